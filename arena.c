@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE	4096
+#define ARENA_ALIGN		16
+#define ALIGN(n)		(((n) + ARENA_ALIGN - 1) & \
+			    ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	struct arena_chunk	*next;	/* Older chunk. */
+	size_t			size;	/* Usable bytes. */
+};
+
+/* The usable bytes start after the aligned chunk header. */
+#define CHUNK_DATA(c)	((char *)(c) + ALIGN(sizeof(struct arena_chunk)))
+
+/*
+ * arena_alloc: Return size bytes, aligned for any type, or NULL if a new
+ * chunk was needed and could not be allocated. Requests larger than a
+ * chunk get a chunk of their own.
+ */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk	*c;
+	size_t			csize;
+	void			*p;
+
+	if (size > SIZE_MAX - 2*ARENA_ALIGN - sizeof(struct arena_chunk))
+		return (NULL);
+	size = ALIGN(size == 0 ? 1 : size);
+	if (a->head == NULL || a->head->size - a->pos < size) {
+		csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		c = malloc(ALIGN(sizeof(struct arena_chunk)) + csize);
+		if (c == NULL)
+			return (NULL);
+		c->size = csize;
+		c->next = a->head;
+		a->head = c;
+		a->pos = 0;
+	}
+	p = CHUNK_DATA(a->head) + a->pos;
+	a->pos += size;
+	return (p);
+}
+
+/* arena_strndup: Like strndup(3), but the copy lives in the arena. */
+char *
+arena_strndup(struct arena *a, const char *s, size_t maxlen)
+{
+	char	*p;
+	size_t	len;
+
+	len = strnlen(s, maxlen);
+	if ((p = arena_alloc(a, len + 1)) == NULL)
+		return (NULL);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return (p);
+}
+
+/*
+ * arena_reset: Release everything allocated from the arena. The oldest
+ * chunk is kept for reuse if it has the standard size, so an arena that
+ * is reset regularly settles down to one allocation.
+ */
+void
+arena_reset(struct arena *a)
+{
+	struct arena_chunk	*c, *next;
+
+	for (c = a->head; c != NULL && c->next != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	if (c != NULL && c->size != ARENA_CHUNK_SIZE) {
+		free(c);
+		c = NULL;
+	}
+	a->head = c;
+	a->pos = 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_ARENA_H
+#define PNP_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator. Allocations are carved out of large chunks and are
+ * never freed one by one; arena_reset() releases all of them at once.
+ * A zeroed struct arena is an empty arena.
+ */
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk	*head;	/* Chunk we are allocating from. */
+	size_t			pos;	/* Bytes used in head. */
+};
+
+void	*arena_alloc(struct arena *, size_t);
+char	*arena_strndup(struct arena *, const char *, size_t);
+void	arena_reset(struct arena *);
+
+#endif
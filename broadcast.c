@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Broadcast of the decoded samples to local listeners, like visualizers or
+ * recorders. broadcast_open() listens on a UNIX socket and creates a PCM
+ * ring; broadcast_tap() has the child copy what a stream decodes into it.
+ * The child never waits for the listeners. Each one has a cursor into
+ * the ring, and broadcast_service() sends it what is new. A listener
+ * that falls half a ring behind skips ahead to the present, so it doesn't
+ * get samples that the child is overwriting. A new listener starts at the
+ * beginning of the track if that is still in the ring.
+ *
+ * A listener first gets a struct pnp_pcm_format, then the samples as they
+ * come. If the format changes, it is disconnected and has to reconnect.
+ *
+ * The child can write all of the ring, so the parent uses its own copy of
+ * the size and never sends what it hasn't copied out and checked first.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pcm.h"
+#include "pnp.h"
+
+#define BROADCAST_LISTENERS	16
+#define BROADCAST_CHUNK		65536	/* Copied out at a time. */
+
+struct listener {
+	int		fd;	/* -1 if the slot is free. */
+	int		hdr_sent;
+	uint64_t	cursor;	/* Byte position in the ring. */
+};
+
+static int	send_samples(struct listener *, uint64_t, size_t);
+static void	skip_ahead(struct listener *, uint64_t, size_t);
+static void	drop_listener(struct listener *);
+
+static struct listener		listeners[BROADCAST_LISTENERS];
+static struct pnp_pcm_format	fmt;
+static struct pcm_ring		*ring;
+static const size_t		ring_size = PCM_RING_SIZE; /* Not ring->size */
+static unsigned char		chunk[BROADCAST_CHUNK];
+static int			ring_fd = -1, listen_fd = -1;
+static char			*sock_path;
+static uint64_t			skips;
+
+/*
+ * broadcast_open: Listen on the UNIX socket at path. A socket that was left
+ * behind there is replaced. Returns 0 on success and -1 on error.
+ */
+int
+broadcast_open(const char *path)
+{
+	struct sockaddr_un	sun;
+	struct stat		sb;
+	int			i;
+
+	if (sock_path != NULL)
+		return (-1);
+	for (i = 0; i < BROADCAST_LISTENERS; i++)
+		listeners[i].fd = -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path))
+	    >= sizeof(sun.sun_path))
+		return (-1);
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode) && unlink(path))
+		return (-1);
+	if ((sock_path = strdup(path)) == NULL
+	    || (ring = pcm_ring_new(&ring_fd, ring_size)) == NULL
+	    || (listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0))
+	    == -1
+	    || bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1
+	    || listen(listen_fd, BROADCAST_LISTENERS) == -1) {
+		broadcast_close();
+		return (-1);
+	}
+	memset(&fmt, 0, sizeof(fmt));
+	skips = 0;
+	return (0);
+}
+
+/*
+ * broadcast_tap: Broadcast what the stream decodes next. Like add_tap(),
+ * this lasts for one file. Returns 0 on success.
+ */
+int
+broadcast_tap(int stream)
+{
+	int	fd;
+
+	if (ring == NULL)
+		return (-1);
+	if ((fd = dup(ring_fd)) == -1)
+		parent_err("dup");
+	return (add_tap(stream, fd, OUT_BROADCAST));
+}
+
+/*
+ * broadcast_service: Take new listeners and send them what the child has
+ * written since. parent_process_events() calls this.
+ */
+void
+broadcast_service(void)
+{
+	struct pnp_pcm_format	cur;
+	struct listener		*l;
+	uint64_t		wpos, start;
+	size_t			framesize;
+	int			i, fd;
+
+	if (listen_fd == -1)
+		return;
+	while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+		for (i = 0; i < BROADCAST_LISTENERS &&
+		    listeners[i].fd != -1; i++)
+			continue;
+		if (i == BROADCAST_LISTENERS
+		    || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			close(fd);
+			continue;
+		}
+		listeners[i].fd = fd;
+		listeners[i].hdr_sent = 0;
+	}
+	cur.rate = ring->rate;
+	cur.channels = ring->channels;
+	cur.bits = ring->bits;
+	if (memcmp(&cur, &fmt, sizeof(fmt)) != 0) {
+		/* Listeners can't tell where the old format ends. */
+		for (i = 0; i < BROADCAST_LISTENERS; i++)
+			if (listeners[i].fd != -1 && listeners[i].hdr_sent)
+				drop_listener(&listeners[i]);
+		fmt = cur;
+	}
+	if (fmt.rate == 0 || (framesize = fmt.channels * (fmt.bits/8)) == 0)
+		return;
+	/* Read the samples only after wpos says they are there. */
+	__sync_synchronize();
+	wpos = ring->wpos;
+	start = ring->fmt_pos;
+	__sync_synchronize();
+	for (i = 0; i < BROADCAST_LISTENERS; i++) {
+		l = &listeners[i];
+		if (l->fd == -1)
+			continue;
+		if (!l->hdr_sent) {
+			if (write(l->fd, &fmt, sizeof(fmt)) != sizeof(fmt)) {
+				drop_listener(l);
+				continue;
+			}
+			l->hdr_sent = 1;
+			/* Start with the track, if it hasn't gone on long. */
+			l->cursor = wpos - start <= ring_size / 2 ? start :
+			    wpos;
+		}
+		if (wpos - l->cursor > ring_size / 2)
+			skip_ahead(l, wpos, framesize);
+		if (send_samples(l, wpos, framesize) == -1)
+			drop_listener(l);
+	}
+}
+
+/*
+ * broadcast_skips: Return how often a listener had to skip ahead since
+ * broadcast_open().
+ */
+uint64_t
+broadcast_skips(void)
+{
+	return (skips);
+}
+
+/* broadcast_close: Disconnect the listeners and remove the socket. */
+void
+broadcast_close(void)
+{
+	int	i;
+
+	if (sock_path == NULL)
+		return;
+	for (i = 0; i < BROADCAST_LISTENERS; i++)
+		if (listeners[i].fd != -1)
+			drop_listener(&listeners[i]);
+	if (listen_fd != -1) {
+		close(listen_fd);
+		unlink(sock_path);
+	}
+	listen_fd = -1;
+	free(sock_path);
+	sock_path = NULL;
+	if (ring != NULL) {
+		pcm_ring_free(ring, ring_size);
+		close(ring_fd);
+	}
+	ring = NULL;
+	ring_fd = -1;
+}
+
+/*
+ * send_samples: Send the listener what it hasn't got up to wpos, as far as
+ * it takes without blocking. Each piece is copied out of the ring first.
+ * If the child has got so far ahead in the meantime that it may have been
+ * writing over the piece, the listener skips ahead instead. Returns -1 if
+ * it has gone away.
+ */
+static int
+send_samples(struct listener *l, uint64_t wpos, size_t framesize)
+{
+	uint64_t	now;
+	size_t		off, len;
+	ssize_t		nw;
+
+	while (l->cursor < wpos) {
+		off = l->cursor % ring_size;
+		len = wpos - l->cursor;
+		if (len > ring_size - off)
+			len = ring_size - off;
+		if (len > sizeof(chunk))
+			len = sizeof(chunk);
+		memcpy(chunk, ring->data + off, len);
+		/* The child's next block may reach half a ring past wpos. */
+		__sync_synchronize();
+		now = ring->wpos;
+		if (now - l->cursor > ring_size / 2) {
+			skip_ahead(l, now, framesize);
+			return (0);
+		}
+		if ((nw = write(l->fd, chunk, len)) == -1)
+			return (errno == EAGAIN || errno == EINTR ? 0 : -1);
+		l->cursor += nw;
+		if ((size_t)nw < len)
+			return (0);
+	}
+	return (0);
+}
+
+/*
+ * skip_ahead: Move a listener that fell behind to wpos, keeping its
+ * position within the sample frame.
+ */
+static void
+skip_ahead(struct listener *l, uint64_t wpos, size_t framesize)
+{
+	l->cursor = wpos - (wpos - l->cursor) % framesize;
+	skips++;
+}
+
+static void
+drop_listener(struct listener *l)
+{
+	close(l->fd);
+	l->fd = -1;
+}
@@ -17,9 +17,13 @@
 #ifndef PNP_CHILD_H
 #define PNP_CHILD_H
 
+#include <sys/types.h>
+
+#include <stdint.h>
 #include <stdio.h>
 
 #include "pnp.h"
+#include "tee.h"
 
 struct input {
 	int	fd;
@@ -27,6 +31,13 @@ struct input {
 	char	*buf;
 	size_t	buf_size, buf_free, read_pos, write_pos;
 	int	eof, error;
+	/*
+	 * A pipe or socket can't seek, so its format is told from the bytes
+	 * in buf once enough have arrived. Until then, sniffing is set and
+	 * skip counts the bytes of an ID3v2 tag that are still to be dropped.
+	 */
+	int	noseek, sniffing;
+	size_t	skip;
 };
 
 /* State for the event handler and player functions. */
@@ -34,11 +45,45 @@ enum {STOPPED, PLAYING, PAUSING, PAUSED, RESUME};
 struct state {
 	int	play;     /* = STOPPED, PLAYING, or PAUSED */
 	int	callback; /* Set to 1 if we are in a callback. */
+	int	running;  /* Set to 1 while a player is running. */
+
+	/* Sample buffer of the running player, NULL if there is none. */
+	struct sample_buf	*sbuf;
 
 	 /* Actions queued up for later. */
 	int	task_new_file, new_fd;
 	int	task_start_play;
+
+	/* IDs of the requests that are answered later. */
+	uint32_t	new_file_id, play_id;
+
+	uint64_t	start_pos; /* Sample the next player starts at. */
 };
 
-void process_events(struct input *, struct out *, struct state *);
+/*
+ * A stream is an input file and the output it is decoded to. The child
+ * works on several streams at once and takes turns between them in its
+ * event loop. Stream 0 uses the output that child_main() was given; the
+ * others get theirs with CMD_NEW_OUTPUT.
+ */
+struct stream {
+	int			id;
+	struct input		in;
+	struct out		out;
+	struct tee		tee;	/* Copies of the output. */
+	struct state		state;
+	void			*dec;	/* Decoder, kept between files. */
+	int			(*step)(struct stream *); /* Of the player. */
+	struct pnp_stats	stats;
+	uint64_t		dec_ns_total, dec_count;
+};
+
+/* Results of a player's step function. */
+enum {PLAY_MORE, PLAY_DONE, PLAY_STOPPED, PLAY_ERROR};
+
+void	process_events(void);
+int	input_seek(struct input *, off_t);
+off_t	input_tell(struct input *);
+size_t	peek_inbuf(struct input *, unsigned char *, size_t);
+size_t	drop_inbuf(struct input *, size_t);
 #endif
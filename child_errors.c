@@ -22,6 +22,29 @@
 
 #include "child_errors.h"
 #include "child_messages.h"
+#include "trace.h"
+
+/*
+ * Error messages are formatted into this buffer instead of being
+ * allocated, so warnings neither leak nor touch the heap. Longer messages
+ * are truncated.
+ */
+#define ERRMSG_SIZE	1024
+static char	errmsg[ERRMSG_SIZE];
+
+static char	*format_err(int, const char *);
+
+static char *
+format_err(int with_errno, const char *message)
+{
+	if (with_errno)
+		(void)snprintf(errmsg, sizeof(errmsg), "%s: %s: %s",
+		    getprogname(), strerror(errno), message);
+	else
+		(void)snprintf(errmsg, sizeof(errmsg), "%s: %s", getprogname(),
+		    message);
+	return (errmsg);
+}
 
 void
 child_warn(const char *message)
@@ -32,34 +55,20 @@ child_warn(const char *message)
 	 * the current errno, plus a message supplied by the caller.
 	 */
 
-	char *full_message;
-	if (asprintf(&full_message, "%s: %s: %s", getprogname(),
-	    strerror(errno), message) == -1) {
-		child_fatal("asprintf");
-	}
-	enqueue_message((u_int32_t)MSG_WARN, full_message);
+	enqueue_message((u_int32_t)MSG_WARN, format_err(1, message));
 }
 
 void
 child_warnx(const char *message)
 {
 	/* Like child_warn, but omit the message associated with errno. */
-	char *full_message;
-	if (asprintf(&full_message, "%s: %s", getprogname(), message) == -1) {
-		child_fatal("asprintf");
-	}
-	enqueue_message((u_int32_t)MSG_WARN, full_message);
+	enqueue_message((u_int32_t)MSG_WARN, format_err(0, message));
 }
 
 void
 file_err(struct input *in, char *message)
 {
-	char *full_message;
-	if (asprintf(&full_message, "%s: %s: %s", getprogname(),
-	    strerror(errno), message) == -1) {
-		ipc_error("asprintf failed.");
-	}
-	enqueue_message((u_int32_t)MSG_FILE_ERR, full_message);
+	enqueue_message((u_int32_t)MSG_FILE_ERR, format_err(1, message));
 	if (in->fd != -1 && close(in->fd) != 0)
 		child_warn("close");
 	in->fd = -1;
@@ -69,11 +78,7 @@ file_err(struct input *in, char *message)
 void
 file_errx(struct input *in, char *message)
 {
-	char *full_message;
-	if (asprintf(&full_message, "%s: %s", getprogname(), message) == -1) {
-		ipc_error("asprintf failed.");
-	}
-	enqueue_message((u_int32_t)MSG_FILE_ERR, full_message);
+	enqueue_message((u_int32_t)MSG_FILE_ERR, format_err(0, message));
 	if (in->fd != -1 && close(in->fd) != 0)
 		child_warn("close");
 	in->fd = -1;
@@ -89,13 +94,9 @@ child_fatal(const char *message)
 	 * message associated with the current errno, plus a message supplied
 	 * by the caller.
 	 */
-	char *full_message;
-	if (asprintf(&full_message, "%s: %s: %s", getprogname(),
-	    strerror(errno), message) == -1) {
-		ipc_error("asprintf failed.");
-	}
-	enqueue_message((u_int32_t)MSG_WARN, full_message);
+	enqueue_message((u_int32_t)MSG_WARN, format_err(1, message));
 	send_messages();
+	TRACE_DUMP();
 	_exit(1);
 }
 
@@ -104,12 +105,9 @@ child_fatalx(const char *message)
 {
 	/* Like child_fatal, but omit the message associated with errno. */
 
-	char *full_message;
-	if (asprintf(&full_message, "%s: %s", getprogname(), message) == -1) {
-		ipc_error("asprintf failed.");
-	}
-	enqueue_message((u_int32_t)MSG_FATAL, full_message);
+	enqueue_message((u_int32_t)MSG_FATAL, format_err(0, message));
 	send_messages();
+	TRACE_DUMP();
 	_exit(1);
 }
 
@@ -36,26 +36,49 @@
 #include "child.h"
 #include "child_errors.h"
 #include "child_messages.h"
+#include "child_stats.h"
 #include "comm.h"
 #include "file.h"
 #include "flac.h"
 #include "message_types.h"
+#include "pcm.h"
 #include "pnp.h"
+#include "tee.h"
+#include "trace.h"
 
-static void	fill_inbuf(struct input *);
+static void	init_stream(struct stream *, int);
+static struct stream	*get_stream(uint32_t);
+static void	handle_command(struct stream *, struct message *);
+static void	start_player(struct stream *);
+static void	end_play_request(struct stream *, int);
+static void	fill_inbuf(struct stream *);
 static void	clear_inbuf(struct input *);
-static void	new_file(int, struct input *);
+static void	sniff_input(struct stream *);
+static void	new_file(int, struct stream *);
+static void	new_output(int, int, struct stream *);
 static int	extract_meta(struct input *);
+static int	scan_input(struct input *);
+static int	extract_picture(struct input *);
+
+/*
+ * pfd[0] is the socket to the parent, pfd[1 + i] the input file of stream
+ * i, and the rest belongs to the sndio device.
+ */
+#define PFD_SIO	(1 + PNP_MAX_STREAMS)
 
 static struct pollfd	*pfd;
 static nfds_t		nfds;
-struct input		*in;
+static struct stream	streams[PNP_MAX_STREAMS];
+
+struct pnp_shared	*child_shared;
 
 int
 child_main(int sv[2], struct out *out)
 {
-	struct state	state;
+	struct stream	*s;
+	int		i, rv;
 
+	TRACE_INIT();
 	if (out->type == OUT_SNDIO && pledge("stdio recvfd audio", NULL) == -1)
 		return (-1);
 	else if (pledge("stdio recvfd", NULL) == -1)
@@ -63,132 +86,333 @@ child_main(int sv[2], struct out *out)
 	close(0);
 	close(1);
 	close(sv[0]);
-	memset(&state, 0, sizeof(state));
 
-	in = malloc(sizeof(struct input));
-	if (in == NULL)
-		child_fatal("malloc");
-	in->fd = -1;
-	in->fmt = UNKNOWN;
-	in->buf = malloc(INBUF_SIZE);
-	if (in->buf == NULL)
-		child_fatal("malloc");
-	in->buf_size = in->buf_free = INBUF_SIZE;
-	in->read_pos = in->write_pos = 0;
-	in->eof = in->error = 0;
+	init_stream(&streams[0], 0);
+	streams[0].out = *out;
+	stats_select(&streams[0]);
 
 	initialize_ipc(sv[1]);
-	nfds = 2 + (out->type == OUT_SNDIO ? sio_nfds(out->handle.sio) : 0);
+	nfds = PFD_SIO + (out->type == OUT_SNDIO ?
+	    sio_nfds(out->handle.sio) : 0);
 	if ((pfd = calloc(nfds, sizeof(struct pollfd))) == NULL)
 		ipc_error("calloc");
 	pfd[0].fd = sv[1];
 	pfd[0].events = POLLIN|POLLOUT;
-	pfd[1].fd = -1;
-	pfd[1].events = POLLIN;
+	for (i = 1; i < PFD_SIO; i++) {
+		pfd[i].fd = -1;
+		pfd[i].events = POLLIN;
+	}
 	if (out->type == OUT_SNDIO) {
-		if (sio_pollfd(out->handle.sio, pfd+2, POLLOUT) == 0)
+		if (sio_pollfd(out->handle.sio, pfd+PFD_SIO, POLLOUT) == 0)
 			ipc_error("sio_pollfd");
 	}
 
+	/* Give every stream a turn. */
 	while (1) {
-		process_events(in, out, &state);
-		if (state.task_start_play) {
-			state.task_start_play = 0;
-			switch (in->fmt) {
-			case (FLAC):
-				play_flac(in, out, &state);
-				break;
-			default:
-				child_warnx("Not implemented.");
+		process_events();
+		for (i = 0; i < PNP_MAX_STREAMS; i++) {
+			s = &streams[i];
+			if (s->in.buf == NULL)
+				continue;
+			stats_select(s);
+			if (s->state.task_start_play && !s->in.sniffing) {
+				s->state.task_start_play = 0;
+				start_player(s);
 			}
+			if (!s->state.running)
+				continue;
+			if ((rv = s->step(s)) != PLAY_MORE)
+				end_play_request(s, rv);
 		}
+		/* Let the parent know where a standby would pick up. */
+		if (child_shared != NULL)
+			child_shared->sample_pos = streams[0].stats.sample_pos;
 	}
 }
 
+/* init_stream: Set up a stream when it is first used. */
+static void
+init_stream(struct stream *s, int id)
+{
+	memset(s, 0, sizeof(*s));
+	s->id = id;
+	s->out.type = NONE;
+	s->in.fd = -1;
+	s->in.fmt = UNKNOWN;
+	s->in.buf = malloc(INBUF_SIZE);
+	if (s->in.buf == NULL)
+		child_fatal("malloc");
+	s->in.buf_size = s->in.buf_free = INBUF_SIZE;
+	s->in.read_pos = s->in.write_pos = 0;
+	s->in.eof = s->in.error = 0;
+	s->state.new_fd = -1;
+}
+
+static struct stream *
+get_stream(uint32_t id)
+{
+	if (id >= PNP_MAX_STREAMS)
+		return (NULL);
+	if (streams[id].in.buf == NULL)
+		init_stream(&streams[id], id);
+	return (&streams[id]);
+}
+
+static void
+start_player(struct stream *s)
+{
+	int	rv;
+
+	if (s->in.fd == -1) {
+		/* Sniffing the input turned up nothing we can play. */
+		child_warnx("No input file");
+		end_play_request(s, PLAY_ERROR);
+		return;
+	}
+	if (s->out.type == NONE) {
+		child_warnx("No output");
+		end_play_request(s, PLAY_ERROR);
+		return;
+	}
+	/* Starting reads from the input, and with it, more commands. */
+	s->state.running = 1;
+	switch (s->in.fmt) {
+	case (FLAC):
+		rv = start_flac(s);
+		s->step = step_flac;
+		break;
+	default:
+		child_warnx("Not implemented.");
+		rv = -1;
+	}
+	s->state.start_pos = 0;
+	if (rv == -1)
+		end_play_request(s, PLAY_ERROR);
+}
+
+/*
+ * end_play_request: Finish the taps and answer the CMD_PLAY that started
+ * the player, so the parent finds the tap files complete. Playback
+ * that was stopped by a new file is only reported to requests with an ID;
+ * callers that don't use IDs would take the reply for one to a later
+ * request.
+ */
+static void
+end_play_request(struct stream *s, int rv)
+{
+	struct state	*state = &s->state;
+
+	tee_finish(&s->tee);
+	state->running = 0;
+	state->play = STOPPED;
+	set_reply_id(state->play_id);
+	if (rv == PLAY_DONE)
+		enqueue_message(MSG_DONE, "");
+	else if (rv == PLAY_ERROR)
+		enqueue_message(MSG_NACK, "");
+	else if (state->play_id != 0)
+		enqueue_message(MSG_NACK, "Stopped");
+	set_reply_id(0);
+	state->play_id = 0;
+}
+
+/*
+ * process_events: Exchange messages with the parent, read from the input
+ * files and check if the sndio device wants more samples. Decoding is left
+ * to the caller, so this can be called from the decoder's callbacks.
+ */
 void
-process_events(struct input *in, struct out *out, struct state *state)
+process_events(void)
 {
-	int		nready;
+	struct message	message;
+	struct stream	*s, *sio = NULL;
+	int		i, nready;
 	int		sio_ev;
 
-	out->ready = 0;
-	if (!state->callback && state->task_new_file) {
-		new_file(state->new_fd, in);
-		state->task_new_file = 0;
-		state->play = STOPPED;
+	for (i = 0; i < PNP_MAX_STREAMS; i++) {
+		s = &streams[i];
+		if (s->in.buf == NULL)
+			continue;
+		if (s->out.type == OUT_SNDIO) {
+			sio = s;
+			s->out.ready = 0;
+		}
+		if (!s->state.callback && s->state.task_new_file) {
+			set_reply_id(s->state.new_file_id);
+			new_file(s->state.new_fd, s);
+			set_reply_id(0);
+			s->state.task_new_file = 0;
+			s->state.new_fd = -1;
+			s->state.play = STOPPED;
+		}
 	}
 
-	if (out->type == OUT_SNDIO) {
-		if (sio_pollfd(out->handle.sio, pfd+2, POLLOUT) == 0)
+	if (sio != NULL) {
+		if (sio_pollfd(sio->out.handle.sio, pfd+PFD_SIO, POLLOUT) == 0)
 			child_fatalx("sio_pollfd: failed");
 	}
 	nready = poll(pfd, nfds, 0);
 	if (nready == -1) {
 		ipc_error("poll");
 	}
+	if (nready > 0) {
+		child_stats->poll_wakeups++;
+		TRACE(TR_PROCESS_EVENTS, nready,
+		    pfd[0].revents | (pfd[1].revents << 16));
+	}
 	if (pfd[0].revents & (POLLIN|POLLHUP))
 		receive_messages();
 	if (pfd[0].revents & POLLOUT)
 		send_messages();
-	if (in->fd == pfd[1].fd && (pfd[1].revents & (POLLIN|POLLHUP))) {
-		fill_inbuf(in);
+	for (i = 0; i < PNP_MAX_STREAMS; i++) {
+		s = &streams[i];
+		if (s->in.buf != NULL && s->in.fd == pfd[1 + i].fd
+		    && (pfd[1 + i].revents & (POLLIN|POLLHUP))) {
+			fill_inbuf(s);
+			if (s->in.sniffing)
+				sniff_input(s);
+		}
 	}
 
-	struct message message;
 	while(get_next_message(&message) == GOT_MESSAGE) {
-		switch (message.type) {
-		case (CMD_NEW_INPUT_FILE):
-			if (state->callback) {
-				state->task_new_file = 1;
-				state->new_fd = message.data.fd;
-			}
-			else {
-				new_file(message.data.fd, in);
-				state->play = STOPPED;
-			}
-			break;
-		case (CMD_META):
-			if (in->fd == -1)
-				enqueue_message(MSG_NACK, "No input file");
-			else
-				extract_meta(in);
-			break;
-		case (CMD_PLAY):
-			if (in->fd == -1)
-				file_errx(in, "No input file");
-			else if (state->play == PAUSED)
-				state->play = RESUME;
-			else if (state->play == PAUSING)
-				state->play = PLAYING;
-			else
-				state->task_start_play = 1;
-			break;
-		case (CMD_PAUSE):
-			state->play = PAUSING;
-			break;
-		case (CMD_EXIT):
-			_exit(0);
-		default:
-			child_fatalx("Unexpected or invalid message type.");
+		/* Everything we send now answers this message. */
+		set_reply_id(message.id);
+		if ((s = get_stream(message.stream)) == NULL) {
+			if (message.data.fd != -1 && close(message.data.fd))
+				child_warn("close");
+			enqueue_message(MSG_NACK, "No such stream");
+			continue;
 		}
+		handle_command(s, &message);
 	}
-	if (state->play == PLAYING && out->type == OUT_SNDIO) {
-		sio_ev = sio_revents(out->handle.sio, pfd+2);
+	set_reply_id(0);
+	if (sio != NULL && sio->state.play == PLAYING) {
+		sio_ev = sio_revents(sio->out.handle.sio, pfd+PFD_SIO);
 		if (sio_ev & POLLHUP)
 			child_fatalx("sndio device gone");
 		if (sio_ev & POLLOUT)
-			out->ready = 1;
+			sio->out.ready = 1;
 	}
 	/*
-	 * Update pfd[1].fd in case a new input file was supplied
+	 * Update the input fds in case a new input file was supplied
 	 * or file_err() was called.
 	 */
-	pfd[1].fd = in->fd;
+	for (i = 0; i < PNP_MAX_STREAMS; i++)
+		pfd[1 + i].fd = streams[i].in.buf != NULL ?
+		    streams[i].in.fd : -1;
 }
 
 static void
-fill_inbuf(struct input *in)
+handle_command(struct stream *s, struct message *message)
 {
+	struct input	*in = &s->in;
+	struct state	*state = &s->state;
+
+	switch (message->type) {
+	case (CMD_NEW_INPUT_FILE):
+		if (state->callback && state->task_new_file) {
+			/* Superseded before we got to it. */
+			if (state->new_fd != -1 && close(state->new_fd))
+				child_warn("close");
+			set_reply_id(state->new_file_id);
+			enqueue_message(MSG_NACK, "Superseded");
+			set_reply_id(message->id);
+		}
+		if (state->callback) {
+			state->task_new_file = 1;
+			state->new_fd = message->data.fd;
+			state->new_file_id = message->id;
+		}
+		else {
+			if (in->sniffing) {
+				/* Its format wasn't known yet. */
+				set_reply_id(state->new_file_id);
+				enqueue_message(MSG_NACK, "Superseded");
+				set_reply_id(message->id);
+			}
+			state->new_file_id = message->id;
+			new_file(message->data.fd, s);
+			state->play = STOPPED;
+		}
+		break;
+	case (CMD_NEW_OUTPUT):
+		new_output(message->data.fd, message->out_type, s);
+		break;
+	case (CMD_ADD_TAP):
+		if (state->running || state->task_start_play) {
+			if (message->data.fd != -1 && close(message->data.fd))
+				child_warn("close");
+			enqueue_message(MSG_NACK, "Already playing");
+		}
+		else if (message->data.fd == -1 || tee_add(&s->tee,
+		    message->data.fd, message->out_type) == -1)
+			enqueue_message(MSG_NACK, "Can't add output");
+		else
+			enqueue_message(MSG_ACK, "");
+		break;
+	case (CMD_META):
+		if (in->fd == -1)
+			enqueue_message(MSG_NACK, "No input file");
+		else if (in->noseek)
+			enqueue_message(MSG_NACK, "Input can't seek");
+		else
+			extract_meta(in);
+		break;
+	case (CMD_SCAN):
+		if (in->fd == -1)
+			enqueue_message(MSG_NACK, "No input file");
+		else if (in->noseek)
+			enqueue_message(MSG_NACK, "Input can't seek");
+		else
+			scan_input(in);
+		break;
+	case (CMD_PICTURE):
+		if (in->fd == -1)
+			enqueue_message(MSG_NACK, "No input file");
+		else if (in->noseek)
+			enqueue_message(MSG_NACK, "Input can't seek");
+		else
+			extract_picture(in);
+		break;
+	case (CMD_PLAY):
+		if (in->fd == -1) {
+			file_errx(in, "No input file");
+			enqueue_message(MSG_NACK, "");
+		}
+		else if (state->running && state->play == PAUSED)
+			state->play = RESUME;
+		else if (state->running && state->play == PAUSING)
+			state->play = PLAYING;
+		else if (state->running || state->task_start_play)
+			enqueue_message(MSG_NACK, "Already playing");
+		else {
+			state->task_start_play = 1;
+			state->play_id = message->id;
+			state->start_pos = message->pos;
+		}
+		break;
+	case (CMD_PAUSE):
+		if (state->running)
+			state->play = PAUSING;
+		break;
+	case (CMD_STATS):
+		send_stats(s);
+		break;
+	case (CMD_TRACE_DUMP):
+		TRACE_DUMP();
+		break;
+	case (CMD_EXIT):
+		TRACE_DUMP();
+		_exit(0);
+	default:
+		child_fatalx("Unexpected or invalid message type.");
+	}
+}
+
+static void
+fill_inbuf(struct stream *s)
+{
+	struct input	*in = &s->in;
 	struct iovec	iov[2];
 	size_t		nbytes;
 	size_t		r_pos = in->read_pos;
@@ -220,6 +444,8 @@ fill_inbuf(struct input *in)
 		return;
 	}
 	in->buf_free -= nbytes;
+	s->stats.bytes_read += nbytes;
+	TRACE(TR_FILL_INBUF, nbytes, in->buf_free);
 	in->write_pos = (w_pos + nbytes) % size;
 }
 
@@ -231,9 +457,105 @@ clear_inbuf(struct input *in)
 	in->buf_free = in->buf_size;
 }
 
+/* peek_inbuf: Copy up to n buffered bytes to dst without consuming them. */
+size_t
+peek_inbuf(struct input *in, unsigned char *dst, size_t n)
+{
+	size_t	avail = in->buf_size - in->buf_free;
+	size_t	first;
+
+	if (n > avail)
+		n = avail;
+	first = in->buf_size - in->read_pos;
+	if (first > n)
+		first = n;
+	memcpy(dst, in->buf + in->read_pos, first);
+	memcpy(dst + first, in->buf, n - first);
+	return (n);
+}
+
+/* drop_inbuf: Throw away up to n buffered bytes; return how many. */
+size_t
+drop_inbuf(struct input *in, size_t n)
+{
+	size_t	avail = in->buf_size - in->buf_free;
+
+	if (n > avail)
+		n = avail;
+	in->read_pos = (in->read_pos + n) % in->buf_size;
+	in->buf_free += n;
+	return (n);
+}
+
+/*
+ * sniff_input: Tell the format of an input that can't seek from what has
+ * been read of it and answer its CMD_NEW_INPUT_FILE. An ID3v2 tag is
+ * dropped on the way, since the decoders would choke on it.
+ */
 static void
-new_file(int fd, struct input *in)
+sniff_input(struct stream *s)
 {
+	struct input	*in = &s->in;
+	unsigned char	hdr[FILETYPE_PROBE_LEN];
+	size_t		n = 0;
+
+	while (in->fd != -1) {
+		in->skip -= drop_inbuf(in, in->skip);
+		if (in->skip > 0 && !in->eof)
+			return;
+		n = peek_inbuf(in, hdr, sizeof(hdr));
+		if (n < sizeof(hdr) && !in->eof)
+			return;
+		if (in->skip > 0 || n < ID3_HDR_LEN ||
+		    (in->skip = id3v2_size(hdr)) == 0)
+			break;
+	}
+	in->sniffing = 0;
+	set_reply_id(s->state.new_file_id);
+	if (in->fd == -1)
+		/* file_err() already told the parent. */
+		enqueue_message(MSG_NACK, "");
+	else if ((in->fmt = header_type(hdr, n)) == UNKNOWN) {
+		enqueue_message(MSG_NACK, "");
+		if (close(in->fd) != 0)
+			child_warn("close");
+		in->fd = -1;
+		clear_inbuf(in);
+	}
+	else
+		enqueue_message(MSG_ACK, "");
+	set_reply_id(0);
+}
+
+/*
+ * input_seek: Continue reading the input at offset and throw away what was
+ * buffered. Returns -1 if the file can't seek.
+ */
+int
+input_seek(struct input *in, off_t offset)
+{
+	if (in->fd == -1 || lseek(in->fd, offset, SEEK_SET) == -1)
+		return (-1);
+	clear_inbuf(in);
+	return (0);
+}
+
+/* input_tell: Return the offset of the next byte read_cb() hands out. */
+off_t
+input_tell(struct input *in)
+{
+	off_t	pos;
+
+	if (in->fd == -1 || (pos = lseek(in->fd, 0, SEEK_CUR)) == -1)
+		return (-1);
+	return (pos - (off_t)(in->buf_size - in->buf_free));
+}
+
+static void
+new_file(int fd, struct stream *s)
+{
+	struct input	*in = &s->in;
+
 	/* Close the old file (if there was one). */
 	if (in->fd != -1) {
 		if (close(in->fd) != 0)
@@ -244,9 +566,21 @@ new_file(int fd, struct input *in)
 	}
 	/* Set the new one. */
 	in->fd = fd;
+	in->noseek = in->sniffing = 0;
+	in->skip = 0;
+	stats_reset(s);
+	/* Whatever was parsed from the old file's tags is gone now. */
+	arena_reset(&meta_arena);
+	if (fd != -1 && lseek(fd, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+		/* sniff_input() answers once enough has been read. */
+		in->noseek = in->sniffing = 1;
+		return;
+	}
 	/* Determine the file format. */
-	if ((in->fmt = filetype(in->fd)) == -1)
+	if ((in->fmt = filetype(in->fd)) == -1) {
 		file_err(in, "read");
+		enqueue_message(MSG_NACK, "");
+	}
 	else if (in->fmt == UNKNOWN) {
 		enqueue_message(MSG_NACK, "");
 		if (in->fd != -1 && close(in->fd) != 0)
@@ -258,6 +592,52 @@ new_file(int fd, struct input *in)
 		enqueue_message(MSG_ACK, "");
 }
 
+/*
+ * new_output: Decode to fd from now on. Only streams without a sndio device
+ * can change their output, and not while they are playing.
+ */
+static void
+new_output(int fd, int type, struct stream *s)
+{
+	FILE		*fp = NULL;
+	struct pcm_ring	*ring = NULL;
+
+	if (s->out.type == OUT_SNDIO || s->state.running
+	    || (type != OUT_WAV_FILE && type != OUT_RAW && type != OUT_NULL
+	    && type != OUT_PCM && type != OUT_VERIFY)) {
+		if (fd != -1 && close(fd))
+			child_warn("close");
+		enqueue_message(MSG_NACK, "Can't change output");
+		return;
+	}
+	if (type == OUT_PCM) {
+		if (fd == -1 || (ring = pcm_ring_map(fd)) == NULL) {
+			enqueue_message(MSG_NACK, "Bad PCM buffer");
+			return;
+		}
+	}
+	else if (type != OUT_NULL && type != OUT_VERIFY
+	    && (fd == -1 || (fp = fdopen(fd, "w")) == NULL)) {
+		if (fd != -1 && close(fd))
+			child_warn("close");
+		enqueue_message(MSG_NACK, "Bad output file");
+		return;
+	}
+	if ((type == OUT_NULL || type == OUT_VERIFY) && fd != -1 && close(fd))
+		child_warn("close");
+	if ((s->out.type == OUT_WAV_FILE || s->out.type == OUT_RAW)
+	    && s->out.handle.fp != NULL && fclose(s->out.handle.fp))
+		child_warn("fclose");
+	if (s->out.type == OUT_PCM)
+		pcm_ring_free(s->out.handle.pcm, s->out.handle.pcm->size);
+	s->out.type = type;
+	if (type == OUT_PCM)
+		s->out.handle.pcm = ring;
+	else
+		s->out.handle.fp = fp;
+	enqueue_message(MSG_ACK, "");
+}
+
 static int
 extract_meta(struct input *in)
 {
@@ -270,8 +650,61 @@ extract_meta(struct input *in)
 	default:
 		rv = -1;
 	}
-	if (rv == -1)
+	if (rv == -1) {
+		enqueue_message(MSG_NACK, "");
+		return (-1);
+	}
+	enqueue_message(MSG_DONE, "");
+	return (rv);
+}
+
+/*
+ * scan_input: Reply to CMD_SCAN with MSG_VERIFY, followed by MSG_DONE; or
+ * with MSG_NACK if the file can't be scanned.
+ */
+static int
+scan_input(struct input *in)
+{
+	struct pnp_verify	v;
+	int			rv;
+
+	switch (in->fmt) {
+	case (FLAC):
+		rv = scan_flac(in, &v);
+		break;
+	default:
+		child_warnx("Not implemented.");
+		rv = -1;
+	}
+	if (rv == -1) {
+		enqueue_message(MSG_NACK, "");
+		return (-1);
+	}
+	enqueue_binary_message(MSG_VERIFY, &v, sizeof(v));
+	enqueue_message(MSG_DONE, "");
+	return (rv);
+}
+
+/*
+ * extract_picture: Reply to CMD_PICTURE with MSG_PICTURE if there is a
+ * picture, followed by MSG_DONE; or with MSG_NACK on failure.
+ */
+static int
+extract_picture(struct input *in)
+{
+	int	rv;
+
+	switch (in->fmt) {
+	case (FLAC):
+		rv = extract_picture_flac(in);
+		break;
+	default:
+		rv = -1;
+	}
+	if (rv == -1) {
+		enqueue_message(MSG_NACK, "");
 		return (-1);
+	}
 	enqueue_message(MSG_DONE, "");
 	return (rv);
 }
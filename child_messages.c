@@ -33,6 +33,7 @@
 #define IMSG_MAX_MESSAGE_LENGTH		(UINT16_MAX)
 
 static struct imsgbuf	ibuf;
+static uint32_t		reply_id; /* peerid of outgoing messages. */
 
 static int is_invalid_message_type(MESSAGE_TYPE);
 
@@ -46,6 +47,16 @@ initialize_ipc(int fd)
 	imsg_init(&ibuf, fd);
 }
 
+void
+set_reply_id(uint32_t id)
+{
+	/*
+	 * Messages enqueued from now on answer the request with this ID. 0
+	 * means that they don't answer any particular request.
+	 */
+	reply_id = id;
+}
+
 void
 send_messages(void)
 {
@@ -98,11 +109,30 @@ enqueue_message(MESSAGE_TYPE type, char *message)
 	 * Enqueue the message. Casting message_length to uint16_t is ok
 	 * because it can't be larger after truncation.
 	 */
-	if (imsg_compose(&ibuf, (uint32_t)type, 0, getpid(), -1, message,
+	if (imsg_compose(&ibuf, (uint32_t)type, reply_id, getpid(), -1, message,
 	    (uint16_t)message_length) == IMSG_FAILURE)
 		ipc_error("Error in imsg_compose.");
 }
 
+void
+enqueue_binary_message(MESSAGE_TYPE type, const void *data, size_t len)
+{
+	/*
+	 * Enqueue a message carrying binary data. Unlike strings, binary data
+	 * can't be truncated, so a message that is too long is a bug.
+	 */
+
+	if (is_invalid_message_type(type)) {
+		child_fatalx("Invalid MESSAGE_TYPE in enqueue_binary_message.");
+	}
+	if (IMSG_MAX_MESSAGE_LENGTH < len) {
+		child_fatalx("Message too long in enqueue_binary_message.");
+	}
+	if (imsg_compose(&ibuf, (uint32_t)type, reply_id, getpid(), -1, data,
+	    (uint16_t)len) == IMSG_FAILURE)
+		ipc_error("Error in imsg_compose.");
+}
+
 GET_NEXT_MESSAGE_STATUS
 get_next_message(struct message *message)
 {
@@ -111,6 +141,7 @@ get_next_message(struct message *message)
 	 * there are none.
 	 */
 	struct imsg imessage;
+	struct stream_cmd cmd;
 	ssize_t imsg_get_status;
 	imsg_get_status = imsg_get(&ibuf, &imessage);
 	if (imsg_get_status == IMSG_FAILURE) {
@@ -123,8 +154,19 @@ get_next_message(struct message *message)
 	 * Check if the message type is valid and extract additional data if
 	 * applicable.
 	 */
+	message->id = imessage.hdr.peerid;
+	message->stream = message->out_type = 0;
+	message->pos = 0;
+	if (imessage.hdr.len - IMSG_HEADER_SIZE == sizeof(struct stream_cmd)) {
+		memcpy(&cmd, imessage.data, sizeof(cmd));
+		message->stream = cmd.stream;
+		message->out_type = cmd.out_type;
+		message->pos = cmd.pos;
+	}
 	switch (imessage.hdr.type) {
 	case (CMD_NEW_INPUT_FILE):
+	case (CMD_NEW_OUTPUT):
+	case (CMD_ADD_TAP):
 		message->type = imessage.hdr.type;
 		message->data.fd = imessage.fd;
 		break;
@@ -132,6 +174,9 @@ get_next_message(struct message *message)
 	case (CMD_META):
 	case (CMD_PLAY):
 	case (CMD_PAUSE):
+	case (CMD_STATS):
+	case (CMD_TRACE_DUMP):
+	case (CMD_PICTURE):
 		message->type = imessage.hdr.type;
 		/* Set message->data to a dummy value. */
 		message->data.fd = -1;
@@ -17,6 +17,8 @@
 #ifndef PNP_CHILD_MESSAGES_H
 #define PNP_CHILD_MESSAGES_H
 
+#include <stdint.h>
+
 #include "message_types.h"
 
 typedef enum {
@@ -31,12 +33,18 @@ union message_data {
 struct message {
 	CMD_MESSAGE_TYPE		type;
 	union message_data		data;
+	uint32_t			id; /* Request ID, or 0. */
+	uint32_t			stream, out_type;
+	uint64_t			pos;
 };
 
 void			initialize_ipc(int);
+void			set_reply_id(uint32_t);
 void			send_messages(void);
 void			receive_messages(void);
 void			enqueue_message(MESSAGE_TYPE, char *);
+void			enqueue_binary_message(MESSAGE_TYPE, const void *,
+			    size_t);
 GET_NEXT_MESSAGE_STATUS	get_next_message(struct message *);
 
 #endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <imsg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "child.h"
+#include "child_messages.h"
+#include "child_stats.h"
+#include "out_sndio.h"
+
+struct pnp_stats	*child_stats;
+
+static struct stream	*cur;
+
+void
+stats_select(struct stream *s)
+{
+	/* Called before working on a stream. */
+	cur = s;
+	child_stats = &s->stats;
+}
+
+void
+stats_reset(struct stream *s)
+{
+	/* Called when a new input file is opened. */
+	memset(&s->stats, 0, sizeof(s->stats));
+	s->dec_ns_total = s->dec_count = 0;
+}
+
+void
+stats_decode_time(const struct timespec *start, const struct timespec *end)
+{
+	uint64_t	ns;
+
+	ns = (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000 +
+	    end->tv_nsec - start->tv_nsec;
+	if (cur->dec_count == 0 || ns < cur->stats.dec_ns_min)
+		cur->stats.dec_ns_min = ns;
+	if (ns > cur->stats.dec_ns_max)
+		cur->stats.dec_ns_max = ns;
+	cur->dec_ns_total += ns;
+	cur->dec_count++;
+}
+
+void
+send_stats(struct stream *s)
+{
+	struct pnp_stats	*stats = &s->stats;
+	struct timespec		cpu;
+
+	/*
+	 * Fill in the values that are cheaper to compute on demand and send
+	 * the snapshot to the parent. The CPU time is for the whole child.
+	 */
+	stats->dec_ns_avg = s->dec_count ? s->dec_ns_total/s->dec_count : 0;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu) == 0)
+		stats->cpu_ns = (uint64_t)cpu.tv_sec * 1000000000 +
+		    cpu.tv_nsec;
+	stats->inbuf_size = s->in.buf_size;
+	stats->inbuf_fill = s->in.buf_size - s->in.buf_free;
+	if (s->state.sbuf != NULL) {
+		stats->sbuf_size = s->state.sbuf->size;
+		stats->sbuf_fill = s->state.sbuf->size - s->state.sbuf->free;
+	}
+	else
+		stats->sbuf_size = stats->sbuf_fill = 0;
+	enqueue_binary_message(MSG_STATS, stats, sizeof(*stats));
+}
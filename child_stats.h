@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_CHILD_STATS_H
+#define PNP_CHILD_STATS_H
+
+#include <time.h>
+
+#include "child.h"
+#include "out_sndio.h"
+
+/*
+ * The counters of the stream that is being worked on. They are updated
+ * directly by the code that does the work. The fill levels and the average
+ * decode time are only filled in by send_stats().
+ */
+extern struct pnp_stats	*child_stats;
+
+void	stats_select(struct stream *);
+void	stats_reset(struct stream *);
+void	stats_decode_time(const struct timespec *, const struct timespec *);
+void	send_stats(struct stream *);
+
+#endif
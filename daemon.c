@@ -0,0 +1,945 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * pnp -D: Accept jobs from clients on a UNIX socket and hand them to a pool
+ * of pledged children. The children run child_main() like the one of a
+ * normal pnp process, and the daemon talks to them in the same way as
+ * parent_main.c does. A worker does one job at a time and is replaced
+ * after max_jobs jobs, or when it dies. See daemon.h for the protocol.
+ *
+ * pnp -t uses the same workers to verify files named on the command line,
+ * without a socket; see pnpd_verify().
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "message_types.h"
+#include "pnp.h"
+
+#define MAX_CLIENTS	64
+
+struct client;
+
+struct job {
+	TAILQ_ENTRY(job)	entry;
+	struct client		*client;	/* NULL once it is gone. */
+	uint32_t		id;
+	int			type;
+	int			in_fd, out_fd;
+	uint32_t		out_type;
+	int			failed;
+	char			*path;		/* For pnp -t, */
+	char			*error;		/* with the first JOB_ERROR */
+	struct pnp_verify	verify;		/* and the JOB_VERIFIED. */
+	int			verified;
+};
+TAILQ_HEAD(job_queue, job);
+
+struct worker {
+	pid_t		pid;
+	struct imsgbuf	ibuf;
+	struct job	*job;		/* NULL if idle. */
+	uint32_t	next_id;
+	uint32_t	last_id;	/* Its reply ends the job. */
+	int		njobs;
+};
+
+struct client {
+	struct imsgbuf	ibuf;
+	int		out_fd;		/* From JOB_OUTPUT, for the */
+	uint32_t	out_id;		/* JOB_DECODE with this ID. */
+	uint32_t	out_type;
+};
+
+static void	signal_handler(int);
+static void	worker_pollfd(struct pollfd *);
+static void	worker_events(struct pollfd *);
+static void	spawn_worker(struct worker *);
+static void	stop_worker(struct worker *);
+static void	worker_died(struct worker *);
+static void	worker_cmd(struct worker *, int, int,
+		    const struct stream_cmd *);
+static void	worker_read(struct worker *);
+static void	worker_msg(struct worker *, struct imsg *);
+static void	start_job(struct worker *, struct job *);
+static void	end_job(struct worker *, int);
+static void	job_error(struct job *, const void *, size_t);
+static void	job_close_fds(struct job *);
+static void	free_job(struct job *);
+static void	dispatch(void);
+static void	new_client(void);
+static void	client_read(int);
+static void	client_msg(struct client *, struct imsg *);
+static void	client_gone(int);
+static void	to_client(struct client *, int, uint32_t, const void *,
+		    size_t);
+static void	send_result(struct client *, uint32_t, pid_t, int32_t);
+static FILE	*open_results(const char *);
+static int	cmp_path(const void *, const void *);
+static char	*next_path(void);
+static int	queued_jobs(void);
+static void	queue_verify(const char *);
+static void	local_result(struct job *);
+static void	print_result(const char *, const struct pnp_verify *);
+
+static struct worker	*workers;
+static int		nworkers, max_jobs, listen_fd = -1;
+static struct client	*clients[MAX_CLIENTS];
+static struct job_queue	queue = TAILQ_HEAD_INITIALIZER(queue);
+static volatile sig_atomic_t	quit;
+
+/* State of pnp -t. */
+static FILE		*results;
+static int		check_type;	/* JOB_VERIFY or JOB_SCAN */
+static char		**arg_paths;	/* Or standard input if none. */
+static int		narg_paths, next_arg;
+static char		**done_paths;	/* Sorted, from the results file. */
+static size_t		ndone;
+static uint64_t		nok, nunsigned, ncorrupt, nerrors, nskipped;
+
+int
+pnpd_main(const char *path, int n, int jobs)
+{
+	struct sockaddr_un	sun;
+	struct stat		sb;
+	struct pollfd		*pfd;
+	struct client		*c;
+	nfds_t			npfd;
+	int			i;
+
+	nworkers = n;
+	max_jobs = jobs;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path))
+	    >= sizeof(sun.sun_path))
+		errx(1, "socket path too long");
+	/* Replace a socket that was left behind, but nothing else. */
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode) && unlink(path))
+		err(1, "unlink");
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "bind");
+	if (listen(listen_fd, MAX_CLIENTS) == -1)
+		err(1, "listen");
+
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR
+	    || signal(SIGHUP, signal_handler) == SIG_ERR
+	    || signal(SIGINT, signal_handler) == SIG_ERR
+	    || signal(SIGTERM, signal_handler) == SIG_ERR)
+		err(1, "signal");
+	if ((workers = calloc(nworkers, sizeof(struct worker))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nworkers; i++)
+		spawn_worker(&workers[i]);
+	if (pledge("stdio cpath unix sendfd recvfd proc", NULL) == -1)
+		err(1, "pledge");
+
+	/* pfd[0] is the socket, then come the clients and the workers. */
+	npfd = 1 + MAX_CLIENTS + nworkers;
+	if ((pfd = calloc(npfd, sizeof(struct pollfd))) == NULL)
+		err(1, "calloc");
+	while (!quit) {
+		dispatch();
+		pfd[0].fd = listen_fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			c = clients[i];
+			pfd[1 + i].fd = c != NULL ? c->ibuf.fd : -1;
+			pfd[1 + i].events = POLLIN;
+			if (c != NULL && c->ibuf.w.queued)
+				pfd[1 + i].events |= POLLOUT;
+		}
+		worker_pollfd(pfd + 1 + MAX_CLIENTS);
+		if (poll(pfd, npfd, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if (pfd[0].revents & POLLIN)
+			new_client();
+		worker_events(pfd + 1 + MAX_CLIENTS);
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			if (clients[i] == NULL || pfd[1 + i].fd == -1)
+				continue;
+			if (pfd[1 + i].revents & POLLOUT
+			    && msgbuf_write(&clients[i]->ibuf.w) <= 0
+			    && errno != EAGAIN)
+				client_gone(i);
+			else if (pfd[1 + i].revents & (POLLIN|POLLHUP))
+				client_read(i);
+		}
+	}
+
+	for (i = 0; i < nworkers; i++)
+		stop_worker(&workers[i]);
+	if (unlink(path))
+		warn("unlink");
+	return (0);
+}
+
+/*
+ * pnpd_verify: pnp -t. Check the files, or those named on standard input,
+ * one per line, with n workers; type is JOB_VERIFY to decode them, or
+ * JOB_SCAN to only check the frame CRCs. Each file gets a line in the
+ * results file, or on standard output, with these fields between tabs:
+ *
+ *	status crc_errors sync_errors md5 samples/expected path
+ *
+ * status is ok, unsigned, corrupt or error, and md5 is match, mismatch,
+ * none or unchecked. Files that an existing results file has a verdict for
+ * are skipped, so an interrupted run picks up where it stopped; a full
+ * check doesn't take the verdict of a scan. Returns 0 if the files checked
+ * in this run are fine.
+ */
+int
+pnpd_verify(char **files, int nfiles, int n, int jobs, int type,
+    const char *path)
+{
+	struct pollfd	*pfd;
+	char		*next;
+	int		i, busy;
+
+	nworkers = n;
+	max_jobs = jobs;
+	arg_paths = files;
+	narg_paths = nfiles;
+	check_type = type;
+	results = open_results(path);
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR
+	    || signal(SIGHUP, signal_handler) == SIG_ERR
+	    || signal(SIGINT, signal_handler) == SIG_ERR
+	    || signal(SIGTERM, signal_handler) == SIG_ERR)
+		err(1, "signal");
+	if ((workers = calloc(nworkers, sizeof(struct worker))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nworkers; i++)
+		spawn_worker(&workers[i]);
+	if (pledge("stdio rpath sendfd proc", NULL) == -1)
+		err(1, "pledge");
+
+	if ((pfd = calloc(nworkers, sizeof(struct pollfd))) == NULL)
+		err(1, "calloc");
+	next = next_path();
+	while (!quit) {
+		/* Open the files as the workers get to them. */
+		while (next != NULL && queued_jobs() < nworkers) {
+			queue_verify(next);
+			next = next_path();
+		}
+		dispatch();
+		for (busy = 0, i = 0; i < nworkers; i++) {
+			if (workers[i].job != NULL)
+				busy = 1;
+		}
+		if (!busy && next == NULL && TAILQ_EMPTY(&queue))
+			break;
+		worker_pollfd(pfd);
+		if (poll(pfd, nworkers, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		worker_events(pfd);
+	}
+
+	for (i = 0; i < nworkers; i++)
+		stop_worker(&workers[i]);
+	if (quit)
+		warnx("interrupted; run again with the same results file to "
+		    "resume");
+	fprintf(stderr, "%llu ok, %llu unsigned, %llu corrupt, %llu errors",
+	    (unsigned long long)nok, (unsigned long long)nunsigned,
+	    (unsigned long long)ncorrupt, (unsigned long long)nerrors);
+	if (nskipped > 0)
+		fprintf(stderr, ", %llu done before",
+		    (unsigned long long)nskipped);
+	fprintf(stderr, "\n");
+	if (results != stdout && fclose(results) == EOF)
+		err(1, "%s", path);
+	return (quit || ncorrupt > 0 || nerrors > 0 ? 1 : 0);
+}
+
+static void
+signal_handler(int s)
+{
+	quit = s;
+}
+
+/* worker_pollfd: Fill in a pollfd for each worker. */
+static void
+worker_pollfd(struct pollfd *pfd)
+{
+	int	i;
+
+	for (i = 0; i < nworkers; i++) {
+		pfd[i].fd = workers[i].ibuf.fd;
+		pfd[i].events = POLLIN;
+		if (workers[i].ibuf.w.queued)
+			pfd[i].events |= POLLOUT;
+	}
+}
+
+/* worker_events: Handle what poll(2) found for the workers. */
+static void
+worker_events(struct pollfd *pfd)
+{
+	int	i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (pfd[i].revents & POLLOUT
+		    && imsg_flush(&workers[i].ibuf) == -1)
+			worker_died(&workers[i]);
+		else if (pfd[i].revents & (POLLIN|POLLHUP))
+			worker_read(&workers[i]);
+	}
+}
+
+static void
+spawn_worker(struct worker *w)
+{
+	struct out	out;
+	struct job	*job;
+	int		i, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	switch (w->pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Don't keep anything of the daemon's around. */
+		signal(SIGHUP, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		close(listen_fd);
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			if (clients[i] == NULL)
+				continue;
+			imsg_clear(&clients[i]->ibuf);
+			close(clients[i]->ibuf.fd);
+			if (clients[i]->out_fd != -1)
+				close(clients[i]->out_fd);
+		}
+		for (i = 0; i < nworkers; i++) {
+			if (&workers[i] == w || workers[i].pid <= 0)
+				continue;
+			/* This closes the fds of jobs not yet sent. */
+			imsg_clear(&workers[i].ibuf);
+			close(workers[i].ibuf.fd);
+			if (workers[i].job != NULL)
+				job_close_fds(workers[i].job);
+		}
+		TAILQ_FOREACH(job, &queue, entry)
+			job_close_fds(job);
+		if (results != NULL && results != stdout)
+			close(fileno(results));
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+		_exit(1);
+	}
+	if (close(sv[1]))
+		err(1, "close");
+	imsg_init(&w->ibuf, sv[0]);
+	w->job = NULL;
+	w->next_id = 1;
+	w->last_id = 0;
+	w->njobs = 0;
+}
+
+static void
+stop_worker(struct worker *w)
+{
+	int	status;
+
+	if (imsg_compose(&w->ibuf, CMD_EXIT, 0, getpid(), -1, NULL, 0) == -1
+	    || imsg_flush(&w->ibuf) == -1)
+		kill(w->pid, SIGTERM);
+	imsg_clear(&w->ibuf);
+	close(w->ibuf.fd);
+	while (waitpid(w->pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			warn("waitpid");
+			break;
+		}
+	}
+	w->pid = -1;
+}
+
+/* worker_died: Fail the worker's job and start a new one in its place. */
+static void
+worker_died(struct worker *w)
+{
+	static const char	msg[] = "worker died";
+	struct job		*job = w->job;
+	int32_t			status = 1;
+
+	warnx("worker %ld died", (long)w->pid);
+	if (job != NULL) {
+		job_error(job, msg, sizeof(msg));
+		send_result(job->client, job->id, w->pid, status);
+		if (job->path != NULL)
+			local_result(job);
+		free_job(job);
+		w->job = NULL;
+	}
+	kill(w->pid, SIGKILL);
+	stop_worker(w);
+	spawn_worker(w);
+}
+
+/* worker_cmd: Send a command; its reply is the one that ends the job. */
+static void
+worker_cmd(struct worker *w, int type, int fd, const struct stream_cmd *cmd)
+{
+	w->last_id = w->next_id++;
+	if (w->next_id == 0)
+		w->next_id = 1;
+	if (imsg_compose(&w->ibuf, (uint32_t)type, w->last_id, getpid(), fd,
+	    cmd, cmd != NULL ? sizeof(*cmd) : 0) == -1)
+		err(1, "imsg_compose");
+}
+
+static void
+worker_read(struct worker *w)
+{
+	struct imsg	imsg;
+	ssize_t		n;
+
+	if ((n = imsg_read(&w->ibuf)) == -1 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		worker_died(w);
+		return;
+	}
+	while ((n = imsg_get(&w->ibuf, &imsg)) > 0) {
+		worker_msg(w, &imsg);
+		imsg_free(&imsg);
+	}
+	if (n == -1)
+		worker_died(w);
+}
+
+static void
+worker_msg(struct worker *w, struct imsg *imsg)
+{
+	struct job	*job = w->job;
+	size_t		len = imsg->hdr.len - IMSG_HEADER_SIZE;
+
+	if (job == NULL)
+		return;
+	switch (imsg->hdr.type) {
+	case (MSG_WARN):
+	case (MSG_FATAL):
+	case (MSG_FILE_ERR):
+		job_error(job, imsg->data, len);
+		return;
+	}
+	/* Earlier commands of the job only count if they fail. */
+	if (imsg->hdr.peerid != w->last_id) {
+		if (imsg->hdr.type == MSG_NACK)
+			job->failed = 1;
+		return;
+	}
+	switch (imsg->hdr.type) {
+	case (META_ARTIST):
+	case (META_TITLE):
+	case (META_ALBUM):
+	case (META_TRACKNO):
+	case (META_DATE):
+	case (META_TIME):
+		to_client(job->client, imsg->hdr.type, job->id, imsg->data,
+		    len);
+		break;
+	case (MSG_VERIFY):
+		if (len != sizeof(job->verify))
+			break;
+		memcpy(&job->verify, imsg->data, len);
+		job->verified = 1;
+		to_client(job->client, JOB_VERIFIED, job->id, imsg->data, len);
+		break;
+	case (MSG_ACK):
+	case (MSG_DONE):
+		end_job(w, job->failed);
+		break;
+	case (MSG_NACK):
+		end_job(w, 1);
+		break;
+	}
+}
+
+static void
+start_job(struct worker *w, struct job *job)
+{
+	struct stream_cmd	cmd;
+
+	w->job = job;
+	memset(&cmd, 0, sizeof(cmd));
+	switch (job->type) {
+	case (JOB_DECODE):
+	case (JOB_VERIFY):
+		/* Verifying is decoding without keeping the samples. */
+		cmd.out_type = job->type == JOB_DECODE ? job->out_type :
+		    OUT_VERIFY;
+		worker_cmd(w, CMD_NEW_OUTPUT, job->out_fd, &cmd);
+		worker_cmd(w, CMD_NEW_INPUT_FILE, job->in_fd, NULL);
+		worker_cmd(w, CMD_PLAY, -1, NULL);
+		break;
+	case (JOB_META):
+		worker_cmd(w, CMD_NEW_INPUT_FILE, job->in_fd, NULL);
+		worker_cmd(w, CMD_META, -1, NULL);
+		break;
+	case (JOB_SCAN):
+		worker_cmd(w, CMD_NEW_INPUT_FILE, job->in_fd, NULL);
+		worker_cmd(w, CMD_SCAN, -1, NULL);
+		break;
+	}
+	/* imsg closes the fds once they are sent. */
+	job->in_fd = job->out_fd = -1;
+}
+
+static void
+end_job(struct worker *w, int failed)
+{
+	struct job	*job = w->job;
+	int32_t		status;
+
+	if (job->verified && job->verify.status == VERIFY_CORRUPT)
+		failed = 1;
+	status = failed ? 1 : 0;
+	send_result(job->client, job->id, w->pid, status);
+	if (job->path != NULL)
+		local_result(job);
+	free_job(job);
+	w->job = NULL;
+	w->njobs++;
+}
+
+/* job_error: Pass a warning on to the client; pnp -t keeps the first. */
+static void
+job_error(struct job *job, const void *msg, size_t len)
+{
+	to_client(job->client, JOB_ERROR, job->id, msg, len);
+	if (job->path != NULL && job->error == NULL
+	    && (job->error = strndup(msg, len)) == NULL)
+		err(1, "strndup");
+}
+
+/* job_close_fds: Close the fds of a job that hasn't been sent yet. */
+static void
+job_close_fds(struct job *job)
+{
+	if (job->in_fd != -1)
+		close(job->in_fd);
+	if (job->out_fd != -1)
+		close(job->out_fd);
+	job->in_fd = job->out_fd = -1;
+}
+
+static void
+free_job(struct job *job)
+{
+	job_close_fds(job);
+	free(job->path);
+	free(job->error);
+	free(job);
+}
+
+/*
+ * dispatch: Replace the workers that have done their share, and give queued
+ * jobs to idle workers.
+ */
+static void
+dispatch(void)
+{
+	struct job	*job;
+	int		i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].job == NULL && workers[i].njobs >= max_jobs) {
+			stop_worker(&workers[i]);
+			spawn_worker(&workers[i]);
+		}
+	}
+	for (i = 0; i < nworkers && !TAILQ_EMPTY(&queue); i++) {
+		if (workers[i].job != NULL)
+			continue;
+		job = TAILQ_FIRST(&queue);
+		TAILQ_REMOVE(&queue, job, entry);
+		start_job(&workers[i], job);
+	}
+}
+
+static void
+new_client(void)
+{
+	struct client	*c;
+	int		fd, i;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) == -1) {
+		if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+			warn("accept");
+		return;
+	}
+	for (i = 0; i < MAX_CLIENTS && clients[i] != NULL; i++)
+		continue;
+	if (i == MAX_CLIENTS || fcntl(fd, F_SETFL, O_NONBLOCK) == -1
+	    || (c = calloc(1, sizeof(struct client))) == NULL) {
+		close(fd);
+		return;
+	}
+	imsg_init(&c->ibuf, fd);
+	c->out_fd = -1;
+	clients[i] = c;
+}
+
+static void
+client_read(int slot)
+{
+	struct client	*c = clients[slot];
+	struct imsg	imsg;
+	ssize_t		n;
+
+	if ((n = imsg_read(&c->ibuf)) == -1 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		client_gone(slot);
+		return;
+	}
+	while ((n = imsg_get(&c->ibuf, &imsg)) > 0) {
+		client_msg(c, &imsg);
+		imsg_free(&imsg);
+	}
+	if (n == -1)
+		client_gone(slot);
+}
+
+static void
+client_msg(struct client *c, struct imsg *imsg)
+{
+	struct job	*job = NULL;
+	const char	*errstr = NULL;
+	int32_t		status = 1;
+	size_t		len = imsg->hdr.len - IMSG_HEADER_SIZE;
+
+	switch (imsg->hdr.type) {
+	case (JOB_OUTPUT):
+		if (c->out_fd != -1)
+			close(c->out_fd);
+		c->out_fd = imsg->fd;
+		c->out_id = imsg->hdr.peerid;
+		c->out_type = NONE;
+		if (len == sizeof(c->out_type))
+			memcpy(&c->out_type, imsg->data, len);
+		return;
+	case (JOB_DECODE):
+	case (JOB_META):
+	case (JOB_VERIFY):
+	case (JOB_SCAN):
+		break;
+	default:
+		errstr = "unknown message";
+		goto fail;
+	}
+
+	if ((job = calloc(1, sizeof(struct job))) == NULL) {
+		errstr = "out of memory";
+		goto fail;
+	}
+	job->client = c;
+	job->id = imsg->hdr.peerid;
+	job->type = imsg->hdr.type;
+	job->in_fd = imsg->fd;
+	job->out_fd = -1;
+	if (job->type == JOB_DECODE) {
+		if (c->out_fd == -1 || c->out_id != job->id)
+			errstr = "no output";
+		job->out_fd = c->out_fd;
+		job->out_type = c->out_type;
+		c->out_fd = -1;
+	}
+	if (job->in_fd == -1)
+		errstr = "no input";
+	if (errstr != NULL) {
+		free_job(job);
+		imsg->fd = -1;
+		goto fail;
+	}
+	TAILQ_INSERT_TAIL(&queue, job, entry);
+	return;
+
+fail:
+	if (imsg->fd != -1)
+		close(imsg->fd);
+	to_client(c, JOB_ERROR, imsg->hdr.peerid, errstr, strlen(errstr) + 1);
+	send_result(c, imsg->hdr.peerid, getpid(), status);
+}
+
+/*
+ * client_gone: Drop a client and its queued jobs. Jobs that are running
+ * are finished, but nobody gets the results.
+ */
+static void
+client_gone(int slot)
+{
+	struct client	*c = clients[slot];
+	struct job	*job, *next;
+	int		i;
+
+	for (job = TAILQ_FIRST(&queue); job != NULL; job = next) {
+		next = TAILQ_NEXT(job, entry);
+		if (job->client == c) {
+			TAILQ_REMOVE(&queue, job, entry);
+			free_job(job);
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].job != NULL && workers[i].job->client == c)
+			workers[i].job->client = NULL;
+	}
+	imsg_clear(&c->ibuf);
+	close(c->ibuf.fd);
+	if (c->out_fd != -1)
+		close(c->out_fd);
+	free(c);
+	clients[slot] = NULL;
+}
+
+static void
+to_client(struct client *c, int type, uint32_t id, const void *data,
+    size_t len)
+{
+	if (c == NULL)
+		return;
+	if (imsg_compose(&c->ibuf, (uint32_t)type, id, getpid(), -1, data,
+	    len) == -1)
+		warn("imsg_compose");
+}
+
+/*
+ * send_result: Send a job's JOB_RESULT with the pid of the worker that ran
+ * it, or the daemon's if none did.
+ */
+static void
+send_result(struct client *c, uint32_t id, pid_t pid, int32_t status)
+{
+	if (c == NULL)
+		return;
+	if (imsg_compose(&c->ibuf, JOB_RESULT, id, pid, -1, &status,
+	    sizeof(status)) == -1)
+		warn("imsg_compose");
+}
+
+/*
+ * open_results: Open the results file of pnp -t for appending, or return
+ * stdout if there is none. The files it already has a verdict for are
+ * remembered in done_paths; those that couldn't be checked are tried again,
+ * and so are those that were only scanned if this run decodes them.
+ */
+static FILE *
+open_results(const char *path)
+{
+	FILE	*fp;
+	char	*line = NULL, *p, *md5, **tmp;
+	size_t	size = 0, alloc = 0;
+	ssize_t	len;
+	int	i, complete = 1;
+
+	if (path == NULL)
+		return (stdout);
+	if ((fp = fopen(path, "a+")) == NULL)
+		err(1, "%s", path);
+	rewind(fp);
+	while ((len = getline(&line, &size, fp)) != -1) {
+		/* The last line may have been cut off by a crash. */
+		if (!(complete = line[len - 1] == '\n'))
+			break;
+		line[len - 1] = '\0';
+		for (p = line, md5 = NULL, i = 0; i < 5 && p != NULL; i++) {
+			if ((p = strchr(p, '\t')) != NULL)
+				p++;
+			if (i == 2)
+				md5 = p;
+		}
+		if (p == NULL || strncmp(line, "error\t", 6) == 0)
+			continue;
+		if (check_type == JOB_VERIFY
+		    && strncmp(md5, "unchecked\t", 10) == 0)
+			continue;
+		if (ndone == alloc) {
+			alloc = alloc == 0 ? 1024 : 2 * alloc;
+			if ((tmp = reallocarray(done_paths, alloc,
+			    sizeof(*done_paths))) == NULL)
+				err(1, "reallocarray");
+			done_paths = tmp;
+		}
+		if ((done_paths[ndone++] = strdup(p)) == NULL)
+			err(1, "strdup");
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	free(line);
+	qsort(done_paths, ndone, sizeof(*done_paths), cmp_path);
+	if (fseeko(fp, 0, SEEK_END) == -1
+	    || (!complete && fputc('\n', fp) == EOF))
+		err(1, "%s", path);
+	return (fp);
+}
+
+static int
+cmp_path(const void *a, const void *b)
+{
+	return (strcmp(*(char *const *)a, *(char *const *)b));
+}
+
+/*
+ * next_path: Return the next file for pnp -t that isn't done yet, or NULL
+ * if there are no more. The string is only good until the next call.
+ */
+static char *
+next_path(void)
+{
+	static char	*line;
+	static size_t	size;
+	ssize_t		len;
+	char		*path;
+
+	while (1) {
+		if (narg_paths > 0) {
+			if (next_arg == narg_paths)
+				return (NULL);
+			path = arg_paths[next_arg++];
+		}
+		else {
+			if ((len = getline(&line, &size, stdin)) == -1) {
+				if (ferror(stdin))
+					err(1, "stdin");
+				return (NULL);
+			}
+			if (len > 0 && line[len - 1] == '\n')
+				line[--len] = '\0';
+			if (len == 0)
+				continue;
+			path = line;
+		}
+		if (ndone == 0 || bsearch(&path, done_paths, ndone,
+		    sizeof(*done_paths), cmp_path) == NULL)
+			return (path);
+		nskipped++;
+	}
+}
+
+static int
+queued_jobs(void)
+{
+	struct job	*job;
+	int		n = 0;
+
+	TAILQ_FOREACH(job, &queue, entry)
+		n++;
+	return (n);
+}
+
+/* queue_verify: Open path and queue a verify job for it. */
+static void
+queue_verify(const char *path)
+{
+	struct job	*job;
+	int		fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		warn("%s", path);
+		print_result(path, NULL);
+		return;
+	}
+	if ((job = calloc(1, sizeof(struct job))) == NULL)
+		err(1, "calloc");
+	if ((job->path = strdup(path)) == NULL)
+		err(1, "strdup");
+	job->type = check_type;
+	job->in_fd = fd;
+	job->out_fd = -1;
+	TAILQ_INSERT_TAIL(&queue, job, entry);
+}
+
+/*
+ * local_result: Report a finished job of pnp -t. After a ^C, the workers
+ * die with it; those jobs are left for the next run.
+ */
+static void
+local_result(struct job *job)
+{
+	if (quit)
+		return;
+	if (job->verified) {
+		print_result(job->path, &job->verify);
+		return;
+	}
+	warnx("%s: %s", job->path, job->error != NULL ? job->error :
+	    "no result");
+	print_result(job->path, NULL);
+}
+
+/* print_result: Write a line of the results file; v is NULL on error. */
+static void
+print_result(const char *path, const struct pnp_verify *v)
+{
+	static const char	*status[] = {"ok", "unsigned", "corrupt"};
+	static const char	*md5[] = {"match", "mismatch", "none",
+				    "unchecked"};
+
+	if (v == NULL || v->status > VERIFY_CORRUPT || v->md5 > MD5_UNCHECKED) {
+		fprintf(results, "error\t-\t-\t-\t-\t%s\n", path);
+		nerrors++;
+	}
+	else {
+		fprintf(results, "%s\t%u\t%u\t%s\t%llu/%llu\t%s\n",
+		    status[v->status], v->crc_errors, v->sync_errors,
+		    md5[v->md5], (unsigned long long)v->samples,
+		    (unsigned long long)v->expected, path);
+		if (v->status == VERIFY_OK)
+			nok++;
+		else if (v->status == VERIFY_UNSIGNED)
+			nunsigned++;
+		else
+			ncorrupt++;
+	}
+	/* Every line counts when resuming. */
+	if (fflush(results) == EOF)
+		err(1, "results");
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_DAEMON_H
+#define PNP_DAEMON_H
+
+/*
+ * Protocol between pnp -D and its clients: imsg over a UNIX socket. The
+ * peerid of every message is a job ID chosen by the client.
+ *
+ * A decode job is JOB_OUTPUT with the output fd and the output type as a
+ * uint32_t (OUT_WAV_FILE, OUT_RAW or OUT_NULL), followed by JOB_DECODE
+ * with the input fd. JOB_META, JOB_VERIFY and JOB_SCAN only take the input
+ * fd.
+ *
+ * Every job is answered with JOB_RESULT, an int32_t that is 0 on success.
+ * Its pid is that of the worker that ran the job, or the daemon's if none
+ * did.
+ * A metadata job gets the META_* messages of message_types.h before that,
+ * and a verify or scan job gets JOB_VERIFIED with a struct pnp_verify; a
+ * corrupt file fails. A scan only checks the frame CRCs, without decoding
+ * or checking the MD5 signature. Any job may get JOB_ERROR messages that
+ * say what went wrong.
+ */
+enum {
+	JOB_OUTPUT = 100,
+	JOB_DECODE,
+	JOB_META,
+	JOB_VERIFY,
+	JOB_RESULT,
+	JOB_ERROR,
+	JOB_VERIFIED,
+	JOB_SCAN,
+};
+
+#define PNPD_WORKERS	4	/* Default size of the worker pool. */
+#define PNPD_JOBS	100	/* Jobs before a worker is replaced. */
+
+int	pnpd_main(const char *, int, int);
+int	pnpd_verify(char **, int, int, int, int, const char *);
+
+#endif
@@ -16,31 +16,51 @@
 
 #include <sys/limits.h>
 
-#include <iconv.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "comm.h"
 #include "child_errors.h"
 #include "child_messages.h"
 #include "file.h"
+#include "pnp.h"
+#include "transcode.h"
+
+struct arena	meta_arena;
+
+/*
+ * tag_reader: Reads a tag of known length from a file through a small
+ * window. Parts we don't care about are skipped with lseek(2), so the
+ * memory needed does not depend on the size of the tag.
+ */
+struct tag_reader {
+	int		fd;
+	size_t		left;		/* Bytes of the tag not yet consumed. */
+	size_t		pos, fill;	/* Window is buf[pos..fill). */
+	off_t		end;		/* File offset of the end of the tag. */
+	unsigned char	buf[TAG_WINDOW];
+};
 
 static MESSAGE_TYPE	vorbis_to_type(char *);
 static int		id3v2_to_type(unsigned char *);
 static size_t		be_to_uint(unsigned char *);
 static size_t		le_to_uint(unsigned char *);
-static unsigned char	*uint_to_le(unsigned int, unsigned char *);
+static void		put_ds64(unsigned char *, uint64_t, unsigned int, int);
+static void		put_le(unsigned char *, uint64_t, size_t);
+static void		tr_init(struct tag_reader *, int, size_t);
+static int		tr_read(struct tag_reader *, void *, size_t);
+static int		tr_skip(struct tag_reader *, size_t);
+static int		tr_getc(struct tag_reader *, size_t, unsigned char *);
 
 int
 filetype(int fd)
 {
 	ssize_t		nread;
-	unsigned char	buf[22];
-	const char	wave_pcm_tag[2] = {0x01, 0x00};
-	off_t		tag_size;
+	unsigned char	buf[FILETYPE_PROBE_LEN];
 
 	nread = read(fd, buf, sizeof(buf));
 	if (nread < 0)
@@ -49,9 +69,7 @@ filetype(int fd)
 	if (nread >= 3 && memcmp(buf, "ID3", 3) == 0) {
 		if (nread <= 10)
 			return (UNKNOWN);
-		tag_size = (buf[6] << 21) + (buf[7] << 14) + (buf[8] << 7)
-		    + buf[9];
-		if (lseek(fd, tag_size+10, SEEK_SET) < 0)
+		if (lseek(fd, id3v2_size(buf), SEEK_SET) < 0)
 			return (-1);
 		nread = read(fd, buf, sizeof(buf));
 		if (nread < 0)
@@ -59,11 +77,24 @@ filetype(int fd)
 	}
 	if (lseek(fd, 0, SEEK_SET) != 0)
 		return (-1);
-	if (nread >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0)
+	return (header_type(buf, nread));
+}
+
+/*
+ * header_type: Like filetype(), but for a file whose first len bytes after
+ * any ID3v2 tag are in buf. FILETYPE_PROBE_LEN bytes are enough to tell.
+ */
+int
+header_type(const unsigned char *buf, size_t len)
+{
+	const char	wave_pcm_tag[2] = {0x01, 0x00};
+
+	if (len >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0)
 		/* mp3 framesync: 12 bits set to 1. */
 		return (MP3);
-	if (nread >= 4 && memcmp(buf, "fLaC", 4) == 0)
-		return (FLAC); if (nread == 22 && memcmp(buf, "RIFF", 4) == 0 &&
+	if (len >= 4 && memcmp(buf, "fLaC", 4) == 0)
+		return (FLAC);
+	if (len == FILETYPE_PROBE_LEN && memcmp(buf, "RIFF", 4) == 0 &&
 	    memcmp(buf+8, "WAVE", 4) == 0 &&
 	    memcmp(buf+12, "fmt ", 4) == 0 &&
 	    memcmp(buf+20, wave_pcm_tag, sizeof(wave_pcm_tag)) == 0)
@@ -71,176 +102,363 @@ filetype(int fd)
 	return (UNKNOWN);
 }
 
+/*
+ * id3v2_size: Return the size of the ID3v2 tag that buf starts with,
+ * including its header, or 0 if there is none. buf holds 10 bytes.
+ */
+size_t
+id3v2_size(const unsigned char *buf)
+{
+	if (memcmp(buf, "ID3", 3) != 0)
+		return (0);
+	return ((buf[6] << 21) + (buf[7] << 14) + (buf[8] << 7) + buf[9]
+	    + ID3_HDR_LEN);
+}
+
+static void
+tr_init(struct tag_reader *tr, int fd, size_t len)
+{
+	off_t	start;
+
+	tr->fd = fd;
+	tr->left = len;
+	tr->pos = tr->fill = 0;
+	start = lseek(fd, 0, SEEK_CUR);
+	tr->end = start == -1 ? -1 : start + (off_t)len;
+}
+
+/* tr_read: Copy the next n bytes of the tag to dst. */
+static int
+tr_read(struct tag_reader *tr, void *dst, size_t n)
+{
+	unsigned char	*d = dst;
+	size_t		chunk;
+	ssize_t		nread;
+
+	if (n > tr->left)
+		return (-1);
+	tr->left -= n;
+	while (n > 0) {
+		if (tr->pos == tr->fill) {
+			/* Everything buffered is consumed; left is unread. */
+			chunk = tr->left + n;
+			if (chunk > sizeof(tr->buf))
+				chunk = sizeof(tr->buf);
+			if ((nread = read(tr->fd, tr->buf, chunk)) <= 0)
+				return (-1);
+			tr->pos = 0;
+			tr->fill = nread;
+		}
+		chunk = tr->fill - tr->pos;
+		if (chunk > n)
+			chunk = n;
+		memcpy(d, tr->buf + tr->pos, chunk);
+		tr->pos += chunk;
+		d += chunk;
+		n -= chunk;
+	}
+	return (0);
+}
+
+/* tr_skip: Skip the next n bytes of the tag. */
+static int
+tr_skip(struct tag_reader *tr, size_t n)
+{
+	size_t	buffered;
+
+	if (n > tr->left)
+		return (-1);
+	tr->left -= n;
+	buffered = tr->fill - tr->pos;
+	if (n <= buffered) {
+		tr->pos += n;
+		return (0);
+	}
+	tr->pos = tr->fill = 0;
+	if (lseek(tr->fd, n - buffered, SEEK_CUR) == -1)
+		return (-1);
+	return (0);
+}
+
+/*
+ * tr_getc: Read one byte, but only if that leaves more than stop bytes of
+ * the tag. This keeps the parser inside a frame that ends there.
+ */
+static int
+tr_getc(struct tag_reader *tr, size_t stop, unsigned char *c)
+{
+	if (tr->left <= stop)
+		return (-1);
+	return (tr_read(tr, c, 1));
+}
+
+/*
+ * parse_vorbis_comment: Parse a VORBIS_COMMENT block of len bytes that
+ * starts at the current position of fd and send the interesting comments
+ * to the parent. Values longer than TAG_MAX_TEXT are truncated.
+ */
 int
-parse_vorbis_comment(unsigned char *vcm, ssize_t len)
+parse_vorbis_comment(int fd, size_t len)
 {
-	unsigned char	*key;
-	size_t		    ncomm, comm_len, key_len, i;
-	int		        type;
+	struct tag_reader	tr;
+	unsigned char		lenbuf[4];
+	char			comm[TAG_MAX_TEXT + 1], *val;
+	size_t			ncomm, comm_len, n, i;
+	int			type;
 
-	if (len <= 8)
-		return (-1); /* Too short. */
+	tr_init(&tr, fd, len);
 	/* Skip vendor tag. */
-	comm_len = le_to_uint(vcm);
-	len -= comm_len + 4;
-	if (len < 0)
+	if (tr_read(&tr, lenbuf, sizeof(lenbuf)) == -1
+	    || tr_skip(&tr, le_to_uint(lenbuf)) == -1)
 		return (-1);
-	vcm += comm_len + 4;
-	ncomm = le_to_uint(vcm); /* Number of comments */
-	len -= 4;
-	if (len < 0)
+	if (tr_read(&tr, lenbuf, sizeof(lenbuf)) == -1)
 		return (-1);
-	vcm += 4;
+	ncomm = le_to_uint(lenbuf); /* Number of comments */
 	/* Parse the metadata. */
 	for (i = 0; i < ncomm; i++) {
-		comm_len = le_to_uint(vcm); /* Comment length */
-		len -= 4 + comm_len;
-		if (len < 0)
+		if (tr_read(&tr, lenbuf, sizeof(lenbuf)) == -1)
 			return (-1);
-		vcm += 4;
+		comm_len = le_to_uint(lenbuf); /* Comment length */
+		n = comm_len < TAG_MAX_TEXT ? comm_len : TAG_MAX_TEXT;
+		if (tr_read(&tr, comm, n) == -1
+		    || tr_skip(&tr, comm_len - n) == -1)
+			return (-1);
+		comm[n] = '\0';
 		/*
 		 * The comment is of the form key=value. Replace the '=' by a
 		 * '\0' to make key a string.
 		 */
-		key = vcm;
-		while (*vcm != '=' && vcm++ < key + comm_len)
-			;
-		*vcm++ = '\0';
-		if ((key_len = vcm - key) < comm_len) {
-			comm_len -= key_len;
-			/* Send the message to the parent. */
-			type = vorbis_to_type((char *)key);
-			if (type > -1) {
-				char *string = malloc(comm_len + 1);
-				if (string == NULL) {
-					child_fatal("malloc");
-				}
-				strlcpy(string, (char *)vcm, comm_len + 1);
-				enqueue_message(type, string);
-				free(string);
-			}
-		}
-		else
+		if ((val = memchr(comm, '=', n)) == NULL)
 			/* Malformed comment. */
 			return (-1);
-		vcm += comm_len;
+		*val++ = '\0';
+		/* Send the message to the parent. */
+		if ((type = vorbis_to_type(comm)) > -1)
+			enqueue_message(type, val);
 	}
 	return (0);
 }
 
+/*
+ * parse_id3v2: Parse the frames of an ID3v2 tag of len bytes (without the
+ * header) that starts at the current position of fd. Like
+ * parse_vorbis_comment, it truncates long values.
+ */
 int
-parse_id3v2(unsigned char flags, unsigned char *id3, ssize_t len)
+parse_id3v2(int fd, unsigned char flags, size_t len)
 {
-	size_t		framelen, trcklen, utf8len, tlen;
-	unsigned char	*frameflags;
-	char 		*utf8str, *utf8strp, *tstr;
-	const char	*errstr;
-	int		type;
-	long long	time;
-	iconv_t		conv;
+	struct tag_reader	tr;
+	size_t			framelen, n;
+	unsigned char		hdr[ID3_HDR_LEN], text[TAG_MAX_TEXT];
+	char 			*utf8str, tstr[32];
+	const char		*charset, *errstr;
+	int			type;
+	long long		time;
 
+	tr_init(&tr, fd, len);
 	/* Skip extended header, if present. */
 	if (flags & 0x40) {
-		if (len < 4)
+		if (tr_read(&tr, hdr, 4) == -1
+		    || tr_skip(&tr, be_to_uint(hdr)) == -1)
 			return (-1);
-		framelen = be_to_uint(id3);
-		len -= framelen + 4;
-		if (len < 0)
-			return (-1);
-		id3 += framelen + 4;
 	}
-	while (len > 0) {
-		if (*id3 == '\0')
-			return (0); /* The rest of the tag is padding. */
-		len -= ID3_HDR_LEN; /* ID3_HDR_LEN = 4 + 4 + 2 */
-		if (len < 0)
+	/* Anything too short for a frame header is padding. */
+	while (tr.left >= ID3_HDR_LEN) {
+		if (tr_read(&tr, hdr, ID3_HDR_LEN) == -1)
 			return (-1);
-		type = id3v2_to_type(id3);
-		id3 += 4;
-		framelen = be_to_uint(id3);
-		id3 += 4;
-		frameflags = id3;
-		id3 += 2;
-		len -= framelen;
-		if (len < 0)
+		if (hdr[0] == '\0')
+			return (0); /* The rest of the tag is padding. */
+		/* ID3_HDR_LEN = 4 (ID) + 4 (size) + 2 (flags) */
+		type = id3v2_to_type(hdr);
+		framelen = be_to_uint(hdr + 4);
+		if (framelen > tr.left)
 			return (-1);
 		if (type == -1) {
 			/* We don't care about this frame. */
-			id3 += framelen;
+			if (tr_skip(&tr, framelen) == -1)
+				return (-1);
 			continue;
 		}
-		if (frameflags[1] & 0x40) {
+		if (hdr[9] & 0x40) {
 			/* Encrypted frame. */
 			child_warnx("Encrypted id3v2 frames not supported.");
-			id3 += framelen;
+			if (tr_skip(&tr, framelen) == -1)
+				return (-1);
 			continue;
 		}
-		if (frameflags[1] & 0x80) {
+		if (hdr[9] & 0x80) {
 			/* Compressed frame. */
 			child_warnx("Compressed id3v2 frames not supported.");
-			id3 += framelen;
+			if (tr_skip(&tr, framelen) == -1)
+				return (-1);
 			continue;
 		}
-		if (framelen < 1)
+		if (framelen < 1 || tr_read(&tr, text, 1) == -1)
 			return (-1);
-		if (*id3 == 0x00) {
-			/* ISO-8859-1 encoding */
-			utf8len = framelen;
-			conv = iconv_open("UTF-8", "ISO-8859-1");
-		}
-		else if (*id3 == 0x01) {
-			/* UTF-16 encoding */
-			utf8len = framelen/2 + 1;
-			conv = iconv_open("UTF-8", "UTF-16");
-		}
-		else {
+		switch (text[0]) {
+		case (0x00):
+			charset = "ISO-8859-1";
+			break;
+		case (0x01):
+			/* UTF-16 with byte order mark */
+			charset = "UTF-16";
+			break;
+		case (0x02):
+			charset = "UTF-16BE";
+			break;
+		case (0x03):
+			charset = "UTF-8";
+			break;
+		default:
 			/* Invalid */
 			child_warnx("Unknown text encoding in id3v2 frame.");
 			return (-1);
 		}
-		id3++;
 		framelen--;
-		if ((utf8str = malloc(utf8len)) == NULL)
-			child_fatal("malloc");
-		utf8strp = utf8str;
-		if (iconv(conv, (char **)&id3, &framelen, &utf8strp, &utf8len)
-		    == -1) {
-			child_warn("iconv");
-			free(utf8str);
+		n = framelen < TAG_MAX_TEXT ? framelen : TAG_MAX_TEXT;
+		if (text[0] == 0x01 || text[0] == 0x02)
+			n &= ~(size_t)1; /* Don't split a UTF-16 code unit. */
+		if (tr_read(&tr, text, n) == -1
+		    || tr_skip(&tr, framelen - n) == -1)
+			return (-1);
+		/* Only this frame's text is needed; keep the arena small. */
+		arena_reset(&meta_arena);
+		if ((utf8str = transcode(&meta_arena, charset, text, n))
+		    == NULL) {
+			child_warn("transcode");
 			return (-1);
 		}
-		*utf8strp = '\0';
 		if (type == META_TIME) {
 			/* The time is given in milliseconds. */
 			time = strtonum(utf8str, 0, INT_MAX, &errstr);
-			if (errstr == NULL) {
-				child_warn("strtonum");
-				return (-1);
+			if (errstr != NULL) {
+				child_warnx("id3v2: invalid TLEN frame");
+				continue;
 			}
 			time = time % 1000 < 500 ? time/1000 : time/1000 + 1;
-			tlen = asprintf(&tstr, "%d:%02d", (int)time/60,
-			    (int)time % 60);
-			if (tstr == NULL)
-				child_fatal("malloc");
+			(void)snprintf(tstr, sizeof(tstr), "%d:%02d",
+			    (int)time/60, (int)time % 60);
 			enqueue_message(META_TIME, tstr);
-			free(tstr);
-		}
-		else if (type == META_TRACKNO) {
-			for (trcklen = 0; trcklen < strlen(utf8str);
-			    trcklen++) {
-				if (utf8str[trcklen] == '/')
-					break;
-				}
-			enqueue_message(type, utf8str);
 		}
 		else
 			enqueue_message(type, utf8str);
-		free(utf8str);
-		id3 += framelen;
 	}
 	return (0);
 }
 
+/*
+ * find_picture_id3v2: Look for APIC frames in an ID3v2 tag like
+ * parse_id3v2 does for text frames. If there is one, store where its image
+ * data is in loc, preferring the front cover. Returns 1 if a picture was
+ * found, 0 if not and -1 if the tag is malformed.
+ */
+int
+find_picture_id3v2(int fd, unsigned char flags, size_t len,
+    struct picture_loc *loc)
+{
+	struct tag_reader	tr;
+	size_t			framelen, stop, n;
+	unsigned char		hdr[ID3_HDR_LEN], enc, c, c2, type;
+	char			mime[PICTURE_MIME_LEN];
+	int			found = 0;
+
+	tr_init(&tr, fd, len);
+	if (tr.end == -1)
+		return (-1);
+	if (flags & 0x40) {
+		if (tr_read(&tr, hdr, 4) == -1
+		    || tr_skip(&tr, be_to_uint(hdr)) == -1)
+			return (-1);
+	}
+	while (tr.left >= ID3_HDR_LEN) {
+		if (tr_read(&tr, hdr, ID3_HDR_LEN) == -1)
+			return (-1);
+		if (hdr[0] == '\0')
+			break; /* Padding */
+		framelen = be_to_uint(hdr + 4);
+		if (framelen > tr.left)
+			return (-1);
+		/* Skip other frames, and the ones we could not read. */
+		if (memcmp(hdr, "APIC", 4) != 0 || (hdr[9] & 0xc0)) {
+			if (tr_skip(&tr, framelen) == -1)
+				return (-1);
+			continue;
+		}
+		stop = tr.left - framelen;
+		/* Text encoding, then the MIME type as a Latin-1 string. */
+		if (tr_getc(&tr, stop, &enc) == -1)
+			return (-1);
+		for (n = 0; ; n++) {
+			if (tr_getc(&tr, stop, &c) == -1)
+				return (-1);
+			if (c == '\0')
+				break;
+			if (n < sizeof(mime) - 1)
+				mime[n] = c;
+		}
+		mime[n < sizeof(mime) ? n : sizeof(mime) - 1] = '\0';
+		if (tr_getc(&tr, stop, &type) == -1)
+			return (-1);
+		/* The description ends with a null character. */
+		do {
+			if (tr_getc(&tr, stop, &c) == -1)
+				return (-1);
+			c2 = 0;
+			if ((enc == 0x01 || enc == 0x02)
+			    && tr_getc(&tr, stop, &c2) == -1)
+				return (-1);
+		} while (c != 0 || c2 != 0);
+		if (!found || type == PICTURE_FRONT_COVER) {
+			memcpy(loc->mime, mime, sizeof(loc->mime));
+			loc->type = type;
+			loc->offset = tr.end - tr.left;
+			loc->length = tr.left - stop;
+			found = 1;
+			if (type == PICTURE_FRONT_COVER)
+				break;
+		}
+		if (tr_skip(&tr, tr.left - stop) == -1)
+			return (-1);
+	}
+	return (found);
+}
+
+/*
+ * find_picture_flac: Read the header of a FLAC PICTURE block of len bytes
+ * at the current position of fd and store where its image data is in loc.
+ * Returns 1, or -1 if the block is malformed.
+ */
+int
+find_picture_flac(int fd, size_t len, struct picture_loc *loc)
+{
+	struct tag_reader	tr;
+	unsigned char		buf[4];
+	size_t			n, mime_len;
+
+	tr_init(&tr, fd, len);
+	if (tr.end == -1)
+		return (-1);
+	if (tr_read(&tr, buf, 4) == -1)
+		return (-1);
+	loc->type = be_to_uint(buf);
+	if (tr_read(&tr, buf, 4) == -1)
+		return (-1);
+	mime_len = be_to_uint(buf);
+	n = mime_len < PICTURE_MIME_LEN ? mime_len : PICTURE_MIME_LEN - 1;
+	if (tr_read(&tr, loc->mime, n) == -1 || tr_skip(&tr, mime_len - n))
+		return (-1);
+	loc->mime[n] = '\0';
+	/* Skip the description, then width, height, depth and colors. */
+	if (tr_read(&tr, buf, 4) == -1 || tr_skip(&tr, be_to_uint(buf)) == -1
+	    || tr_skip(&tr, 16) == -1 || tr_read(&tr, buf, 4) == -1)
+		return (-1);
+	loc->length = be_to_uint(buf);
+	if (loc->length > tr.left)
+		return (-1);
+	loc->offset = tr.end - tr.left;
+	return (1);
+}
+
 static int
 id3v2_to_type(unsigned char *id)
 {
@@ -277,58 +495,122 @@ vorbis_to_type(char *key)
 	return (-1);
 }
 
+/*
+ * write_wav_header: Write a WAVE header and return its length, or -1 on
+ * error. If the data doesn't fit the 32-bit sizes of RIFF, the header is
+ * RF64 (EBU Tech 3306), with the real sizes in a ds64 chunk. If the length
+ * is unknown, a JUNK chunk keeps room for the ds64 chunk, so that
+ * patch_wav_header() can turn the file into RF64 once the size is known.
+ */
 int
 write_wav_header(FILE *f, unsigned int channels, unsigned int rate,
     unsigned int bps, uint64_t samples)
 {
-	unsigned char	buf[4];
-	uint64_t	data_size;
-	size_t		bytes;
+	unsigned char	hdr[WAV_EXT_HEADER_LEN], *p;
+	unsigned int	framesize = channels*bps/8;
+	uint64_t	data_size = 0;
+	int		len;
 
-	if (bps % 8 != 0)
-		return (-1);
-	data_size = samples*channels*bps/8;
-	if (samples > UINT32_MAX || data_size > UINT32_MAX)
-		/* The file is too large for the WAVE format. */
+	if (bps % 8 != 0 || framesize == 0)
 		return (-1);
-	bytes = fwrite("RIFF", 1, 4, f);
-	if (bytes < 4)
-		return (-1);
-	/* Write the file size (excluding the RIFF tag and the size). */
-	bytes += fwrite(uint_to_le(data_size + 36, buf), 1, 4, f);
-	if (bytes < 8)
-		return (-1);
-	bytes += fwrite("WAVEfmt \x10\x00\x00\x00\x01\x00", 1, 14, f);
-	/*
-	 * Bytes 9-15 are the size of the fmt chunk (16 bytes).
-	 * The last two bytes are the tag for the WAVE PCM format.
-	 */
-	if (bytes < 22)
-		return (-1);
-	bytes += fwrite(uint_to_le(channels, buf), 1, 2, f);
-	if (bytes < 24)
-		return (-1);
-	bytes += fwrite(uint_to_le(rate, buf), 1, 4, f);
-	if (bytes < 28)
-		return (-1);
-	bytes += fwrite(uint_to_le(rate*channels*bps/8, buf), 1, 4, f);
+	if (samples != WAV_UNKNOWN_LENGTH) {
+		if (samples > UINT64_MAX / 2 / framesize)
+			return (-1);
+		data_size = samples * framesize;
+	}
+	if (samples != WAV_UNKNOWN_LENGTH
+	    && data_size <= UINT32_MAX - (WAV_HEADER_LEN - 8)) {
+		len = WAV_HEADER_LEN;
+		memcpy(hdr, "RIFF", 4);
+		put_le(hdr + 4, data_size + len - 8, 4);
+		p = hdr + 12;
+	} else {
+		len = WAV_EXT_HEADER_LEN;
+		if (samples == WAV_UNKNOWN_LENGTH) {
+			/* Readers take these sizes to mean "until EOF". */
+			memcpy(hdr, "RIFF", 4);
+			put_le(hdr + 4, UINT32_MAX, 4);
+			put_ds64(hdr + 12, 0, 0, 0);
+		} else {
+			memcpy(hdr, "RF64", 4);
+			put_le(hdr + 4, UINT32_MAX, 4);
+			put_ds64(hdr + 12, data_size, framesize, 1);
+		}
+		p = hdr + 48;
+	}
+	memcpy(hdr + 8, "WAVE", 4);
+	/* The fmt chunk is 16 bytes, and 1 is the tag for PCM. */
+	memcpy(p, "fmt \x10\x00\x00\x00\x01\x00", 10);
+	put_le(p + 10, channels, 2);
+	put_le(p + 12, rate, 4);
 	/* Data rate (bytes/s) */
-	if (bytes < 32)
-		return (-1);
-	bytes += fwrite(uint_to_le(channels*bps/8, buf), 1, 2, f);
+	put_le(p + 16, rate*framesize, 4);
 	/* Block size in bytes. (Block = One sample per channel) */
-	if (bytes < 34)
+	put_le(p + 20, framesize, 2);
+	put_le(p + 22, bps, 2);
+	memcpy(p + 24, "data", 4);
+	put_le(p + 28, len == WAV_HEADER_LEN ? data_size : UINT32_MAX, 4);
+	if (fwrite(hdr, 1, len, f) < (size_t)len)
+		return (-1);
+	return (len);
+}
+
+/*
+ * patch_wav_header: Fill in the sizes of a header of length hdr_len, as
+ * returned by write_wav_header(), now that the size of the data is known.
+ * A header with room for a ds64 chunk becomes RF64 if the data needs it.
+ * Returns -1 if f can't seek, like a pipe, or the data is too large; the
+ * header then stays as it was.
+ */
+int
+patch_wav_header(FILE *f, int hdr_len, uint64_t data_size,
+    unsigned int framesize)
+{
+	unsigned char	hdr[WAV_EXT_HEADER_LEN];
+	uint64_t	riff_size = data_size + hdr_len - 8;
+	off_t		end;
+	int		rf64;
+
+	if (hdr_len != WAV_HEADER_LEN && hdr_len != WAV_EXT_HEADER_LEN)
 		return (-1);
-	bytes += fwrite(uint_to_le(bps, buf), 1, 2, f);
-	if (bytes < 36)
+	rf64 = riff_size > UINT32_MAX;
+	if (rf64 && (hdr_len == WAV_HEADER_LEN || framesize == 0))
 		return (-1);
-	bytes += fwrite("data", 1, 4, f);
-	if (bytes < 40)
+	memcpy(hdr, rf64 ? "RF64" : "RIFF", 4);
+	put_le(hdr + 4, rf64 ? UINT32_MAX : riff_size, 4);
+	if (hdr_len == WAV_EXT_HEADER_LEN)
+		put_ds64(hdr + 12, data_size, framesize, rf64);
+	put_le(hdr + hdr_len - 4, rf64 ? UINT32_MAX : data_size, 4);
+	if ((end = ftello(f)) == -1 || fseeko(f, 0, SEEK_SET) == -1)
 		return (-1);
-	bytes += fwrite(uint_to_le(data_size, buf), 1, 4, f);
-	if (bytes < 44)
+	if (fwrite(hdr, 1, 8, f) < 8
+	    || (hdr_len == WAV_EXT_HEADER_LEN && (fseeko(f, 12, SEEK_SET) == -1
+	    || fwrite(hdr + 12, 1, 36, f) < 36))
+	    || fseeko(f, hdr_len - 4, SEEK_SET) == -1
+	    || fwrite(hdr + hdr_len - 4, 1, 4, f) < 4
+	    || fseeko(f, end, SEEK_SET) == -1)
 		return (-1);
-	return ((int)bytes);
+	return (0);
+}
+
+/*
+ * put_ds64: Write the 36-byte chunk that follows "WAVE" in an extended
+ * header. For RF64, it is the ds64 chunk with the 64-bit sizes. Otherwise,
+ * it is a JUNK chunk of the same size that readers skip.
+ */
+static void
+put_ds64(unsigned char *p, uint64_t data_size, unsigned int framesize,
+    int rf64)
+{
+	memset(p, 0, 36);
+	memcpy(p, rf64 ? "ds64" : "JUNK", 4);
+	put_le(p + 4, 28, 4);
+	if (!rf64)
+		return;
+	put_le(p + 8, data_size + WAV_EXT_HEADER_LEN - 8, 8);
+	put_le(p + 16, data_size, 8);
+	put_le(p + 24, data_size / framesize, 8);
+	/* The table of other chunk sizes (p + 32) stays empty. */
 }
 
 /* Decode/encode big and little endian */
@@ -344,15 +626,14 @@ le_to_uint(unsigned char *d)
 	return (d[0] + (d[1] << 8) + (d[2] << 16) + (d[3] << 24));
 }
 
-static unsigned char *
-uint_to_le(unsigned int n, unsigned char *buf)
+/* put_le: Store the len lowest bytes of n in little endian order. */
+static void
+put_le(unsigned char *p, uint64_t n, size_t len)
 {
-	/* buf must be able to hold four bytes. */
-	int 	i;
+	size_t	i;
 
-	for (i = 0; i < 4; i++) {
-		buf[i] = n % (1 << 8);
+	for (i = 0; i < len; i++) {
+		p[i] = n & 0xff;
 		n >>= 8;
 	}
-	return (buf);
 }
@@ -17,13 +17,40 @@
 #ifndef PNP_FILE_H
 #define PNP_FILE_H
 
+#include "arena.h"
+
 #define ID3_HDR_LEN	10
+#define TAG_WINDOW	4096	/* Read buffer of the tag parsers. */
+#define TAG_MAX_TEXT	1024	/* Longer tag values are truncated. */
+
+/*
+ * Tag parsing allocates from this arena. The child resets it whenever it
+ * switches to a new input file, and parse_id3v2() before each frame.
+ */
+extern struct arena	meta_arena;
+
+struct picture_loc;
 
 int	filetype(int);
-int	parse_id3v2(unsigned char, unsigned char *, ssize_t);
-int	parse_vorbis_comment(unsigned char *, ssize_t);
+int	header_type(const unsigned char *, size_t);
+size_t	id3v2_size(const unsigned char *);
+int	parse_id3v2(int, unsigned char, size_t);
+int	parse_vorbis_comment(int, size_t);
+int	find_picture_id3v2(int, unsigned char, size_t, struct picture_loc *);
+int	find_picture_flac(int, size_t, struct picture_loc *);
 int	write_wav_header(FILE *, unsigned int, unsigned int, unsigned int,
 	    uint64_t);
+int	patch_wav_header(FILE *, int, uint64_t, unsigned int);
+
+/*
+ * Sample count for write_wav_header() if it isn't known. The sizes in the
+ * header are set to 0xffffffff, which readers take to mean "until EOF".
+ */
+#define WAV_UNKNOWN_LENGTH	UINT64_MAX
+/* Header lengths: plain RIFF, and RF64 or RIFF with room for ds64. */
+#define WAV_HEADER_LEN		44
+#define WAV_EXT_HEADER_LEN	80
 
 enum {UNKNOWN, FLAC, MP3, WAVE_PCM}; /* Return values for filetype. */
+#define FILETYPE_PROBE_LEN	22	/* Bytes header_type() looks at. */
 #endif
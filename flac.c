@@ -14,11 +14,14 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/stat.h>
+
 #include <fcntl.h>
 #include <sndio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <FLAC/format.h>
@@ -29,34 +32,71 @@
 #include "child.h"
 #include "child_errors.h"
 #include "child_messages.h"
+#include "child_stats.h"
 #include "file.h"
 #include "flac.h"
 #include "out_sndio.h"
+#include "pcm.h"
 #include "pnp.h"
+#include "tee.h"
+#include "trace.h"
+#include "writer.h"
 
 static FLAC__StreamDecoder	*init_flac_decoder(struct flac_client_data *);
-static void			cleanup_flac_decoder(FLAC__StreamDecoder *);
+static int			step_file(struct flac_client_data *);
+static int			step_sndio(struct flac_client_data *);
+static void			end_play(struct flac_client_data *,
+				    struct state *);
 static size_t			blocksize(unsigned char *);
 static u_int64_t		get_samples(unsigned char *);
 static u_int64_t		get_rate(unsigned char *);
 static void			flac_error_msg(FLAC__StreamDecoderErrorStatus);
+static int			seek_start(struct stream *);
+static int			write_header(struct flac_client_data *);
+static void			report_verify(struct flac_client_data *);
+static int			native_start(struct flac_client_data *);
+static void			native_fill(struct flac_client_data *);
+static int			native_step(struct flac_client_data *);
+static int			decode_frame(struct flac_client_data *);
+static int			at_end(struct flac_client_data *);
+static int			input_done(struct input *);
 
 void mdata_cb(const FLAC__StreamDecoder *, const FLAC__StreamMetadata *,
     void *);
 FLAC__StreamDecoderReadStatus read_cb(const FLAC__StreamDecoder *,
     FLAC__byte *, size_t *, void *);
+FLAC__StreamDecoderSeekStatus seek_cb(const FLAC__StreamDecoder *,
+    FLAC__uint64, void *);
+FLAC__StreamDecoderTellStatus tell_cb(const FLAC__StreamDecoder *,
+    FLAC__uint64 *, void *);
+FLAC__StreamDecoderLengthStatus length_cb(const FLAC__StreamDecoder *,
+    FLAC__uint64 *, void *);
+FLAC__bool eof_cb(const FLAC__StreamDecoder *, void *);
 FLAC__StreamDecoderWriteStatus write_cb_file (const FLAC__StreamDecoder *,
     const FLAC__Frame *, const FLAC__int32 *const [], void *);
 FLAC__StreamDecoderWriteStatus write_cb_sndio (const FLAC__StreamDecoder *,
     const FLAC__Frame *, const FLAC__int32 *const [], void *);
+FLAC__StreamDecoderWriteStatus write_cb_null (const FLAC__StreamDecoder *,
+    const FLAC__Frame *, const FLAC__int32 *const [], void *);
+FLAC__StreamDecoderWriteStatus write_cb_pcm (const FLAC__StreamDecoder *,
+    const FLAC__Frame *, const FLAC__int32 *const [], void *);
 void err_cb (const FLAC__StreamDecoder *, const FLAC__StreamDecoderErrorStatus,
     void *);
 
+int	flac_decoder = FLAC_DEC_LIBFLAC;
+
+/*
+ * init_flac_decoder: Return the stream's decoder, ready for a new file. It
+ * is created and initialized for the first file; afterwards it is only
+ * rewound with FLAC__stream_decoder_reset(), which keeps its buffers. MD5
+ * checking can only be switched on before initialization, so a change to
+ * or from OUT_VERIFY starts over.
+ */
 static FLAC__StreamDecoder *
 init_flac_decoder(struct flac_client_data *cdata)
 {
 	FLAC__StreamDecoderWriteCallback	write_cb;
-	FLAC__StreamDecoder			*dec;
+	int					md5;
 
 	switch (cdata->out->type) {
 	case (OUT_SNDIO):
@@ -66,19 +106,40 @@ init_flac_decoder(struct flac_client_data *cdata)
 	case (OUT_RAW):
 		write_cb = write_cb_file;
 		break;
+	case (OUT_NULL):
+	case (OUT_VERIFY):
+		write_cb = write_cb_null;
+		break;
+	case (OUT_PCM):
+		write_cb = write_cb_pcm;
+		break;
 	default:
 		child_warnx("invalid output type\n");
 		return (NULL);
 	}
-	if ((dec = FLAC__stream_decoder_new()) == NULL)
+	md5 = cdata->out->type == OUT_VERIFY;
+	if (cdata->dec == NULL
+	    && (cdata->dec = FLAC__stream_decoder_new()) == NULL)
 		child_fatal("malloc");
-	if (FLAC__stream_decoder_init_stream(dec, read_cb, NULL, NULL, NULL,
-	    NULL, write_cb, mdata_cb, err_cb, cdata)
+	if (FLAC__stream_decoder_get_state(cdata->dec)
+	    != FLAC__STREAM_DECODER_UNINITIALIZED) {
+		if (write_cb == cdata->write_cb && md5 == cdata->md5
+		    && FLAC__stream_decoder_reset(cdata->dec))
+			return (cdata->dec);
+		/* Different output, or reset ran out of memory. Start over. */
+		FLAC__stream_decoder_finish(cdata->dec);
+	}
+	FLAC__stream_decoder_set_md5_checking(cdata->dec, md5);
+	if (FLAC__stream_decoder_init_stream(cdata->dec, read_cb, seek_cb,
+	    tell_cb, length_cb, eof_cb, write_cb, mdata_cb, err_cb, cdata)
 	    != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
 		child_warnx("flac decoder: initialization failed");
 		return (NULL);
 	}
-	return (dec);
+	cdata->write_cb = write_cb;
+	cdata->md5 = md5;
+	child_stats->dec_inits++;
+	return (cdata->dec);
 }
 
 FLAC__StreamDecoderReadStatus
@@ -90,25 +151,29 @@ read_cb(const FLAC__StreamDecoder *dec, FLAC__byte *buf, size_t *len,
 	struct state		*state = cdata->state;
 	size_t			bytes_left, size, r_pos, w_pos, to_read, to_end;
 
-	state->callback = 1;
-	process_events(in, cdata->out, state);
-	state->callback = 0;
-
-	if (in->error)
-		return (FLAC__STREAM_DECODER_READ_STATUS_ABORT);
+	/*
+	 * If the decoder has caught up with the input, wait for more instead
+	 * of handing libFLAC an empty read.
+	 */
 	size = in->buf_size;
-	bytes_left = size - in->buf_free;
-	if (bytes_left < *len)
-		*len = bytes_left;
+	do {
+		state->callback = 1;
+		process_events();
+		state->callback = 0;
+		if (in->error)
+			return (FLAC__STREAM_DECODER_READ_STATUS_ABORT);
+		bytes_left = size - in->buf_free;
+	} while (bytes_left == 0 && !in->eof && in->fd != -1);
 	if (bytes_left == 0 && in->eof)
 		return (FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM);
+	if (bytes_left == 0)
+		/* The input file was closed after an error. */
+		return (FLAC__STREAM_DECODER_READ_STATUS_ABORT);
+	if (bytes_left < *len)
+		*len = bytes_left;
 	r_pos = in->read_pos;
 	w_pos = in->write_pos;
 	to_read = *len;
-	if (to_read == 0) {
-		child_warnx("input buffer is empty\n");
-		return (FLAC__STREAM_DECODER_READ_STATUS_CONTINUE);
-	}
 	if (r_pos + to_read <= size) {
 		memcpy(buf, in->buf + r_pos, to_read);
 	}
@@ -119,22 +184,89 @@ read_cb(const FLAC__StreamDecoder *dec, FLAC__byte *buf, size_t *len,
 	}
 	in->read_pos = (r_pos + to_read) % size;
 	in->buf_free += to_read;
+	TRACE(TR_READ_CB, bytes_left, to_read);
 	return (FLAC__STREAM_DECODER_READ_STATUS_CONTINUE);
 }
 
+/*
+ * The seek callbacks are only needed to start in the middle of a file; see
+ * seek_start().
+ */
+FLAC__StreamDecoderSeekStatus
+seek_cb(const FLAC__StreamDecoder *dec, FLAC__uint64 offset,
+    void *client_data)
+{
+	struct flac_client_data	*cdata = client_data;
+
+	if (cdata->in->noseek)
+		return (FLAC__STREAM_DECODER_SEEK_STATUS_UNSUPPORTED);
+	if (input_seek(cdata->in, (off_t)offset) == -1)
+		return (FLAC__STREAM_DECODER_SEEK_STATUS_ERROR);
+	return (FLAC__STREAM_DECODER_SEEK_STATUS_OK);
+}
+
+FLAC__StreamDecoderTellStatus
+tell_cb(const FLAC__StreamDecoder *dec, FLAC__uint64 *offset,
+    void *client_data)
+{
+	struct flac_client_data	*cdata = client_data;
+	off_t			pos;
+
+	if (cdata->in->noseek)
+		return (FLAC__STREAM_DECODER_TELL_STATUS_UNSUPPORTED);
+	if ((pos = input_tell(cdata->in)) == -1)
+		return (FLAC__STREAM_DECODER_TELL_STATUS_ERROR);
+	*offset = (FLAC__uint64)pos;
+	return (FLAC__STREAM_DECODER_TELL_STATUS_OK);
+}
+
+FLAC__StreamDecoderLengthStatus
+length_cb(const FLAC__StreamDecoder *dec, FLAC__uint64 *length,
+    void *client_data)
+{
+	struct flac_client_data	*cdata = client_data;
+	struct stat		sb;
+
+	if (cdata->in->fd == -1 || fstat(cdata->in->fd, &sb) == -1
+	    || !S_ISREG(sb.st_mode))
+		return (FLAC__STREAM_DECODER_LENGTH_STATUS_UNSUPPORTED);
+	*length = (FLAC__uint64)sb.st_size;
+	return (FLAC__STREAM_DECODER_LENGTH_STATUS_OK);
+}
+
+FLAC__bool
+eof_cb(const FLAC__StreamDecoder *dec, void *client_data)
+{
+	struct flac_client_data	*cdata = client_data;
+
+	return (input_done(cdata->in));
+}
+
+/* input_done: Tell if everything in the input file has been read. */
+static int
+input_done(struct input *in)
+{
+	return (in->eof && in->buf_free == in->buf_size);
+}
+
 void
 mdata_cb(const FLAC__StreamDecoder *dec, const FLAC__StreamMetadata *mdata,
     void *client_data)
 {
 	struct flac_client_data	*cd;
+	static const FLAC__byte	unsigned_md5[16];
 
 	cd = (struct flac_client_data *)client_data;
 	if (mdata->type == FLAC__METADATA_TYPE_STREAMINFO) {
 		cd->samples = mdata->data.stream_info.total_samples;
+		/* Encoders that don't compute the MD5 leave it 0. */
+		cd->md5_signed = memcmp(mdata->data.stream_info.md5sum,
+		    unsigned_md5, sizeof(unsigned_md5)) != 0;
 		cd->rate = mdata->data.stream_info.sample_rate;
 		cd->channels = mdata->data.stream_info.channels;
 		cd->bps = mdata->data.stream_info.bits_per_sample;
 		cd->max_bsize = mdata->data.stream_info.max_blocksize;
+		cd->max_fsize = mdata->data.stream_info.max_framesize;
 		if (cd->max_bsize == 0)
 			/*
 			 * Maximal blocksize unknown. Use the maximal size
@@ -144,29 +276,34 @@ mdata_cb(const FLAC__StreamDecoder *dec, const FLAC__StreamMetadata *mdata,
 	}
 }
 
+/*
+ * write_cb_file: Pack the block into the sample buffer and queue it for the
+ * writer thread, which writes it out while the next block is decoded.
+ */
 FLAC__StreamDecoderWriteStatus
 write_cb_file(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame,
     const FLAC__int32 *const decoded_samples[], void *client_data)
 {
 	struct flac_client_data	*cdata;
-	FILE			*outfp;
-	unsigned int		channels, bsiz, bps, chan, samp;
-	const FLAC__int32	*sample;
+	struct sample_buf	*sbuf;
+	size_t			nput, len;
 
 	cdata = (struct flac_client_data *)client_data;
-	outfp = cdata->out->handle.fp;
-	bsiz = frame->header.blocksize;
-	bps = frame->header.bits_per_sample/8;
-	channels = frame->header.channels;
-	for (samp = 0; samp < bsiz; samp++)
-		for (chan = 0; chan < channels; chan++) {
-			sample = &decoded_samples[chan][samp];
-			if (fwrite(sample, bps, 1, outfp) < 1) {
-				return
-				    (FLAC__STREAM_DECODER_WRITE_STATUS_ABORT);
-			}
-			cdata->bytes_written += bps;
-		}
+	sbuf = cdata->sbuf;
+	if (frame->header.bits_per_sample != cdata->bps
+	    || frame->header.channels != cdata->channels)
+		return (FLAC__STREAM_DECODER_WRITE_STATUS_ABORT);
+	nput = sbuf_put(sbuf, decoded_samples, frame->header.blocksize);
+	len = nput * sbuf->framesize;
+	sbuf_clear(sbuf);
+	if (nput < frame->header.blocksize
+	    || writer_write(&cdata->writer, sbuf->buf, len) == -1)
+		return (FLAC__STREAM_DECODER_WRITE_STATUS_ABORT);
+	tee_put(cdata->tee, decoded_samples, nput);
+	cdata->bytes_written += len;
+	child_stats->frames_decoded++;
+	child_stats->sample_pos += nput;
+	child_stats->pcm_bytes += len;
 	return (FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE);
 }
 
@@ -186,6 +323,74 @@ write_cb_sndio(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame,
 	nput = sbuf_put(cdata->sbuf, decoded_samples, frame->header.blocksize);
 	if (nput < frame->header.blocksize)
 		child_fatalx("Sample buffer full.");
+	tee_put(cdata->tee, decoded_samples, nput);
+	child_stats->frames_decoded++;
+	child_stats->pcm_bytes += nput * cdata->sbuf->framesize;
+	TRACE(TR_WRITE_CB_SNDIO, frame->header.blocksize, cdata->sbuf->free);
+	return (FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE);
+}
+
+/*
+ * write_cb_null: Pack the samples into the sample buffer like
+ * write_cb_sndio, then throw them away. This measures the decoder without
+ * the cost of any output device.
+ */
+FLAC__StreamDecoderWriteStatus
+write_cb_null(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame,
+    const FLAC__int32 *const decoded_samples[], void *client_data)
+{
+	struct flac_client_data	*cdata;
+	size_t			nput;
+
+	cdata = (struct flac_client_data *)client_data;
+	if (frame->header.bits_per_sample != cdata->bps)
+		child_fatalx("FLAC files with variable bps are not supported.");
+	if (frame->header.channels != cdata->channels)
+		child_fatalx("FLAC files with a variable number of channels are"
+		    " not supported.");
+	nput = sbuf_put(cdata->sbuf, decoded_samples, frame->header.blocksize);
+	if (nput < frame->header.blocksize)
+		child_fatalx("Sample buffer full.");
+	sbuf_clear(cdata->sbuf);
+	tee_put(cdata->tee, decoded_samples, nput);
+	child_stats->frames_decoded++;
+	child_stats->sample_pos += nput;
+	child_stats->pcm_bytes += nput * cdata->sbuf->framesize;
+	return (FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE);
+}
+
+/*
+ * write_cb_pcm: Pack the samples like write_cb_null, append them to the
+ * shared ring and tell the parent. step_file() made sure they fit.
+ */
+FLAC__StreamDecoderWriteStatus
+write_cb_pcm(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame,
+    const FLAC__int32 *const decoded_samples[], void *client_data)
+{
+	struct flac_client_data	*cdata;
+	struct sample_buf	*sbuf;
+	size_t			nput;
+
+	cdata = (struct flac_client_data *)client_data;
+	sbuf = cdata->sbuf;
+	if (frame->header.bits_per_sample != cdata->bps)
+		child_fatalx("FLAC files with variable bps are not supported.");
+	if (frame->header.channels != cdata->channels)
+		child_fatalx("FLAC files with a variable number of channels are"
+		    " not supported.");
+	nput = sbuf_put(sbuf, decoded_samples, frame->header.blocksize);
+	if (nput < frame->header.blocksize)
+		child_fatalx("Sample buffer full.");
+	pcm_ring_write(cdata->out->handle.pcm, sbuf->buf,
+	    nput * sbuf->framesize);
+	sbuf_clear(sbuf);
+	tee_put(cdata->tee, decoded_samples, nput);
+	set_reply_id(cdata->state->play_id);
+	enqueue_binary_message(MSG_PCM, NULL, 0);
+	set_reply_id(0);
+	child_stats->frames_decoded++;
+	child_stats->sample_pos += nput;
+	child_stats->pcm_bytes += nput * sbuf->framesize;
 	return (FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE);
 }
 
@@ -198,71 +403,270 @@ err_cb(const FLAC__StreamDecoder *dec,
 	cd = (struct flac_client_data *)client_data;
 	cd->error = 1;
 	cd->error_status = status;
+	/* The decoder skips ahead to the next frame; count what it skipped. */
+	if (status == FLAC__STREAM_DECODER_ERROR_STATUS_FRAME_CRC_MISMATCH)
+		cd->crc_errors++;
+	else
+		cd->sync_errors++;
+}
+
+/*
+ * end_play: Stop the writer thread and give the sample buffer back to the
+ * pool. The decoder is left as it is; init_flac_decoder() resets it for
+ * the next track.
+ */
+static void
+end_play(struct flac_client_data *cdata, struct state *state)
+{
+	writer_finish(&cdata->writer);
+	if (cdata->sbuf != NULL)
+		sbuf_release(cdata->sbuf);
+	cdata->sbuf = NULL;
+	state->sbuf = NULL;
+	if (cdata->native) {
+		frame_dec_free(&cdata->frames);
+		free(cdata->nbuf);
+		cdata->nbuf = NULL;
+		cdata->native = 0;
+	}
+}
+
+/*
+ * native_start: Hand the file over to the in-tree decoder once libFLAC has
+ * read the metadata. It goes on from where the metadata ends, so the input
+ * has to seek. Returns 0 if it is ready and -1 if libFLAC has to carry on.
+ */
+static int
+native_start(struct flac_client_data *cdata)
+{
+	FLAC__uint64	pos;
+
+	if (cdata->bps > FRAME_MAX_BPS || cdata->in->noseek
+	    || !FLAC__stream_decoder_get_decode_position(cdata->dec, &pos))
+		return (-1);
+	/*
+	 * Encoders fall back to verbatim subframes, so frames are hardly ever
+	 * bigger than this. native_step() makes room if one is.
+	 */
+	cdata->frame_size = (size_t)cdata->max_bsize * cdata->channels *
+	    (cdata->bps + 1) / 8 + cdata->channels * 2 + FRAME_MAX_HEADER + 2;
+	cdata->max_frame = cdata->frame_size;
+	cdata->nbuf_size = 2 * cdata->max_frame;
+	cdata->nbuf_len = cdata->nbuf_pos = 0;
+	cdata->native_eof = 0;
+	if ((cdata->nbuf = malloc(cdata->nbuf_size)) == NULL)
+		child_fatal("malloc");
+	if (frame_dec_init(&cdata->frames, cdata->max_bsize, cdata->bps,
+	    cdata->rate) == -1)
+		child_fatal("malloc");
+	if (input_seek(cdata->in, (off_t)pos) == -1) {
+		frame_dec_free(&cdata->frames);
+		free(cdata->nbuf);
+		cdata->nbuf = NULL;
+		return (-1);
+	}
+	return (0);
+}
+
+/* native_fill: Move what is left in nbuf to the front and top it up. */
+static void
+native_fill(struct flac_client_data *cdata)
+{
+	size_t	n;
+
+	n = cdata->nbuf_len - cdata->nbuf_pos;
+	memmove(cdata->nbuf, cdata->nbuf + cdata->nbuf_pos, n);
+	cdata->nbuf_len = n;
+	cdata->nbuf_pos = 0;
+	n = peek_inbuf(cdata->in, cdata->nbuf + cdata->nbuf_len,
+	    cdata->nbuf_size - cdata->nbuf_len);
+	cdata->nbuf_len += drop_inbuf(cdata->in, n);
+}
+
+/*
+ * native_step: Decode a frame with the in-tree decoder and pass it to the
+ * write callback, like FLAC__stream_decoder_process_single() does. A frame
+ * is only decoded once nbuf holds max_frame bytes or the rest of the file;
+ * until then, native_step() does nothing. Broken frames go through err_cb()
+ * and are skipped as libFLAC would. Returns 0 if decoding has to stop.
+ */
+static int
+native_step(struct flac_client_data *cdata)
+{
+	struct input		*in = cdata->in;
+	struct frame_hdr	*h = &cdata->frames.hdr;
+	FLAC__Frame		frame;
+	unsigned char		*buf;
+	size_t			avail, used, skip;
+	size_t			limit;
+	int			rv;
+
+	avail = cdata->nbuf_len - cdata->nbuf_pos;
+	if (avail < cdata->max_frame) {
+		native_fill(cdata);
+		avail = cdata->nbuf_len;
+		if (in->error || (in->fd == -1 && !in->eof))
+			return (0);
+		if (avail < cdata->max_frame && !input_done(in))
+			return (1);
+	}
+	if (avail == 0) {
+		cdata->native_eof = 1;
+		return (1);
+	}
+	buf = cdata->nbuf + cdata->nbuf_pos;
+	rv = frame_decode(&cdata->frames, buf, avail, &used);
+	/* No frame is bigger than STREAMINFO says, if it says anything. */
+	limit = cdata->max_fsize != 0 ? cdata->max_fsize : FRAME_MAX_SIZE;
+	if (rv == FRAME_SHORT && !input_done(in) && cdata->max_frame < limit) {
+		/* Bigger than verbatim, which is allowed. Wait for the rest. */
+		cdata->max_frame = 2 * cdata->max_frame < limit ?
+		    2 * cdata->max_frame : limit;
+		if (2 * cdata->max_frame > cdata->nbuf_size) {
+			cdata->nbuf_size = 2 * cdata->max_frame;
+			if ((cdata->nbuf = realloc(cdata->nbuf,
+			    cdata->nbuf_size)) == NULL)
+				child_fatal("realloc");
+		}
+		return (1);
+	}
+	/* Wait for the usual amount again once this frame is dealt with. */
+	cdata->max_frame = cdata->frame_size;
+	if (rv == FRAME_SHORT || rv == FRAME_SYNC) {
+		err_cb(NULL, FLAC__STREAM_DECODER_ERROR_STATUS_LOST_SYNC,
+		    cdata);
+		/* A header cut off at the end of nbuf is looked at again. */
+		skip = 1 + frame_find(buf + 1, avail - 1);
+		if (!input_done(in) && skip > avail - FRAME_MAX_HEADER)
+			skip = avail - FRAME_MAX_HEADER;
+		cdata->nbuf_pos += skip;
+		return (1);
+	}
+	if (rv == FRAME_CRC)
+		err_cb(NULL,
+		    FLAC__STREAM_DECODER_ERROR_STATUS_FRAME_CRC_MISMATCH,
+		    cdata);
+	cdata->nbuf_pos += used;
+	memset(&frame, 0, sizeof(frame));
+	frame.header.blocksize = h->blocksize;
+	frame.header.sample_rate = h->rate != 0 ? h->rate : cdata->rate;
+	frame.header.channels = h->channels;
+	frame.header.bits_per_sample = h->bps != 0 ? h->bps : cdata->bps;
+	return (cdata->write_cb(NULL, &frame,
+	    (const FLAC__int32 *const *)cdata->frames.chan, cdata)
+	    == FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE);
+}
+
+/* decode_frame: Decode the next frame with whichever decoder has the file. */
+static int
+decode_frame(struct flac_client_data *cdata)
+{
+	if (cdata->native)
+		return (native_step(cdata));
+	return (FLAC__stream_decoder_process_single(cdata->dec));
 }
 
+/* at_end: Tell if the whole file has been decoded. */
+static int
+at_end(struct flac_client_data *cdata)
+{
+	if (cdata->native)
+		return (cdata->native_eof);
+	return (FLAC__stream_decoder_get_state(cdata->dec)
+	    == FLAC__STREAM_DECODER_END_OF_STREAM);
+}
+
+/*
+ * start_flac: Get a stream ready to play: read the metadata and set up the
+ * output. The decoder and its client data stay with the stream, so the
+ * client data keeps its address. Returns 0 on success and -1 on error.
+ */
 int
-play_flac(struct input *in, struct out *out, struct state *state)
+start_flac(struct stream *s)
 {
-	struct flac_client_data		cdata;
+	struct flac_client_data		*cdata;
+	struct out			*out = &s->out;
 	struct sio_par			par;
+	struct pcm_ring			*ring;
 	FLAC__StreamDecoder		*dec;
-	int				decode_done = 0;
-
-	state->play = PLAYING;
-	state->callback = 0;
-	cdata.in = in;
-	cdata.state = state;
-	cdata.out = out;
-	cdata.error = 0;
-	cdata.bytes_written = 0;
-	cdata.sbuf = NULL;
-	if ((dec = init_flac_decoder(&cdata)) == NULL)
+	size_t				sbuf_size;
+
+	if (s->dec == NULL
+	    && (s->dec = calloc(1, sizeof(struct flac_client_data))) == NULL)
+		child_fatal("calloc");
+	cdata = s->dec;
+	s->state.play = PLAYING;
+	s->state.callback = 0;
+	cdata->in = &s->in;
+	cdata->state = &s->state;
+	cdata->out = out;
+	cdata->tee = &s->tee;
+	cdata->error = 0;
+	cdata->crc_errors = cdata->sync_errors = 0;
+	cdata->md5_signed = 0;
+	cdata->bytes_written = 0;
+	cdata->sbuf = NULL;
+	cdata->decode_done = cdata->starved = 0;
+	cdata->native = 0;
+	if ((dec = init_flac_decoder(cdata)) == NULL)
 		return (-1);
 	if (FLAC__stream_decoder_process_until_end_of_metadata(dec) == false) {
-		if (cdata.error)
-			flac_error_msg(cdata.error_status);
-		cleanup_flac_decoder(dec);
+		if (cdata->error)
+			flac_error_msg(cdata->error_status);
 		return (-1);
 	}
-	/* If the output is to a file, we just decode in one go. */
-	if (out->type == OUT_WAV_FILE || out->type == OUT_RAW) {
-		if (out->type == OUT_WAV_FILE) {
-			if (cdata.samples > UINT32_MAX)
-				return (-1);
-			cdata.bytes_written += write_wav_header(out->handle.fp,
-			    cdata.channels, cdata.rate, cdata.bps,
-			    cdata.samples);
+	/* OUT_VERIFY needs libFLAC's MD5, and seeking is left to libFLAC. */
+	if (flac_decoder == FLAC_DEC_NATIVE && out->type != OUT_VERIFY
+	    && s->state.start_pos == 0)
+		cdata->native = native_start(cdata) == 0;
+	switch (out->type) {
+	case (OUT_PCM):
+		ring = out->handle.pcm;
+		if (ring->size < cdata->max_bsize * cdata->channels *
+		    (cdata->bps / 8)) {
+			child_warnx("PCM buffer too small");
+			return (-1);
 		}
-		if (FLAC__stream_decoder_process_until_end_of_stream(dec)
-		    == false) {
-			if (cdata.error)
-				flac_error_msg(cdata.error_status);
-			cleanup_flac_decoder(dec);
+		ring->rate = cdata->rate;
+		ring->channels = cdata->channels;
+		ring->bits = cdata->bps;
+		/* Fallthrough */
+	case (OUT_NULL):
+	case (OUT_VERIFY):
+	case (OUT_WAV_FILE):
+	case (OUT_RAW):
+		/* Samples are packed into a buffer for one block. */
+		cdata->sbuf = sbuf_acquire(cdata->bps/8, cdata->channels,
+		    cdata->max_bsize);
+		if (cdata->sbuf == NULL)
+			child_fatal("malloc");
+		if (out->type == OUT_WAV_FILE && write_header(cdata) == -1) {
+			end_play(cdata, &s->state);
 			return (-1);
 		}
-		if (out->type == OUT_WAV_FILE) {
-			/* Check if we need a padding byte for WAVE. */
-			if (out->type == OUT_WAV_FILE
-			    && cdata.bytes_written % 2 != 0
-			    && fwrite("\0", 1, 1, out->handle.fp) < 1)
-				return (-1);
+		/* The samples go around stdio, to the writer thread. */
+		if ((out->type == OUT_WAV_FILE || out->type == OUT_RAW)
+		    && (fflush(out->handle.fp) == EOF
+		    || writer_start(&cdata->writer, fileno(out->handle.fp))
+		    == -1)) {
+			child_warnx("can't start writer");
+			end_play(cdata, &s->state);
+			return (-1);
 		}
-		if (fclose(out->handle.fp))
-			child_warn("fclose");
-		cleanup_flac_decoder(dec);
-		enqueue_message(MSG_DONE, "");
-		return (0);
+		tee_start(&s->tee, cdata->bps, cdata->channels, cdata->rate,
+		    cdata->samples, cdata->max_bsize, 0);
+		return (seek_start(s));
 	}
 
 	/* We decode to a sndio device. First, it needs to be configured. */
 	sio_initpar(&par);
-	par.bits = cdata.bps;
-	par.bps = SIO_BPS(cdata.bps);
+	par.bits = cdata->bps;
+	par.bps = SIO_BPS(cdata->bps);
 	par.sig = 1;
 	par.le = SIO_LE_NATIVE;
-	par.pchan = cdata.channels;
-	par.rate = cdata.rate;
-	par.appbufsz = (cdata.rate * 200) / 1000; /* 200 ms buffer */
+	par.pchan = cdata->channels;
+	par.rate = cdata->rate;
+	par.appbufsz = (cdata->rate * 200) / 1000; /* 200 ms buffer */
 	par.xrun = SIO_IGNORE;
 	if (sio_setpar(out->handle.sio, &par) == 0)
 		child_fatalx("sio_setpar: failed");
@@ -273,20 +677,19 @@ play_flac(struct input *in, struct out *out, struct state *state)
 	 */
 	if (sio_getpar(out->handle.sio, &par) == 0)
 		child_fatal("sio_getpar");
-	if (par.bits != cdata.bps || par.bps != cdata.bps/8
+	if (par.bits != cdata->bps || par.bps != cdata->bps/8
 	    || par.sig != 1 || par.le != 1
-	    || par.pchan != cdata.channels || par.xrun != SIO_IGNORE
-	    || par.appbufsz != (cdata.rate * 200) / 1000
-	    || par.rate < (995*cdata.rate)/1000
-	    || par.rate > (1005*cdata.rate)/1000) {
+	    || par.pchan != cdata->channels || par.xrun != SIO_IGNORE
+	    || par.appbufsz != (cdata->rate * 200) / 1000
+	    || par.rate < (995*cdata->rate)/1000
+	    || par.rate > (1005*cdata->rate)/1000) {
 		child_fatalx("setting sndio parameters failed");
 	}
 	/* Prepare the buffer for the samples. */
-	size_t	sbuf_size;
-	if (par.appbufsz > cdata.max_bsize)
+	if (par.appbufsz > cdata->max_bsize)
 		sbuf_size = 3*par.appbufsz;
 	else
-		sbuf_size = 3*cdata.max_bsize;
+		sbuf_size = 3*cdata->max_bsize;
 	/*
 	 * Audio devices process frames not one by one, but in blocks.
 	 * This blocksize is stored in par.round. According to www.sndio.org,
@@ -294,89 +697,248 @@ play_flac(struct input *in, struct out *out, struct state *state)
 	 */
 	sbuf_size += par.round - 1;
 	sbuf_size = sbuf_size - (sbuf_size % par.round);
-	cdata.sbuf = sbuf_new(cdata.bps/8, cdata.channels, sbuf_size);
-	if (cdata.sbuf == NULL)
+	cdata->sbuf = sbuf_acquire(cdata->bps/8, cdata->channels, sbuf_size);
+	if (cdata->sbuf == NULL)
 		child_fatal("calloc");
+	s->state.sbuf = cdata->sbuf;
+	tee_start(&s->tee, cdata->bps, cdata->channels, cdata->rate,
+	    cdata->samples, cdata->max_bsize, 1);
+	if (seek_start(s) == -1)
+		return (-1);
 	if (sio_start(out->handle.sio) == 0)
 		child_fatalx("sio_start: failed\n");
+	return (0);
+}
 
-	while (1) {
-		process_events(in, out, state);
-		switch (state->play) {
-		case (RESUME):
-			state->play = PLAYING;
-			if (out->type == OUT_SNDIO &&
-			    sio_start(out->handle.sio) == 0)
-				child_fatalx("sio_start: failed\n");
-			/* Fallthrough */
-		case (PLAYING):
-			/* sndio output */
-			if (out->type == OUT_SNDIO && out->ready &&
-			    sbuf_sio_write(cdata.sbuf, out->handle.sio)) {
-				child_fatalx("sio_write: failed");
-			}
-			if (decode_done
-			    && cdata.sbuf->free == cdata.sbuf->size) {
-				sio_stop(out->handle.sio);
-				cleanup_flac_decoder(dec);
-				enqueue_message(MSG_DONE, "");
-				return (0);
-			}
-			if (!decode_done
-			    && cdata.sbuf->free >= cdata.max_bsize) {
-				if (FLAC__stream_decoder_process_single(dec)
-				    == false) {
-					if (cdata.error)
-						flac_error_msg(cdata.error_status);
-					cleanup_flac_decoder(dec);
-					return (-1);
-				}
-			}
-			if (FLAC__stream_decoder_get_state(dec)
-			    == FLAC__STREAM_DECODER_END_OF_STREAM) {
-				decode_done = 1;
-			}
-			break;
-		case (PAUSING):
-			/*
-			 * If there's space available, decode another block and
-			 * put it in the buffer.
-			 */
-			if (out->type == OUT_SNDIO &&
-			    sio_stop(out->handle.sio) == 0)
-				child_fatalx("sio_stop: failed\n");
-			state->play = PAUSED;
-			/* Fallthrough */
-		case (PAUSED):
-			break;
-		case (STOPPED):
-			if (out->type == OUT_SNDIO &&
-			    sio_stop(out->handle.sio) == 0)
-				child_fatalx("sio_stop: failed\n");
-			cleanup_flac_decoder(dec);
-			return (0);
-		default:
-			child_fatal("unknown state");
-		}
+/*
+ * write_header: Write the WAVE header. If the STREAMINFO block doesn't give
+ * the number of samples, the header says "until EOF" and is fixed up at
+ * the end if the output can seek. Returns 0 on success and -1 on error.
+ */
+static int
+write_header(struct flac_client_data *cdata)
+{
+	int	len;
+
+	len = write_wav_header(cdata->out->handle.fp, cdata->channels,
+	    cdata->rate, cdata->bps, cdata->samples != 0 ? cdata->samples :
+	    WAV_UNKNOWN_LENGTH);
+	if (len == -1) {
+		child_warnx("can't write WAVE header");
+		return (-1);
 	}
+	cdata->bytes_written += len;
+	cdata->hdr_len = len;
+	return (0);
 }
 
-static void
-cleanup_flac_decoder(FLAC__StreamDecoder *dec)
+/*
+ * seek_start: If CMD_PLAY asked for a start position, skip to it. The
+ * decoder delivers the rest of the frame it lands in, so the output has to
+ * be ready. Returns 0 on success and -1 on error.
+ */
+static int
+seek_start(struct stream *s)
+{
+	struct flac_client_data	*cdata = s->dec;
+	uint64_t		pos = s->state.start_pos;
+
+	if (pos == 0)
+		return (0);
+	if (cdata->samples != 0 && pos >= cdata->samples) {
+		child_warnx("start position beyond end of file");
+		end_play(cdata, &s->state);
+		return (-1);
+	}
+	/* The frames written while seeking count from here. */
+	child_stats->sample_pos = pos;
+	if (FLAC__stream_decoder_seek_absolute(cdata->dec, pos) == false) {
+		if (cdata->error)
+			flac_error_msg(cdata->error_status);
+		child_warnx("seek failed");
+		end_play(cdata, &s->state);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * step_flac: Do a bit of work on a stream that start_flac() got ready and
+ * return PLAY_MORE until it is done. Each call decodes at most one block,
+ * so other streams get their turn.
+ */
+int
+step_flac(struct stream *s)
+{
+	struct flac_client_data	*cdata = s->dec;
+	struct state		*state = &s->state;
+	struct out		*out = &s->out;
+
+	switch (state->play) {
+	case (RESUME):
+		state->play = PLAYING;
+		if (out->type == OUT_SNDIO &&
+		    sio_start(out->handle.sio) == 0)
+			child_fatalx("sio_start: failed\n");
+		/* Fallthrough */
+	case (PLAYING):
+		break;
+	case (PAUSING):
+		if (out->type == OUT_SNDIO &&
+		    sio_stop(out->handle.sio) == 0)
+			child_fatalx("sio_stop: failed\n");
+		state->play = PAUSED;
+		/* Fallthrough */
+	case (PAUSED):
+		return (PLAY_MORE);
+	case (STOPPED):
+		if (out->type == OUT_SNDIO &&
+		    sio_stop(out->handle.sio) == 0)
+			child_fatalx("sio_stop: failed\n");
+		end_play(cdata, state);
+		return (PLAY_STOPPED);
+	default:
+		child_fatal("unknown state");
+	}
+	if (out->type == OUT_SNDIO)
+		return (step_sndio(cdata));
+	return (step_file(cdata));
+}
+
+/*
+ * step_file: Decode the next block to a file, the PCM ring or nowhere. To
+ * keep the decoder from waiting for input in read_cb(), wait until the
+ * input buffer is full.
+ */
+static int
+step_file(struct flac_client_data *cdata)
 {
-	if (!(FLAC__stream_decoder_finish(dec)))
-		child_warnx("flac decoder: bad MD5 checksum\n");
-	FLAC__stream_decoder_delete(dec);
+	struct input	*in = cdata->in;
+	struct out	*out = cdata->out;
+	struct timespec	dec_start, dec_end;
+	uint64_t	data_size;
+	unsigned int	framesize;
+
+	tee_flush(cdata->tee);
+	/* The in-tree decoder needn't wait while it has a whole frame. */
+	if (in->buf_free > 0 && !in->eof && in->fd != -1 && (!cdata->native
+	    || cdata->nbuf_len - cdata->nbuf_pos < cdata->max_frame))
+		return (PLAY_MORE);
+	/* Nothing is played in real time, so the taps can hold us up. */
+	if (!tee_room(cdata->tee, cdata->max_bsize))
+		return (PLAY_MORE);
+	/* Wait for the parent to make room for a whole block. */
+	if (out->type == OUT_PCM && pcm_ring_space(out->handle.pcm)
+	    < cdata->max_bsize * cdata->sbuf->framesize)
+		return (PLAY_MORE);
+	clock_gettime(CLOCK_MONOTONIC, &dec_start);
+	if (decode_frame(cdata) == false) {
+		if (cdata->error)
+			flac_error_msg(cdata->error_status);
+		end_play(cdata, cdata->state);
+		return (PLAY_ERROR);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &dec_end);
+	stats_decode_time(&dec_start, &dec_end);
+	if (!at_end(cdata))
+		return (PLAY_MORE);
+
+	/* Check if we need a padding byte for WAVE. */
+	if (out->type == OUT_WAV_FILE && cdata->bytes_written % 2 != 0
+	    && writer_write(&cdata->writer, "\0", 1) == -1) {
+		end_play(cdata, cdata->state);
+		return (PLAY_ERROR);
+	}
+	if (writer_finish(&cdata->writer) == -1) {
+		child_warnx("write failed");
+		end_play(cdata, cdata->state);
+		return (PLAY_ERROR);
+	}
+	end_play(cdata, cdata->state);
+	if (out->type == OUT_NULL)
+		return (PLAY_DONE);
+	if (out->type == OUT_VERIFY) {
+		report_verify(cdata);
+		return (PLAY_DONE);
+	}
+	if (out->type == OUT_PCM) {
+		/* Like an output file, the ring is used only once. */
+		pcm_ring_free(out->handle.pcm, out->handle.pcm->size);
+		out->handle.pcm = NULL;
+		out->type = NONE;
+		return (PLAY_DONE);
+	}
+	/*
+	 * Fix up the header if the length was unknown or the data came out
+	 * shorter, like after a seek. stdio doesn't know where the writer
+	 * left off.
+	 */
+	framesize = cdata->channels * cdata->bps/8;
+	data_size = cdata->bytes_written - cdata->hdr_len;
+	if (out->type == OUT_WAV_FILE && (cdata->samples == 0
+	    || data_size != cdata->samples * framesize)
+	    && fseeko(out->handle.fp, 0, SEEK_END) == 0)
+		patch_wav_header(out->handle.fp, cdata->hdr_len, data_size,
+		    framesize);
+	/* The output file is finished and can't be used again. */
+	if (fclose(out->handle.fp))
+		child_warn("fclose");
+	out->handle.fp = NULL;
+	out->type = NONE;
+	return (PLAY_DONE);
+}
+
+/* step_sndio: Feed the sndio device and decode when there is space. */
+static int
+step_sndio(struct flac_client_data *cdata)
+{
+	struct out	*out = cdata->out;
+	struct timespec	dec_start, dec_end;
+
+	tee_flush(cdata->tee);
+	/*
+	 * Count an underrun whenever the device asks for samples while the
+	 * sample buffer is empty.
+	 */
+	if (out->ready && !cdata->decode_done
+	    && cdata->sbuf->free == cdata->sbuf->size) {
+		if (!cdata->starved)
+			child_stats->underruns++;
+		cdata->starved = 1;
+	}
+	else
+		cdata->starved = 0;
+	if (out->ready && sbuf_sio_write(cdata->sbuf, out->handle.sio))
+		child_fatalx("sio_write: failed");
+	if (cdata->decode_done && cdata->sbuf->free == cdata->sbuf->size) {
+		sio_stop(out->handle.sio);
+		end_play(cdata, cdata->state);
+		return (PLAY_DONE);
+	}
+	if (!cdata->decode_done && cdata->sbuf->free >= cdata->max_bsize) {
+		clock_gettime(CLOCK_MONOTONIC, &dec_start);
+		if (decode_frame(cdata) == false) {
+			if (cdata->error)
+				flac_error_msg(cdata->error_status);
+			end_play(cdata, cdata->state);
+			return (PLAY_ERROR);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &dec_end);
+		stats_decode_time(&dec_start, &dec_end);
+	}
+	if (at_end(cdata))
+		cdata->decode_done = 1;
+	return (PLAY_MORE);
 }
 
 int
 extract_meta_flac(struct input *in)
 {
 	off_t		prev_pos;
-	unsigned char	mdata_hdr[4], str_info[34], id3_hdr[10], *mdata = NULL;
+	unsigned char	mdata_hdr[4], str_info[34], id3_hdr[10];
 	size_t		len;
 	u_int64_t	rate, samples, t; /* t = time in s (samples/rate) */
-	char		*t_str;
+	char		t_str[32];
 	int		fd, rv, id3v2_found = 0;
 
 	fd = in->fd;
@@ -397,14 +959,13 @@ extract_meta_flac(struct input *in)
 	if (memcmp(id3_hdr, "ID3", 3) == 0) {
 		len = (id3_hdr[6] << 21) + (id3_hdr[7] << 14) +
 		    (id3_hdr[8] << 7) + id3_hdr[9];
-		if ((mdata = malloc(len)) == NULL)
-			child_fatal("malloc");
-		if (read(fd, mdata, len) < len) {
-			file_err(in, "read");
+		if ((rv = parse_id3v2(fd, id3_hdr[5], len)) == -1) {
+			file_errx(in, "malformed ID3v2 tag.");
 			return (-1);
 		}
-		if ((rv = parse_id3v2(id3_hdr[5], mdata, len)) == -1) {
-			file_errx(in, "malformed ID3v2 tag.");
+		/* The parser may stop early, at the padding. */
+		if (lseek(fd, sizeof(id3_hdr) + len, SEEK_SET) < 0) {
+			file_err(in, "lseek");
 			return (-1);
 		}
 		id3v2_found = 1;
@@ -447,17 +1008,18 @@ extract_meta_flac(struct input *in)
 		/* 0 samples means an unknown number. */
 		enqueue_message(META_TIME, "?");
 	else {
-		int	len;
 		t = samples/rate;
-		len = asprintf(&t_str, "%u:%02u", (unsigned int)(t/60),
-		    (unsigned int)(t % 60)); /* m:s */
-		if (len == -1)
-			child_fatal("malloc");
+		(void)snprintf(t_str, sizeof(t_str), "%u:%02u",
+		    (unsigned int)(t/60), (unsigned int)(t % 60)); /* m:s */
 		enqueue_message(META_TIME, t_str);
-		free(t_str);
 	}
-	if (id3v2_found)
+	if (id3v2_found) {
+		if (lseek(fd, prev_pos, SEEK_SET) < 0) {
+			file_err(in, "lseek");
+			return (-1);
+		}
 		goto done;
+	}
 
 	/* Look for the VORBIS_COMMENT block. */
 	while (1) {
@@ -468,19 +1030,12 @@ extract_meta_flac(struct input *in)
 		}
 		if ((mdata_hdr[0] & 0x7f) == 4) {
 			/* Found a VORBIS_COMMENT block. */
-			len = blocksize(mdata_hdr);
-			if ((mdata = malloc(len)) == NULL)
-				child_fatal("malloc");
-			if (read(fd, mdata, len) < len) {
-				file_err(in, "read");
-				return (-1);
-			}
+			rv = parse_vorbis_comment(fd, blocksize(mdata_hdr));
 			/* Return to the previous position in the file. */
 			if (lseek(fd, prev_pos, SEEK_SET) < 0) {
 				file_err(in, "lseek");
 				return (-1);
 			}
-			rv = parse_vorbis_comment(mdata, len);
 			goto done;
 		}
 		else if (mdata_hdr[0] & 0x80) {
@@ -502,10 +1057,74 @@ extract_meta_flac(struct input *in)
 	}
 
 done:
-	free(mdata);
 	return (rv);
 }
 
+/*
+ * extract_picture_flac: Find the front cover, or else the first picture,
+ * in the ID3v2 tag and the PICTURE blocks and tell the parent where its
+ * data is. Only headers are read; everything else is skipped.
+ */
+int
+extract_picture_flac(struct input *in)
+{
+	struct picture_loc	loc, found;
+	off_t			prev_pos, pos;
+	unsigned char		hdr[10];
+	size_t			len;
+	int			fd, rv, have = 0;
+
+	fd = in->fd;
+	if ((prev_pos = lseek(fd, 0, SEEK_CUR)) == -1
+	    || lseek(fd, 0, SEEK_SET) == -1) {
+		child_warn("lseek");
+		return (-1);
+	}
+	if (read(fd, hdr, sizeof(hdr)) < (ssize_t)sizeof(hdr))
+		goto bad;
+	pos = 0;
+	if (memcmp(hdr, "ID3", 3) == 0) {
+		len = (hdr[6] << 21) + (hdr[7] << 14) + (hdr[8] << 7) + hdr[9];
+		if ((rv = find_picture_id3v2(fd, hdr[5], len, &found)) == -1)
+			goto bad;
+		have = rv;
+		pos = sizeof(hdr) + len;
+	}
+	/* Skip "fLaC". */
+	pos += 4;
+	while (!have || found.type != PICTURE_FRONT_COVER) {
+		if (lseek(fd, pos, SEEK_SET) == -1
+		    || read(fd, hdr, 4) < 4)
+			goto bad;
+		len = blocksize(hdr);
+		pos += 4 + len;
+		if ((hdr[0] & 0x7f) == 6) {
+			if (find_picture_flac(fd, len, &loc) == -1)
+				goto bad;
+			if (!have || loc.type == PICTURE_FRONT_COVER) {
+				found = loc;
+				have = 1;
+			}
+		}
+		if (hdr[0] & 0x80)
+			/* Last metadata block */
+			break;
+	}
+	if (lseek(fd, prev_pos, SEEK_SET) == -1) {
+		child_warn("lseek");
+		return (-1);
+	}
+	if (have)
+		enqueue_binary_message(MSG_PICTURE, &found, sizeof(found));
+	return (0);
+
+bad:
+	child_warnx("malformed picture or metadata block.");
+	if (lseek(fd, prev_pos, SEEK_SET) == -1)
+		child_warn("lseek");
+	return (-1);
+}
+
 /* Extract the size of a metadata block from its header. */
 static size_t
 blocksize(unsigned char *mdata_hdr)
@@ -531,6 +1150,37 @@ get_samples(unsigned char *strinf)
 	return (rv);
 }
 
+/*
+ * report_verify: Tell the parent what decoding to OUT_VERIFY turned up.
+ * Finishing the decoder compares the MD5 signature; init_flac_decoder()
+ * sets it up again for the next file.
+ */
+static void
+report_verify(struct flac_client_data *cdata)
+{
+	struct pnp_verify	v;
+
+	memset(&v, 0, sizeof(v));
+	v.crc_errors = cdata->crc_errors;
+	v.sync_errors = cdata->sync_errors;
+	if (!FLAC__stream_decoder_finish(cdata->dec))
+		v.md5 = MD5_MISMATCH;
+	else
+		v.md5 = cdata->md5_signed ? MD5_MATCH : MD5_NONE;
+	v.samples = child_stats->sample_pos;
+	v.expected = cdata->samples;
+	if (v.crc_errors != 0 || v.sync_errors != 0 || v.md5 == MD5_MISMATCH
+	    || (v.expected != 0 && v.samples != v.expected))
+		v.status = VERIFY_CORRUPT;
+	else if (v.md5 == MD5_NONE)
+		v.status = VERIFY_UNSIGNED;
+	else
+		v.status = VERIFY_OK;
+	set_reply_id(cdata->state->play_id);
+	enqueue_binary_message(MSG_VERIFY, &v, sizeof(v));
+	set_reply_id(0);
+}
+
 static void
 flac_error_msg(FLAC__StreamDecoderErrorStatus error_status)
 {
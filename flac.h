@@ -19,19 +19,45 @@
 #include <FLAC/stream_decoder.h> /* For FLAC__StreamDecoderErrorStatus */
 
 #include "child.h"
+#include "flac_frame.h"
+#include "writer.h"
 
 struct flac_client_data {
+	FLAC__StreamDecoder		*dec;
+	FLAC__StreamDecoderWriteCallback write_cb;
+	int				decode_done, starved;
 	struct input			*in;
 	struct state			*state;
 	struct out			*out;
+	struct tee			*tee;
 	struct sample_buf		*sbuf;
+	struct writer			writer;	/* For OUT_WAV_FILE, OUT_RAW */
 	uint64_t			samples;
 	unsigned int			bps, rate, channels, max_bsize;
+	uint32_t			max_fsize; /* 0 if unknown */
 	int				error;
 	FLAC__StreamDecoderErrorStatus	error_status;
-	size_t				bytes_written;
+	int				md5;	/* Checking is on. */
+	int				md5_signed; /* From STREAMINFO */
+	uint32_t			crc_errors, sync_errors;
+	uint64_t			bytes_written;
+	int				hdr_len;	/* Of the WAVE header */
+	/*
+	 * The in-tree decoder, if native is set. It takes over from libFLAC
+	 * after the metadata and reads frames from nbuf. It waits for
+	 * max_frame bytes before it decodes a frame; that is frame_size
+	 * unless the frame turned out to be bigger.
+	 */
+	int				native, native_eof;
+	struct frame_dec		frames;
+	unsigned char			*nbuf;
+	size_t				nbuf_size, nbuf_len, nbuf_pos;
+	size_t				max_frame, frame_size;
 };
 
-int	play_flac(struct input *, struct out *, struct state *);
+int	start_flac(struct stream *);
+int	step_flac(struct stream *);
 int	extract_meta_flac(struct input *);
+int	extract_picture_flac(struct input *);
+int	scan_flac(struct input *, struct pnp_verify *);
 #endif
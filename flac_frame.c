@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * In-tree FLAC frame decoder. It is an alternative to libFLAC for the
+ * frames; the metadata is still read by libFLAC. The bit reader keeps the
+ * next bits of the frame in a 64-bit word and refills it 8 bytes at a
+ * time, so most Rice codes are decoded with a count of leading zeros and
+ * two shifts. LPC prediction has a kernel for each order up to 12 with the
+ * taps written out; higher orders and those that need 64-bit sums take a
+ * plain loop. Each sample depends on the ones before it, so none of this
+ * is vector code. Samples come out in the same planar layout as libFLAC's,
+ * bit for bit.
+ */
+
+#include <sys/types.h>
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <FLAC/format.h>
+
+#include "flac_frame.h"
+
+#define LPC_UNROLLED	12	/* Orders with their own kernel. */
+
+/*
+ * Sums that only overflow in a broken stream. Unsigned arithmetic wraps
+ * instead of being undefined, and gives the same bits otherwise.
+ */
+#define ADD(a, b)	((FLAC__int32)((uint32_t)(a) + (uint32_t)(b)))
+#define SUB(a, b)	((FLAC__int32)((uint32_t)(a) - (uint32_t)(b)))
+#define MUL(a, b)	((uint32_t)(a) * (uint32_t)(b))
+
+/*
+ * The bits of a frame, from pos in buf on. cache holds the next bits, most
+ * significant first, of which the first nbits are counted. Past len, the
+ * reader sees zeros; a frame that runs into them is cut off.
+ */
+struct bitreader {
+	const unsigned char	*buf;
+	size_t			pos, len;
+	uint64_t		cache;
+	unsigned int		nbits;
+};
+
+typedef void	(*lpc_kernel)(FLAC__int32 *, uint32_t, const FLAC__int32 *,
+		    int);
+
+static void		crc_init(void);
+static void		br_refill(struct bitreader *);
+static uint32_t		br_read(struct bitreader *, unsigned int);
+static FLAC__int32	br_read_signed(struct bitreader *, unsigned int);
+static int		br_unary(struct bitreader *, uint32_t *);
+static int		br_overrun(const struct bitreader *);
+static int		read_subframe(struct bitreader *, FLAC__int32 *,
+			    uint32_t, unsigned int);
+static int		read_residual(struct bitreader *, FLAC__int32 *,
+			    uint32_t, unsigned int);
+static int		read_rice(struct bitreader *, FLAC__int32 *, uint32_t,
+			    unsigned int);
+static void		fixed_restore(FLAC__int32 *, uint32_t, unsigned int);
+static void		lpc_restore(FLAC__int32 *, uint32_t,
+			    const FLAC__int32 *, unsigned int, int, int);
+static void		decorrelate(struct frame_dec *);
+
+static uint8_t	crc8_table[256];
+static uint16_t	crc16_table[8][256];	/* For 8 bytes at a time. */
+static int	crc_ready;
+
+/*
+ * frame_dec_init: Set up d for a stream with the given STREAMINFO. Returns
+ * -1 if it is out of memory.
+ */
+int
+frame_dec_init(struct frame_dec *d, uint32_t max_bsize, unsigned int bps,
+    unsigned int rate)
+{
+	unsigned int	c;
+
+	memset(d, 0, sizeof(*d));
+	d->size = max_bsize != 0 ? max_bsize : 65536;
+	d->bps = bps;
+	d->rate = rate;
+	for (c = 0; c < FRAME_MAX_CHANNELS; c++) {
+		d->chan[c] = reallocarray(NULL, d->size, sizeof(FLAC__int32));
+		if (d->chan[c] == NULL) {
+			frame_dec_free(d);
+			return (-1);
+		}
+	}
+	if (!crc_ready)
+		crc_init();
+	return (0);
+}
+
+void
+frame_dec_free(struct frame_dec *d)
+{
+	unsigned int	c;
+
+	for (c = 0; c < FRAME_MAX_CHANNELS; c++) {
+		free(d->chan[c]);
+		d->chan[c] = NULL;
+	}
+}
+
+/*
+ * frame_decode: Decode the frame at the start of buf, which holds len
+ * bytes, into d->chan[] and set *used to its length. Returns FRAME_OK;
+ * FRAME_SHORT if the frame doesn't end within len; FRAME_SYNC if buf
+ * doesn't start with a frame that can be decoded, and FRAME_CRC if it
+ * does but the CRC-16 is wrong. Like libFLAC, such a frame comes out as
+ * silence.
+ */
+int
+frame_decode(struct frame_dec *d, const unsigned char *buf, size_t len,
+    size_t *used)
+{
+	struct frame_hdr	*h = &d->hdr;
+	struct bitreader	br;
+	unsigned int		c, bps, side;
+	size_t			end;
+
+	*used = 0;
+	if (frame_header(buf, len, h) == -1)
+		return (len < FRAME_MAX_HEADER ? FRAME_SHORT : FRAME_SYNC);
+	bps = h->bps != 0 ? h->bps : d->bps;
+	if (bps == 0 || bps > FRAME_MAX_BPS || h->blocksize > d->size)
+		return (FRAME_SYNC);
+	/* The side channel needs a bit more. */
+	switch (h->chan_code) {
+	case (FRAME_RIGHT_SIDE):
+		side = 0;
+		break;
+	case (FRAME_LEFT_SIDE):
+	case (FRAME_MID_SIDE):
+		side = 1;
+		break;
+	default:
+		side = FRAME_MAX_CHANNELS;
+	}
+	memset(&br, 0, sizeof(br));
+	br.buf = buf;
+	br.pos = h->len;
+	br.len = len;
+	for (c = 0; c < h->channels; c++) {
+		if (read_subframe(&br, d->chan[c], h->blocksize,
+		    c == side ? bps + 1 : bps) == -1)
+			return (br_overrun(&br) ? FRAME_SHORT : FRAME_SYNC);
+	}
+	/* The CRC-16 follows the padding to the next byte. */
+	br_read(&br, br.nbits % 8 + 16);
+	if (br_overrun(&br))
+		return (FRAME_SHORT);
+	end = br.pos - br.nbits / 8;
+	*used = end;
+	if (frame_crc16(0, buf, end) != 0) {
+		for (c = 0; c < h->channels; c++)
+			memset(d->chan[c], 0,
+			    h->blocksize * sizeof(FLAC__int32));
+		return (FRAME_CRC);
+	}
+	decorrelate(d);
+	return (FRAME_OK);
+}
+
+/*
+ * read_subframe: Decode a subframe of n samples with bps bits each into s.
+ * Returns -1 if it is broken.
+ */
+static int
+read_subframe(struct bitreader *br, FLAC__int32 *s, uint32_t n,
+    unsigned int bps)
+{
+	FLAC__int32	coef[FLAC__MAX_LPC_ORDER], v;
+	uint32_t	type, wasted = 0, i;
+	unsigned int	order, prec, ilog;
+	int		shift;
+
+	if (br_read(br, 1) != 0)
+		return (-1);
+	type = br_read(br, 6);
+	if (br_read(br, 1)) {
+		/* Bits that are 0 in every sample are left out. */
+		if (br_unary(br, &wasted) == -1 || ++wasted >= bps)
+			return (-1);
+		bps -= wasted;
+	}
+	if (type == 0) {
+		v = br_read_signed(br, bps);
+		for (i = 0; i < n; i++)
+			s[i] = v;
+	}
+	else if (type == 1) {
+		for (i = 0; i < n; i++)
+			s[i] = br_read_signed(br, bps);
+	}
+	else if (type >= 8 && type <= 12) {
+		order = type - 8;
+		if (order > n)
+			return (-1);
+		for (i = 0; i < order; i++)
+			s[i] = br_read_signed(br, bps);
+		if (read_residual(br, s + order, n, order) == -1)
+			return (-1);
+		fixed_restore(s, n, order);
+	}
+	else if (type >= 32) {
+		order = type - 31;
+		if (order > n)
+			return (-1);
+		for (i = 0; i < order; i++)
+			s[i] = br_read_signed(br, bps);
+		if ((prec = br_read(br, 4) + 1) == 16
+		    || (shift = br_read_signed(br, 5)) < 0)
+			return (-1);
+		for (i = 0; i < order; i++)
+			coef[i] = br_read_signed(br, prec);
+		if (read_residual(br, s + order, n, order) == -1)
+			return (-1);
+		for (ilog = 0; (2U << ilog) <= order; ilog++)
+			continue;
+		/* This is when libFLAC sums in 32 bits, too. */
+		lpc_restore(s, n, coef, order, shift,
+		    bps + prec + ilog <= 32);
+	}
+	else
+		return (-1);
+	if (wasted > 0) {
+		for (i = 0; i < n; i++)
+			s[i] = (FLAC__int32)((uint32_t)s[i] << wasted);
+	}
+	return (br_overrun(br) ? -1 : 0);
+}
+
+/*
+ * read_residual: Decode the residual of a subframe with the given
+ * predictor order into s. n is the blocksize.
+ */
+static int
+read_residual(struct bitreader *br, FLAC__int32 *s, uint32_t n,
+    unsigned int order)
+{
+	uint32_t	method, porder, psize, count, p, i;
+	unsigned int	pbits, k, esc, bits;
+
+	if ((method = br_read(br, 2)) > 1)
+		return (-1);
+	pbits = method == 0 ? 4 : 5;
+	esc = (1U << pbits) - 1;
+	porder = br_read(br, 4);
+	psize = n >> porder;
+	if (psize << porder != n || psize < order)
+		return (-1);
+	for (p = 0; p < 1U << porder; p++) {
+		count = p == 0 ? psize - order : psize;
+		if ((k = br_read(br, pbits)) != esc) {
+			if (read_rice(br, s, count, k) == -1)
+				return (-1);
+		}
+		else if ((bits = br_read(br, 5)) == 0)
+			memset(s, 0, count * sizeof(*s));
+		else {
+			/* An escaped partition is stored verbatim. */
+			for (i = 0; i < count; i++)
+				s[i] = br_read_signed(br, bits);
+		}
+		s += count;
+	}
+	return (0);
+}
+
+/*
+ * read_rice: Decode n Rice codes with parameter k into s. Unless the
+ * quotient is large or the frame is about to end, a code is in the cache
+ * and takes a count of leading zeros and a few shifts. The reader is kept
+ * in locals, since the compiler can't tell that storing a sample doesn't
+ * change it.
+ */
+static int
+read_rice(struct bitreader *br, FLAC__int32 *s, uint32_t n, unsigned int k)
+{
+	uint64_t	cache = br->cache, w, v;
+	size_t		pos = br->pos;
+	unsigned int	nbits = br->nbits;
+	uint32_t	q, i;
+
+	for (i = 0; i < n; i++) {
+		if (pos + 8 <= br->len) {
+			/* br_refill(), inline and without a branch on nbits. */
+			memcpy(&w, br->buf + pos, sizeof(w));
+			cache |= be64toh(w) >> nbits;
+			pos += (63 - nbits) >> 3;
+			nbits |= 56;
+		}
+		if (cache != 0 && (q = __builtin_clzll(cache)) + k < nbits) {
+			/* Shifts by 64 are undefined, so split them. */
+			v = ((uint64_t)q << k) |
+			    (cache << q << 1 >> 1 >> (63 - k));
+			cache = cache << q << 1 << k;
+			nbits -= q + 1 + k;
+		}
+		else {
+			br->cache = cache;
+			br->pos = pos;
+			br->nbits = nbits;
+			if (br_unary(br, &q) == -1)
+				return (-1);
+			v = (uint64_t)q << k;
+			if (k > 0)
+				v |= br_read(br, k);
+			cache = br->cache;
+			pos = br->pos;
+			nbits = br->nbits;
+		}
+		/* The codes are zigzag: 0, -1, 1, -2, ... */
+		s[i] = (FLAC__int32)((uint32_t)(v >> 1) ^ -(uint32_t)(v & 1));
+	}
+	br->cache = cache;
+	br->pos = pos;
+	br->nbits = nbits;
+	return (br_overrun(br) ? -1 : 0);
+}
+
+/* fixed_restore: Undo one of the fixed polynomial predictors. */
+static void
+fixed_restore(FLAC__int32 *s, uint32_t n, unsigned int order)
+{
+	uint32_t	i;
+
+	switch (order) {
+	case (1):
+		for (i = 1; i < n; i++)
+			s[i] = ADD(s[i], s[i - 1]);
+		break;
+	case (2):
+		for (i = 2; i < n; i++)
+			s[i] = ADD(s[i], MUL(2, s[i - 1]) - s[i - 2]);
+		break;
+	case (3):
+		for (i = 3; i < n; i++)
+			s[i] = ADD(s[i], MUL(3, SUB(s[i - 1], s[i - 2])) +
+			    s[i - 3]);
+		break;
+	case (4):
+		for (i = 4; i < n; i++)
+			s[i] = ADD(s[i], MUL(4, ADD(s[i - 1], s[i - 3])) -
+			    MUL(6, s[i - 2]) - s[i - 4]);
+		break;
+	}
+}
+
+/*
+ * The LPC kernels for 32-bit sums. s[i] is the residual until the
+ * prediction from the samples before it is added.
+ */
+#define TAP(j)	MUL(c[j], s[i - (j) - 1])
+#define SUM1	TAP(0)
+#define SUM2	SUM1 + TAP(1)
+#define SUM3	SUM2 + TAP(2)
+#define SUM4	SUM3 + TAP(3)
+#define SUM5	SUM4 + TAP(4)
+#define SUM6	SUM5 + TAP(5)
+#define SUM7	SUM6 + TAP(6)
+#define SUM8	SUM7 + TAP(7)
+#define SUM9	SUM8 + TAP(8)
+#define SUM10	SUM9 + TAP(9)
+#define SUM11	SUM10 + TAP(10)
+#define SUM12	SUM11 + TAP(11)
+
+#define LPC_KERNEL(order)						\
+static void								\
+lpc_##order(FLAC__int32 *restrict s, uint32_t n,			\
+    const FLAC__int32 *restrict c, int shift)				\
+{									\
+	uint32_t	i;						\
+									\
+	for (i = order; i < n; i++)					\
+		s[i] = ADD(s[i], (FLAC__int32)(SUM##order) >> shift);	\
+}
+
+LPC_KERNEL(1)
+LPC_KERNEL(2)
+LPC_KERNEL(3)
+LPC_KERNEL(4)
+LPC_KERNEL(5)
+LPC_KERNEL(6)
+LPC_KERNEL(7)
+LPC_KERNEL(8)
+LPC_KERNEL(9)
+LPC_KERNEL(10)
+LPC_KERNEL(11)
+LPC_KERNEL(12)
+
+static const lpc_kernel	lpc_kernels[LPC_UNROLLED + 1] = {NULL, lpc_1,
+			    lpc_2, lpc_3, lpc_4, lpc_5, lpc_6, lpc_7, lpc_8,
+			    lpc_9, lpc_10, lpc_11, lpc_12};
+
+/*
+ * lpc_restore: Undo the LPC prediction. If narrow is set, the sums fit
+ * into 32 bits.
+ */
+static void
+lpc_restore(FLAC__int32 *restrict s, uint32_t n,
+    const FLAC__int32 *restrict c, unsigned int order, int shift, int narrow)
+{
+	int64_t		wide;
+	uint32_t	i, j, sum;
+
+	if (narrow && order <= LPC_UNROLLED) {
+		lpc_kernels[order](s, n, c, shift);
+		return;
+	}
+	for (i = order; i < n; i++) {
+		if (narrow) {
+			for (sum = 0, j = 0; j < order; j++)
+				sum += MUL(c[j], s[i - j - 1]);
+			s[i] = ADD(s[i], (FLAC__int32)sum >> shift);
+		}
+		else {
+			for (wide = 0, j = 0; j < order; j++)
+				wide += (int64_t)c[j] * s[i - j - 1];
+			s[i] = ADD(s[i], wide >> shift);
+		}
+	}
+}
+
+/* decorrelate: Turn the stereo channels back into left and right. */
+static void
+decorrelate(struct frame_dec *d)
+{
+	FLAC__int32	*a = d->chan[0], *b = d->chan[1], mid;
+	uint32_t	i, n = d->hdr.blocksize;
+
+	switch (d->hdr.chan_code) {
+	case (FRAME_LEFT_SIDE):
+		for (i = 0; i < n; i++)
+			b[i] = SUB(a[i], b[i]);
+		break;
+	case (FRAME_RIGHT_SIDE):
+		for (i = 0; i < n; i++)
+			a[i] = ADD(a[i], b[i]);
+		break;
+	case (FRAME_MID_SIDE):
+		for (i = 0; i < n; i++) {
+			mid = (FLAC__int32)((uint32_t)a[i] << 1) | (b[i] & 1);
+			a[i] = ADD(mid, b[i]) >> 1;
+			b[i] = SUB(mid, b[i]) >> 1;
+		}
+		break;
+	}
+}
+
+/*
+ * br_refill: Fill up the cache to at least 56 bits. While there are 8
+ * bytes left, this is one load; the bits past nbits that it also brings in
+ * are the right ones, so loading them again does no harm.
+ */
+static inline void
+br_refill(struct bitreader *br)
+{
+	uint64_t	w;
+
+	if (br->pos <= br->len && br->len - br->pos >= 8) {
+		memcpy(&w, br->buf + br->pos, sizeof(w));
+		br->cache |= be64toh(w) >> br->nbits;
+		br->pos += (63 - br->nbits) >> 3;
+		br->nbits |= 56;
+		return;
+	}
+	while (br->nbits <= 56) {
+		if (br->pos < br->len)
+			br->cache |= (uint64_t)br->buf[br->pos] <<
+			    (56 - br->nbits);
+		br->pos++;
+		br->nbits += 8;
+	}
+}
+
+/* br_read: Read n bits, 1 <= n <= 32. */
+static inline uint32_t
+br_read(struct bitreader *br, unsigned int n)
+{
+	uint32_t	v;
+
+	if (br->nbits < n)
+		br_refill(br);
+	v = br->cache >> (64 - n);
+	br->cache <<= n;
+	br->nbits -= n;
+	return (v);
+}
+
+/* br_read_signed: Read an n bit two's complement number. */
+static inline FLAC__int32
+br_read_signed(struct bitreader *br, unsigned int n)
+{
+	return ((FLAC__int32)(br_read(br, n) << (32 - n)) >> (32 - n));
+}
+
+/* br_unary: Count the 0 bits up to the next 1. */
+static int
+br_unary(struct bitreader *br, uint32_t *v)
+{
+	uint32_t	n = 0;
+	unsigned int	z;
+
+	while (1) {
+		br_refill(br);
+		if (br->cache != 0
+		    && (z = __builtin_clzll(br->cache)) < br->nbits) {
+			br->cache = br->cache << z << 1;
+			br->nbits -= z + 1;
+			*v = n + z;
+			return (0);
+		}
+		n += br->nbits;
+		br->cache = 0;
+		br->nbits = 0;
+		if (br->pos > br->len)
+			return (-1);
+	}
+}
+
+/* br_overrun: Return 1 if the reader went past the end of the buffer. */
+static int
+br_overrun(const struct bitreader *br)
+{
+	return (br->pos * 8 - br->nbits > br->len * 8);
+}
+
+/*
+ * frame_header: If p starts with a valid frame header, fill in h and
+ * return 0. Otherwise, return -1. len is the number of bytes at p.
+ */
+int
+frame_header(const unsigned char *p, size_t len, struct frame_hdr *h)
+{
+	static const uint32_t	bsizes[16] = {0, 192, 576, 1152, 2304, 4608,
+				    0, 0, 256, 512, 1024, 2048, 4096, 8192,
+				    16384, 32768};
+	static const uint32_t	rates[12] = {0, 88200, 176400, 192000, 8000,
+				    16000, 22050, 24000, 32000, 44100, 48000,
+				    96000};
+	static const unsigned	bpss[8] = {0, 8, 12, 0, 16, 20, 24, 32};
+	size_t			n, need, i, extra;
+	unsigned int		bs_code, rate_code, c, ones;
+	uint8_t			crc;
+
+	if (len < 6 || p[0] != 0xff || (p[1] & 0xfe) != 0xf8)
+		return (-1);
+	bs_code = p[2] >> 4;
+	rate_code = p[2] & 0x0f;
+	/* Reserved codes: blocksize, rate, channels, sample size, 1 bit. */
+	if (bs_code == 0 || rate_code == 0x0f || p[3] >> 4 >= 11
+	    || (p[3] & 0x0e) == 0x06 || p[3] & 0x01)
+		return (-1);
+	/* The number is coded like UTF-8, in up to 7 bytes. */
+	c = p[4];
+	for (ones = 0; ones < 8 && (c << ones) & 0x80; ones++)
+		continue;
+	if (ones == 1 || ones == 8)
+		return (-1);
+	extra = ones == 0 ? 0 : ones - 1;
+	need = 5 + extra + 1;
+	if (bs_code == 6 || bs_code == 7)
+		need += bs_code - 5;
+	if (rate_code == 12)
+		need += 1;
+	else if (rate_code == 13 || rate_code == 14)
+		need += 2;
+	if (len < need)
+		return (-1);
+	if (!crc_ready)
+		crc_init();
+	for (crc = 0, i = 0; i < need - 1; i++)
+		crc = crc8_table[crc ^ p[i]];
+	if (crc != p[need - 1])
+		return (-1);
+	h->number = ones == 0 ? c : c & (0x7f >> ones);
+	for (n = 5, i = 0; i < extra; i++, n++) {
+		if ((p[n] & 0xc0) != 0x80)
+			return (-1);
+		h->number = (h->number << 6) | (p[n] & 0x3f);
+	}
+	if (bs_code == 6)
+		h->blocksize = p[n++] + 1;
+	else if (bs_code == 7) {
+		h->blocksize = ((p[n] << 8) | p[n + 1]) + 1;
+		n += 2;
+	}
+	else
+		h->blocksize = bsizes[bs_code];
+	if (rate_code == 12)
+		h->rate = p[n] * 1000;
+	else if (rate_code == 13)
+		h->rate = (p[n] << 8) | p[n + 1];
+	else if (rate_code == 14)
+		h->rate = ((p[n] << 8) | p[n + 1]) * 10;
+	else
+		h->rate = rates[rate_code];
+	h->chan_code = p[3] >> 4;
+	h->channels = h->chan_code < FRAME_LEFT_SIDE ? h->chan_code + 1 : 2;
+	h->bps = bpss[(p[3] >> 1) & 0x07];
+	h->variable = p[1] & 0x01;
+	h->len = need;
+	return (0);
+}
+
+/* frame_find: Return the offset of the first frame header in p, or len. */
+size_t
+frame_find(const unsigned char *p, size_t len)
+{
+	struct frame_hdr	h;
+	const unsigned char	*q;
+	size_t			pos = 0;
+
+	while (pos < len) {
+		if ((q = memchr(p + pos, 0xff, len - pos)) == NULL)
+			return (len);
+		pos = q - p;
+		if (frame_header(p + pos, len - pos, &h) == 0)
+			return (pos);
+		pos++;
+	}
+	return (len);
+}
+
+/*
+ * crc_init: Set up the tables. FLAC's CRC-8 has the polynomial
+ * x^8 + x^2 + x + 1, its CRC-16 x^16 + x^15 + x^2 + 1; both start at 0
+ * and go most significant bit first.
+ */
+static void
+crc_init(void)
+{
+	unsigned int	i, j, k, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 0x80 ? (c << 1) ^ 0x07 : c << 1;
+		crc8_table[i] = c & 0xff;
+		c = i << 8;
+		for (j = 0; j < 8; j++)
+			c = c & 0x8000 ? (c << 1) ^ 0x8005 : c << 1;
+		crc16_table[0][i] = c & 0xffff;
+	}
+	/* crc16_table[k][i] is the CRC of i followed by k zero bytes. */
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			c = crc16_table[k - 1][i];
+			crc16_table[k][i] = ((c << 8) ^ crc16_table[0][c >> 8])
+			    & 0xffff;
+		}
+	}
+	crc_ready = 1;
+}
+
+/*
+ * frame_crc16: Continue crc over len bytes at p, 8 bytes at a time. Over a
+ * whole frame, including the CRC at its end, it comes out as 0.
+ */
+uint16_t
+frame_crc16(uint16_t crc, const unsigned char *p, size_t len)
+{
+	if (!crc_ready)
+		crc_init();
+	while (len >= 8) {
+		crc = crc16_table[7][p[0] ^ (crc >> 8)] ^
+		    crc16_table[6][p[1] ^ (crc & 0xff)] ^
+		    crc16_table[5][p[2]] ^ crc16_table[4][p[3]] ^
+		    crc16_table[3][p[4]] ^ crc16_table[2][p[5]] ^
+		    crc16_table[1][p[6]] ^ crc16_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = (uint16_t)(crc << 8) ^ crc16_table[0][(crc >> 8) ^ *p++];
+	return (crc);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_FLAC_FRAME_H
+#define PNP_FLAC_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <FLAC/format.h>
+
+#define FRAME_MAX_CHANNELS	8
+#define FRAME_MAX_HEADER	16	/* Bytes in a frame header, at most. */
+#define FRAME_MAX_BPS		24	/* Deeper ones are left to libFLAC. */
+#define FRAME_MAX_SIZE		(1 << 24) /* STREAMINFO gives it 24 bits. */
+
+/*
+ * A frame header. rate and bps are 0 if STREAMINFO has them. chan_code is
+ * the number of channels minus 1, or one of the stereo codes below.
+ */
+struct frame_hdr {
+	int		variable;	/* Numbered by samples, not frames. */
+	uint64_t	number;
+	uint32_t	blocksize, rate;
+	unsigned int	channels, chan_code, bps;
+	size_t		len;
+};
+
+/*
+ * The in-tree frame decoder. It decodes one frame at a time from memory
+ * into planar buffers of FLAC__int32, like libFLAC hands to its write
+ * callback, so the same callbacks take the samples of either decoder.
+ * bps and rate are those of STREAMINFO.
+ */
+struct frame_dec {
+	FLAC__int32		*chan[FRAME_MAX_CHANNELS];
+	uint32_t		size;		/* Samples in each chan[]. */
+	unsigned int		bps, rate;
+	struct frame_hdr	hdr;		/* Of the last frame. */
+};
+
+enum {FRAME_LEFT_SIDE = 8, FRAME_RIGHT_SIDE, FRAME_MID_SIDE};
+
+/* Results of frame_decode(). */
+enum {FRAME_OK, FRAME_SHORT, FRAME_SYNC, FRAME_CRC};
+
+int		frame_header(const unsigned char *, size_t,
+		    struct frame_hdr *);
+size_t		frame_find(const unsigned char *, size_t);
+uint16_t	frame_crc16(uint16_t, const unsigned char *, size_t);
+int		frame_dec_init(struct frame_dec *, uint32_t, unsigned int,
+		    unsigned int);
+void		frame_dec_free(struct frame_dec *);
+int		frame_decode(struct frame_dec *, const unsigned char *,
+		    size_t, size_t *);
+
+#endif
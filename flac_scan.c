@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Quick check of a FLAC file that doesn't decode it. The file is mapped
+ * and its frames are walked: the CRC-8 of each frame header, the CRC-16 of
+ * each frame and the frame or sample numbers are checked. Frames don't say
+ * how long they are, so a frame ends at the next header with the expected
+ * number at which the CRC-16 of the bytes so far comes out as 0; a CRC
+ * over data followed by the CRC itself is 0.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <FLAC/format.h>
+#include <FLAC/stream_decoder.h>
+
+#include "child.h"
+#include "child_errors.h"
+#include "file.h"
+#include "flac.h"
+#include "flac_frame.h"
+#include "pnp.h"
+
+/* What the scan needs from STREAMINFO. */
+struct scan_info {
+	uint32_t	max_bsize, max_framesize;
+	unsigned int	channels, bps;
+	uint64_t	samples;
+};
+
+static int	read_streaminfo(const unsigned char *, size_t, size_t *,
+		    struct scan_info *);
+static void	scan_frames(const unsigned char *, size_t, size_t,
+		    const struct scan_info *, struct pnp_verify *);
+
+/*
+ * scan_flac: Check the frames of the input file and fill in v, with the
+ * MD5 unchecked. Returns -1 if the file can't be scanned at all.
+ */
+int
+scan_flac(struct input *in, struct pnp_verify *v)
+{
+	struct stat		sb;
+	struct scan_info	info;
+	unsigned char		*buf;
+	size_t			len, pos;
+	int			rv = 0;
+
+	if (fstat(in->fd, &sb) == -1) {
+		file_err(in, "fstat");
+		return (-1);
+	}
+	if (sb.st_size == 0 || (uintmax_t)sb.st_size > SIZE_MAX) {
+		file_errx(in, "can't map file");
+		return (-1);
+	}
+	len = sb.st_size;
+	buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in->fd, 0);
+	if (buf == MAP_FAILED) {
+		file_err(in, "mmap");
+		return (-1);
+	}
+	/* The file is read once, front to back. */
+	madvise(buf, len, MADV_SEQUENTIAL);
+	memset(v, 0, sizeof(*v));
+	v->md5 = MD5_UNCHECKED;
+	if (read_streaminfo(buf, len, &pos, &info) == -1) {
+		file_errx(in, "no STREAMINFO block");
+		rv = -1;
+	}
+	else
+		scan_frames(buf, len, pos, &info, v);
+	if (munmap(buf, len) == -1)
+		child_warn("munmap");
+	return (rv);
+}
+
+/*
+ * scan_frames: Walk the frames from pos on. A frame whose CRC-16 doesn't
+ * come out right ends at the next header with the expected number; if
+ * there is none within the largest possible frame, the scan picks up at
+ * the next header it finds.
+ */
+static void
+scan_frames(const unsigned char *buf, size_t len, size_t pos,
+    const struct scan_info *info, struct pnp_verify *v)
+{
+	struct frame_hdr	h, next;
+	const unsigned char	*q;
+	size_t			end = len, max_frame, lim, p, cand;
+	uint64_t		expect = 0, next_num;
+	uint16_t		crc;
+	int			have_expect = 1, found;
+
+	/* An ID3v1 tag at the end isn't part of the stream. */
+	if (end - pos >= 128 && memcmp(buf + end - 128, "TAG", 3) == 0)
+		end -= 128;
+	if (info->max_framesize != 0)
+		max_frame = info->max_framesize;
+	else
+		max_frame = (size_t)(info->max_bsize != 0 ? info->max_bsize :
+		    65535) * info->channels * (info->bps + 1) / 8 + 64;
+	max_frame += FRAME_MAX_HEADER;
+
+	while (pos < end) {
+		if (frame_header(buf + pos, end - pos, &h) == -1
+		    || (have_expect && h.number != expect)) {
+			v->sync_errors++;
+			pos += 1 + frame_find(buf + pos + 1, end - pos - 1);
+			have_expect = 0;
+			continue;
+		}
+		next_num = h.variable ? h.number + h.blocksize : h.number + 1;
+		v->samples += h.blocksize;
+		crc = frame_crc16(0, buf + pos, h.len);
+		p = pos + h.len;
+		lim = end - pos > max_frame ? pos + max_frame : end;
+		cand = 0;
+		found = 0;
+		while (p < lim) {
+			if ((q = memchr(buf + p, 0xff, lim - p)) == NULL) {
+				crc = frame_crc16(crc, buf + p, lim - p);
+				p = lim;
+				break;
+			}
+			crc = frame_crc16(crc, buf + p, q - (buf + p));
+			p = q - buf;
+			if (frame_header(buf + p, end - p, &next) == 0
+			    && next.number == next_num
+			    && next.variable == h.variable) {
+				if (crc == 0) {
+					found = 1;
+					break;
+				}
+				if (cand == 0)
+					cand = p;
+			}
+			crc = frame_crc16(crc, buf + p, 1);
+			p++;
+		}
+		if (found) {
+			pos = p;
+			expect = next_num;
+			have_expect = 1;
+			continue;
+		}
+		if (p == end && crc == 0)
+			break;	/* The last frame. */
+		v->crc_errors++;
+		if (cand != 0) {
+			pos = cand;
+			expect = next_num;
+			have_expect = 1;
+		}
+		else if (lim == end)
+			break;	/* Cut off or damaged at the end. */
+		else {
+			pos += 1 + frame_find(buf + pos + 1, end - pos - 1);
+			have_expect = 0;
+		}
+	}
+	v->expected = info->samples;
+	if (v->crc_errors != 0 || v->sync_errors != 0
+	    || (v->expected != 0 && v->samples != v->expected))
+		v->status = VERIFY_CORRUPT;
+	else
+		v->status = VERIFY_OK;
+}
+
+/*
+ * read_streaminfo: Find the STREAMINFO block, after an ID3v2 tag if there
+ * is one, and set *first to the offset of the first frame. Returns -1 if
+ * buf doesn't hold FLAC metadata.
+ */
+static int
+read_streaminfo(const unsigned char *buf, size_t len, size_t *first,
+    struct scan_info *info)
+{
+	const unsigned char	*s;
+	size_t			pos = 0, blen;
+	int			last, found = 0;
+
+	if (len >= 10)
+		pos = id3v2_size(buf);
+	if (pos > len || len - pos < 4 || memcmp(buf + pos, "fLaC", 4) != 0)
+		return (-1);
+	pos += 4;
+	do {
+		if (len - pos < 4)
+			return (-1);
+		last = buf[pos] & 0x80;
+		blen = (buf[pos + 1] << 16) | (buf[pos + 2] << 8) |
+		    buf[pos + 3];
+		if (blen > len - pos - 4)
+			return (-1);
+		if ((buf[pos] & 0x7f) == FLAC__METADATA_TYPE_STREAMINFO
+		    && blen >= 34) {
+			s = buf + pos + 4;
+			info->max_bsize = (s[2] << 8) | s[3];
+			info->max_framesize = (s[7] << 16) | (s[8] << 8) |
+			    s[9];
+			info->channels = ((s[12] >> 1) & 0x07) + 1;
+			info->bps = (((s[12] & 0x01) << 4) | (s[13] >> 4)) + 1;
+			info->samples = ((uint64_t)(s[13] & 0x0f) << 32) |
+			    ((uint64_t)s[14] << 24) | (s[15] << 16) |
+			    (s[16] << 8) | s[17];
+			found = 1;
+		}
+		pos += 4 + blen;
+	} while (!last);
+	*first = pos;
+	return (found ? 0 : -1);
+}
@@ -25,60 +25,143 @@
 #include <fcntl.h>
 #include <imsg.h>
 #include <libgen.h>
+#include <limits.h>
 #include <poll.h>
 #include <sndio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "daemon.h"
 #include "pnp.h"
 
+#define HUD_INTERVAL_MS	250
+
+static void	draw_hud(struct pnp_stats *);
+static void	null_report(struct timespec *, struct timespec *);
+static int	open_sndio(struct out *);
+static void	add_taps(char **, int *, int);
+
+static char	*sio_name;
+
 extern char	*__progname;
 
 int
 main(int argc, char **argv)
 {
 	struct out	out;
-	struct sio_hdl	*hdl;
 
-	int		opt, decflag = 0, rawflag = 0, sv[2];
+	int		opt, decflag = 0, rawflag = 0, hudflag = 0,
+			nullflag = 0, verifyflag = 0, scanflag = 0, fd;
 	FILE		*outfp;
-	pid_t		child_pid;
 	char		*name = NULL, *infile = NULL, *base = NULL,
-			*ext = NULL;
+			*ext = NULL, *sockpath = NULL, *bcast = NULL;
+	const char	*errstr;
+	int		nworkers = 0, max_jobs = PNPD_JOBS;
+	char		*taps[PNP_MAX_TAPS];
+	int		tap_types[PNP_MAX_TAPS], ntaps = 0;
 	
 	char		default_dev[] = "snd/0";
 
 	extern char	*optarg;
 	extern int	optind;
 
-	while ((opt = getopt(argc, argv, "do:r")) != -1) {
+	while ((opt = getopt(argc, argv, "A:a:b:D:dj:Nno:qrstw:")) != -1) {
 		switch (opt) {
+		case 'A':
+		case 'a':
+			/* Also write what is decoded to this file. */
+			if (ntaps == PNP_MAX_TAPS)
+				errx(1, "at most %d extra outputs",
+				    PNP_MAX_TAPS);
+			taps[ntaps] = optarg;
+			tap_types[ntaps++] = opt == 'a' ? OUT_WAV_FILE :
+			    OUT_RAW;
+			break;
+		case 'b':
+			bcast = optarg;
+			break;
+		case 'D':
+			sockpath = optarg;
+			break;
+		case 'j':
+			max_jobs = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs per worker is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'w':
+			nworkers = strtonum(optarg, 1, 64, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of workers is %s: %s", errstr,
+				    optarg);
+			break;
 		case 'd':
 			decflag = 1;
 			break;
+		case 'N':
+			flac_decoder = FLAC_DEC_NATIVE;
+			break;
+		case 'n':
+			nullflag = 1;
+			break;
 		case 'o':
 			if (asprintf(&name, "%s", optarg) < 0)
 				err(1, "asprintf");
 			break;
+		case 'q':
+			scanflag = 1;
+			break;
 		case 'r':
 			rawflag = 1;
 			break;
+		case 's':
+			hudflag = 1;
+			break;
+		case 't':
+			verifyflag = 1;
+			break;
 		default:
 			(void)fprintf(stderr,
-			    "usage: %s [-dr] [-o output_file] file\n",
-			    __progname);
+			    "usage: %s [-dNnrs] [-A raw_file] [-a wav_file] "
+			    "[-b socket] [-o output_file]\n"
+			    "           file\n"
+			    "       %s -D socket [-j jobs] [-w workers]\n"
+			    "       %s -t [-q] [-j jobs] [-o results] "
+			    "[-w workers] [file ...]\n",
+			    __progname, __progname, __progname);
 			exit(1);
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
+	if (sockpath != NULL)
+		return (pnpd_main(sockpath, nworkers > 0 ? nworkers :
+		    PNPD_WORKERS, max_jobs));
+	if (verifyflag) {
+		/* Verifying is CPU bound, so use every core by default. */
+		if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN))
+		    < 1)
+			nworkers = PNPD_WORKERS;
+		return (pnpd_verify(argv, argc, nworkers, max_jobs,
+		    scanflag ? JOB_SCAN : JOB_VERIFY, name));
+	}
+
 	if (argc == 0)
 		errx(1, "no input file given");
 	infile = argv[0];
-	if (decflag) {
+	if (nullflag) {
+		/* Decode, but throw the samples away. */
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+	}
+	else if (decflag) {
+		if (name == NULL && strcmp(infile, "-") == 0)
+			errx(1, "Reading standard input. Specify an output "
+			    "filename with -o.");
 		if (name == NULL) {
 			/* No output filename specified. */
 			size_t	osize;
@@ -119,7 +202,14 @@ main(int argc, char **argv)
 				    osize);
 			}
 		}
-		if ((outfp = fopen(name, "w")) == NULL)
+		if (strcmp(name, "-") == 0) {
+			/* The child closes stdout, so it gets a copy. */
+			if ((fd = dup(1)) == -1)
+				err(1, "dup");
+			if ((outfp = fdopen(fd, "w")) == NULL)
+				err(1, "fdopen");
+		}
+		else if ((outfp = fopen(name, "w")) == NULL)
 			err(1, "open");
 		out.type = rawflag ? OUT_RAW : OUT_WAV_FILE;
 		out.handle.fp = outfp;
@@ -127,39 +217,55 @@ main(int argc, char **argv)
 	else { /* decflag == 0 */
 		if (name == NULL)
 			name = default_dev;
-		hdl = sio_open(name, SIO_PLAY, 1);
-		if (hdl == NULL)
+		sio_name = name;
+		if (open_sndio(&out) == -1)
 			errx(1, "sio_open: failed");
-		out.type = OUT_SNDIO;
-		out.handle.sio = hdl;
 	}
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
-		err(1, "socketpair");
-	child_pid = fork();
-	if (child_pid == 0) {
-		child_main(sv, &out);
+	parent_start(&out);
+	add_taps(taps, tap_types, ntaps);
+	if (bcast != NULL) {
+		/* Listeners connect to bcast to get the samples. */
+		if (broadcast_open(bcast) == -1)
+			err(1, "%s", bcast);
+		if (broadcast_tap(0) != 0)
+			errx(1, "broadcast_tap");
 	}
-	else {
-		parent_init(sv, child_pid);
-		if (decflag && decode(argv[0]) != 0)
+	if (nullflag) {
+		struct timespec	start, end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (decode(argv[0]) != 0)
 			errx(1, "decode");
-		else {
-			struct pollfd	pfd;
-			int		nready, paused = 0;
-
-			pfd.fd = 1;
-			pfd.events = POLLIN;
-			if (start_play(argv[0]) != 0) 
-				errx(1, "start_play");
-			initscr();
-			cbreak();
-			noecho();
-			while (1) {
-				if ((nready = poll(&pfd, 1, 1)) < 0)
-					parent_err("poll");
-				if (nready == 1 && pfd.revents & POLLIN &&
-				    getchar() == ' ') {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		null_report(&start, &end);
+	}
+	else if (decflag && decode(argv[0]) != 0)
+		errx(1, "decode");
+	else if (!decflag) {
+		struct pollfd	pfd;
+		struct pnp_stats stats;
+		struct imsg	msg;
+		struct timespec	now, last_hud = {0, 0};
+		int		nready, paused = 0;
+
+		pfd.fd = 1;
+		pfd.events = POLLIN;
+		/* If the child crashes, a standby resumes playback. */
+		parent_standby(open_sndio);
+		if (start_play(argv[0]) != 0) 
+			errx(1, "start_play");
+		initscr();
+		cbreak();
+		noecho();
+		while (1) {
+			if ((nready = poll(&pfd, 1, 1)) < 0)
+				parent_err("poll");
+			if (parent_process_events(&msg) > 0)
+				imsg_free(&msg);
+			if (nready == 1 && pfd.revents & POLLIN) {
+				switch (getchar()) {
+				case ' ':
 					if (paused) {
 						paused = 0;
 						resume_play();
@@ -167,10 +273,103 @@ main(int argc, char **argv)
 						paused = 1;
 						pause_play();
 					}
+					break;
+				case 't':
+					dump_trace();
+					break;
 				}
 			}
+			if (!hudflag)
+				continue;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - last_hud.tv_sec) * 1000 +
+			    (now.tv_nsec - last_hud.tv_nsec) / 1000000
+			    < HUD_INTERVAL_MS)
+				continue;
+			last_hud = now;
+			if (get_stats(&stats) == 0)
+				draw_hud(&stats);
 		}
-		stop_child();
 	}
+	broadcast_close();
+	stop_child();
+	return (0);
+}
+
+/* add_taps: Have the child write copies of what it decodes to files. */
+static void
+add_taps(char **names, int *types, int n)
+{
+	int	i, fd;
+
+	for (i = 0; i < n; i++) {
+		if ((fd = open(names[i], O_WRONLY|O_CREAT|O_TRUNC, 0644))
+		    == -1)
+			err(1, "%s", names[i]);
+		if (add_tap(0, fd, types[i]) != 0)
+			errx(1, "add_tap");
+	}
+}
+
+/* open_sndio: Open the sndio device for a child. */
+static int
+open_sndio(struct out *out)
+{
+	out->type = OUT_SNDIO;
+	out->ready = 0;
+	if ((out->handle.sio = sio_open(sio_name, SIO_PLAY, 1)) == NULL)
+		return (-1);
 	return (0);
 }
+
+/* null_report: Print the throughput of a decode to the null output. */
+static void
+null_report(struct timespec *start, struct timespec *end)
+{
+	struct pnp_stats	st;
+	double			secs;
+
+	if (get_stats(&st) != 0)
+		errx(1, "get_stats");
+	secs = (end->tv_sec - start->tv_sec) +
+	    (end->tv_nsec - start->tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+	printf("%llu frames, %.1f MB of PCM in %.3f s: %.1f MB/s, "
+	    "%.0f frames/s\n", (unsigned long long)st.sample_pos,
+	    st.pcm_bytes / 1e6, secs, st.pcm_bytes / 1e6 / secs,
+	    st.sample_pos / secs);
+	printf("child CPU time %.3f s, decode time per block min/avg/max "
+	    "%llu/%llu/%llu us\n", st.cpu_ns / 1e9,
+	    (unsigned long long)st.dec_ns_min / 1000,
+	    (unsigned long long)st.dec_ns_avg / 1000,
+	    (unsigned long long)st.dec_ns_max / 1000);
+}
+
+/* draw_hud: Show the child's counters at the top of the screen. */
+static void
+draw_hud(struct pnp_stats *st)
+{
+	erase();
+	mvprintw(0, 0, "position   %12llu frames",
+	    (unsigned long long)st->sample_pos);
+	mvprintw(1, 0, "input      %12llu bytes read, buffer %llu/%llu",
+	    (unsigned long long)st->bytes_read,
+	    (unsigned long long)st->inbuf_fill,
+	    (unsigned long long)st->inbuf_size);
+	mvprintw(2, 0, "decoder    %12llu blocks, us/block min %llu avg %llu "
+	    "max %llu", (unsigned long long)st->frames_decoded,
+	    (unsigned long long)st->dec_ns_min / 1000,
+	    (unsigned long long)st->dec_ns_avg / 1000,
+	    (unsigned long long)st->dec_ns_max / 1000);
+	mvprintw(3, 0, "samplebuf  %12llu/%llu frames",
+	    (unsigned long long)st->sbuf_fill,
+	    (unsigned long long)st->sbuf_size);
+	mvprintw(4, 0, "sndio      %12llu writes, %llu short, %llu underruns",
+	    (unsigned long long)st->sio_writes,
+	    (unsigned long long)st->sio_short_writes,
+	    (unsigned long long)st->underruns);
+	mvprintw(5, 0, "poll       %12llu wakeups",
+	    (unsigned long long)st->poll_wakeups);
+	refresh();
+}
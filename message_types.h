@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_MESSAGE_TYPES_H
+#define PNP_MESSAGE_TYPES_H
+
+#include <stdint.h>
+
+/* Messages from the child to the parent. */
+typedef enum {
+	MSG_ACK,
+	MSG_NACK,
+	MSG_DONE,
+	MSG_WARN,
+	MSG_FATAL,
+	MSG_FILE_ERR,
+	META_ARTIST,
+	META_TITLE,
+	META_ALBUM,
+	META_TRACKNO,
+	META_DATE,
+	META_TIME,
+	MSG_STATS,
+	MSG_PICTURE,
+	MSG_PCM,
+	MSG_VERIFY,
+	MSG_SENTINEL,
+} MESSAGE_TYPE;
+
+/*
+ * Commands from the parent to the child. CMD_NEW_INPUT_FILE has to come
+ * first since it always carries a file descriptor. CMD_NEW_OUTPUT carries
+ * one unless the new output is OUT_NULL or OUT_VERIFY; CMD_ADD_TAP always
+ * does.
+ */
+typedef enum {
+	CMD_NEW_INPUT_FILE,
+	CMD_EXIT,
+	CMD_META,
+	CMD_PLAY,
+	CMD_PAUSE,
+	CMD_STATS,
+	CMD_TRACE_DUMP,
+	CMD_PICTURE,
+	CMD_NEW_OUTPUT,
+	CMD_ADD_TAP,
+	CMD_SCAN,
+	CMD_MESSAGE_SENTINEL,
+} CMD_MESSAGE_TYPE;
+
+/*
+ * Optional data of a command: the stream it is for, for CMD_NEW_OUTPUT and
+ * CMD_ADD_TAP the output type, and for CMD_PLAY the sample to start at.
+ * Commands without it are for stream 0.
+ */
+struct stream_cmd {
+	uint32_t	stream;
+	uint32_t	out_type;
+	uint64_t	pos;
+};
+
+#endif
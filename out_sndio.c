@@ -1,14 +1,26 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sndio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <FLAC/format.h>
 
 #include "child.h"
+#include "child_stats.h"
 #include "out_sndio.h"
+#include "trace.h"
 
+/*
+ * Sample buffers that were released, one per size class. Class n holds a
+ * buffer of exactly 1 << n bytes, so the next track with a similar format
+ * can reuse it.
+ */
+#define SBUF_CLASSES	32
+static struct sample_buf	*sbuf_pool[SBUF_CLASSES];
+
+static int	sbuf_class(size_t);
 static void	_sbuf_put_nowrap(struct sample_buf *,
 		    const FLAC__int32 *const [], size_t, size_t);
 
@@ -30,10 +42,80 @@ sbuf_new(unsigned int bps, unsigned int channels, size_t nframes)
 	sbuf->framesize = bps*channels;
 	sbuf->size = sbuf->free = nframes;
 	sbuf->rpos = sbuf->wpos = 0;
+	sbuf->bufsize = bps*channels*nframes;
 
 	return (sbuf);
 }
 
+/*
+ * sbuf_class: Return the smallest n with 1 << n >= len, or -1 if there is
+ * no such class.
+ */
+static int
+sbuf_class(size_t len)
+{
+	int	n;
+
+	for (n = 0; n < SBUF_CLASSES; n++)
+		if (((size_t)1 << n) >= len)
+			return (n);
+	return (-1);
+}
+
+/*
+ * sbuf_acquire: Like sbuf_new, but take the buffer from the pool if one of
+ * the right size class is there. The allocation is rounded up to the size
+ * class, so it can be given back with sbuf_release.
+ */
+struct sample_buf *
+sbuf_acquire(unsigned int bps, unsigned int channels, size_t nframes)
+{
+	struct sample_buf	*sbuf;
+	size_t			len;
+	int			n;
+
+	if (nframes == 0 || bps*channels > SIZE_MAX / nframes
+	    || (n = sbuf_class(bps*channels*nframes)) == -1)
+		return (sbuf_new(bps, channels, nframes));
+	len = (size_t)1 << n;
+	if ((sbuf = sbuf_pool[n]) != NULL)
+		sbuf_pool[n] = NULL;
+	else {
+		if ((sbuf = malloc(sizeof(struct sample_buf))) == NULL)
+			return (NULL);
+		if ((sbuf->buf = malloc(len)) == NULL) {
+			free(sbuf);
+			return (NULL);
+		}
+		sbuf->bufsize = len;
+	}
+	sbuf->channels = channels;
+	sbuf->bps = bps;
+	sbuf->framesize = bps*channels;
+	sbuf->size = nframes;
+	sbuf_clear(sbuf);
+
+	return (sbuf);
+}
+
+/*
+ * sbuf_release: Put the buffer back into the pool. If it does not fit a
+ * size class or its slot is taken, it is freed.
+ */
+void
+sbuf_release(struct sample_buf *sbuf)
+{
+	int	n;
+
+	n = sbuf_class(sbuf->bufsize);
+	if (n == -1 || ((size_t)1 << n) != sbuf->bufsize
+	    || sbuf_pool[n] != NULL) {
+		sbuf_free(sbuf);
+		return;
+	}
+	sbuf_pool[n] = sbuf;
+}
+
 void
 sbuf_free(struct sample_buf *sbuf)
 {
@@ -56,6 +138,7 @@ sbuf_put(struct sample_buf *sbuf, const FLAC__int32 *const smp[],
 
 	if (sbuf->free < nframes)
 		nframes = sbuf->free;
+	TRACE(TR_SBUF_PUT, sbuf->free, nframes);
 	if (nframes == 0)
 		return (0);
 	to_end = sbuf->size - sbuf->wpos;
@@ -111,6 +194,11 @@ sbuf_sio_write(struct sample_buf *sbuf, struct sio_hdl *hdl)
 		if (bytes_written % sbuf->framesize != 0)
 			return (-1);
 		frames_written = bytes_written/sbuf->framesize;
+		child_stats->sio_writes++;
+		TRACE(TR_SBUF_SIO_WRITE, to_end, frames_written);
+		if (frames_written < to_end)
+			child_stats->sio_short_writes++;
+		child_stats->sample_pos += frames_written;
 		sbuf->free += frames_written;
 		sbuf->rpos = (sbuf->rpos + frames_written) % sbuf->size;
 		return (0);
@@ -122,6 +210,11 @@ sbuf_sio_write(struct sample_buf *sbuf, struct sio_hdl *hdl)
 	if (bytes_written % sbuf->framesize != 0)
 		return (-1);
 	frames_written = bytes_written/sbuf->framesize;
+	child_stats->sio_writes++;
+	TRACE(TR_SBUF_SIO_WRITE, nframes, frames_written);
+	if (frames_written < nframes)
+		child_stats->sio_short_writes++;
+	child_stats->sample_pos += frames_written;
 	sbuf->free += frames_written;
 	sbuf->rpos = (sbuf->rpos + frames_written) % sbuf->size;
 	return (0);
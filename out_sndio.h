@@ -9,11 +9,14 @@ struct sample_buf {
 	size_t		framesize;
 	size_t		size, free; /* In frames. */
 	size_t		rpos, wpos;
+	size_t		bufsize; /* Allocated bytes. */
 };
 
 struct sample_buf	*sbuf_new(unsigned int, unsigned int, size_t);
 void 			sbuf_free(struct sample_buf *);
 void 			sbuf_clear(struct sample_buf *);
+struct sample_buf	*sbuf_acquire(unsigned int, unsigned int, size_t);
+void			sbuf_release(struct sample_buf *);
 size_t			sbuf_put(struct sample_buf *,
 			    const FLAC__int32 *const [], size_t);
 int			sbuf_sio_write(struct sample_buf *, struct sio_hdl *);
@@ -15,7 +15,10 @@
  */
 
 #include <sys/limits.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -26,25 +29,115 @@
 #include <imsg.h>
 #include <poll.h>
 #include <signal.h>
+#include <sndio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "child_messages.h"
 #include "comm.h"
+#include "message_types.h"
+#include "pcm.h"
 #include "pnp.h"
+#include "trace.h"
+
+/*
+ * A request to the child that is waiting for its reply. The ID is sent in
+ * the peerid field, and the child copies it into everything it sends in
+ * reply. handle() is called with each of those messages and returns 1 once
+ * the request is complete and its callback has run.
+ */
+struct request {
+	uint32_t		id;
+	int			(*handle)(struct request *, struct imsg *);
+	union {
+		void	(*status)(int, void *);
+		void	(*meta)(struct meta *, void *);
+		void	(*picture)(struct picture *, void *);
+	}			cb;
+	void			(*block)(const struct pnp_pcm_format *, void *,
+				    size_t, void *);
+	void			*arg;
+	struct meta		*meta;
+	struct pnp_stats	*stats;
+	struct picture_loc	loc;
+	int			found, fd;
+	struct pcm_ring		*pcm;
+	size_t			pcm_size;	/* Not the child's ring->size */
+	void			*buf;
+	size_t			bufsize;
+	TAILQ_ENTRY(request)	entry;
+};
+
+/* Used by the synchronous functions to wait for an asynchronous one. */
+struct sync_reply {
+	int		done, status;
+	struct meta	*meta;
+	struct picture	*picture;
+};
 
 static void	 	signal_handler(int);
 static void		check_signal(void);
 static void		print_err(int, char *);
+static struct request	*new_request(int, int, const struct stream_cmd *,
+			    int (*)(struct request *, struct imsg *));
+static int		dispatch_reply(struct imsg *);
+static int		status_reply(struct request *, struct imsg *);
+static int		meta_reply(struct request *, struct imsg *);
+static int		picture_reply(struct request *, struct imsg *);
+static int		stats_reply(struct request *, struct imsg *);
+static int		pcm_reply(struct request *, struct imsg *);
+static void		pcm_deliver(struct request *);
+static struct meta	*new_meta(void);
+static void		wait_sync(struct sync_reply *);
+static void		sync_status(int, void *);
+static void		sync_meta(struct meta *, void *);
+static void		sync_picture(struct picture *, void *);
+static void		fail_request(struct request *);
+static int		open_input(char *);
+static void		set_playing(char *, uint32_t);
+static struct pnp_shared *new_shared(void);
+static pid_t		fork_child(struct out *, int (*)(struct out *),
+			    struct pnp_shared *, int[2]);
+static void		drop_out(struct out *);
+static int		spawn_standby(void);
+static int		check_standby(void);
+static void		child_died(void);
+static int		recover(void);
 
 static struct imsgbuf	ibuf;
 static struct pollfd	pfd;
 static int		term_sig, caught_sigchld;
 static pid_t		child_pid;
+static int		cur_fd = -1; /* Our copy of the child's input file. */
 static void		(*err_cb)(int, char *) = print_err;
+static TAILQ_HEAD(, request) requests = TAILQ_HEAD_INITIALIZER(requests);
+static uint32_t		next_id = 1;
+static int		npending;
+static struct pnp_shared *shared; /* Of the running child, or NULL. */
+
+/* A child that waits to take over if the running one dies. */
+static pid_t		standby_pid = -1;
+static int		standby_fd = -1;
+static struct pnp_shared *standby_shared;
+static int		(*standby_out)(struct out *);
+static time_t		standby_time;	/* When the last one was forked. */
+static int		standby_fast;	/* Forked too soon after that. */
+
+/*
+ * A standby that dies within STANDBY_MIN_SECS of the last one, more than
+ * STANDBY_MAX_FAST times in a row, is not replaced.
+ */
+#define STANDBY_MIN_SECS	10
+#define STANDBY_MAX_FAST	3
+
+/* What the running child plays, so the standby can pick it up. */
+static char		*play_path;
+static int		playing, paused;
+static uint32_t		play_req_id;
 
 void			warning_received(char *, size_t);
 
@@ -62,12 +155,178 @@ parent_init(int sv[2], pid_t child)
 
 	if (close(sv[1]))
 		parent_err("close");
+	TRACE_INIT();
 	imsg_init(&ibuf, sv[0]);
 	child_pid = child;
 	pfd.fd = sv[0];
 	pfd.events = POLLIN|POLLOUT;
 }
 
+/*
+ * parent_start: Fork a child that plays or decodes to out and set up the
+ * parent like parent_init(). The child shares a page with the parent,
+ * which a standby needs to take over. The parent's copy of out is closed.
+ * Returns the child's PID.
+ */
+pid_t
+parent_start(struct out *out)
+{
+	struct pnp_shared	*shm;
+	pid_t			pid;
+	int			sv[2];
+
+	if ((shm = new_shared()) == NULL)
+		err(1, "mmap");
+	if ((pid = fork_child(out, NULL, shm, sv)) == -1)
+		err(1, "fork");
+	drop_out(out);
+	parent_init(sv, pid);
+	shared = shm;
+	return (pid);
+}
+
+/*
+ * parent_standby: Keep a second child forked and pledged, so playback goes
+ * on right away if the running one dies. f opens an output like the one
+ * given to parent_start() and returns 0, or -1 on error; each standby
+ * calls it after the fork, so the parent never holds their outputs.
+ * Returns -1 if no standby could be started.
+ */
+int
+parent_standby(int (*f)(struct out *))
+{
+	/* Writing to a dead child must not kill us before we notice. */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		parent_err("signal");
+	standby_out = f;
+	standby_fast = 0;
+	return (spawn_standby());
+}
+
+static struct pnp_shared *
+new_shared(void)
+{
+	struct pnp_shared	*shm;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE,
+	    MAP_ANON|MAP_SHARED, -1, 0);
+	if (shm == MAP_FAILED)
+		return (NULL);
+	shm->sample_pos = 0;
+	return (shm);
+}
+
+/*
+ * fork_child: Start a child on a new socketpair that plays to out, or to
+ * the output that open_out opens in the child if that isn't NULL. The
+ * parent's end is sv[0]; the caller closes sv[1]. Returns the PID, or -1
+ * on error.
+ */
+static pid_t
+fork_child(struct out *out, int (*open_out)(struct out *),
+    struct pnp_shared *shm, int sv[2])
+{
+	struct out	own;
+	pid_t		pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		return (-1);
+	switch (pid = fork()) {
+	case -1:
+		close(sv[0]);
+		close(sv[1]);
+		return (-1);
+	case 0:
+		/* Undo parent_init() and parent_standby(). */
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		/* Don't hold on to the running child's socket and file. */
+		if (child_pid != 0)
+			close(ibuf.fd);
+		if (cur_fd != -1)
+			close(cur_fd);
+		if (open_out != NULL) {
+			memset(&own, 0, sizeof(own));
+			if (open_out(&own) == -1) {
+				warnx("no output for a standby child");
+				_exit(1);
+			}
+			out = &own;
+		}
+		child_shared = shm;
+		child_main(sv, out);
+		_exit(1);
+	}
+	return (pid);
+}
+
+/*
+ * drop_out: Close the parent's copy of a child's output. sio_close() would
+ * end the child's stream, too, so only the device's fds are closed.
+ */
+static void
+drop_out(struct out *out)
+{
+	struct pollfd	pfds[4];
+	int		i, n;
+
+	switch (out->type) {
+	case OUT_SNDIO:
+		if (sio_nfds(out->handle.sio) > 4)
+			break;
+		n = sio_pollfd(out->handle.sio, pfds, POLLOUT);
+		for (i = 0; i < n; i++)
+			close(pfds[i].fd);
+		break;
+	case OUT_WAV_FILE:
+	case OUT_RAW:
+		fclose(out->handle.fp);
+		break;
+	}
+}
+
+/*
+ * spawn_standby: Fork a new standby child. Returns 0 on success. Gives up
+ * if standbys keep dying right after they were started.
+ */
+static int
+spawn_standby(void)
+{
+	struct timespec	now;
+	int		sv[2];
+
+	if (standby_out == NULL)
+		return (-1);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (standby_time != 0 && now.tv_sec - standby_time < STANDBY_MIN_SECS)
+		standby_fast++;
+	else
+		standby_fast = 0;
+	if (standby_fast > STANDBY_MAX_FAST) {
+		err_cb(PNP_PARENT_WARN, "standby children keep dying, "
+		    "not starting another");
+		standby_out = NULL;
+		return (-1);
+	}
+	standby_time = now.tv_sec;
+	if ((standby_shared = new_shared()) == NULL)
+		parent_err("mmap");
+	if ((standby_pid = fork_child(NULL, standby_out, standby_shared,
+	    sv)) == -1) {
+		err_cb(PNP_PARENT_WARN, "could not fork a standby child");
+		munmap(standby_shared, sizeof(*standby_shared));
+		standby_shared = NULL;
+		return (-1);
+	}
+	if (close(sv[1]))
+		parent_err("close");
+	standby_fd = sv[0];
+	return (0);
+}
+
 void
 set_err_cb(void (*f)(int, char *))
 {
@@ -106,7 +365,8 @@ parent_msg(int type, char *data, size_t datalen)
  * the child process. It stores the next message in the supplied struct
  * and returns the length of the message; 0 indicates that there is no
  * message. If the return value was > 0, the message data needs to be freed
- * with imsg_free() when no longer needed.
+ * with imsg_free() when no longer needed. Replies to asynchronous requests
+ * are passed to their handlers instead and not returned.
  *
  * This function should be called regularly.
  */
@@ -118,6 +378,7 @@ parent_process_events(struct imsg *msg)
 	ssize_t		rv = 0;
 
 	check_signal();
+	broadcast_service();
 	nready = poll(&pfd, 1, 0);
 	if (nready == -1)
 		parent_err("poll");
@@ -129,6 +390,11 @@ parent_process_events(struct imsg *msg)
 			err_type = PNP_CHILD_WARN;
 			break;
 		case (MSG_FATAL):
+			if (standby_pid != -1) {
+				/* The standby takes over once it's gone. */
+				err_type = PNP_CHILD_WARN;
+				break;
+			}
 			/* Check if the child really exited. */
 			if (check_child())
 				parent_err("Child sent fatal error, but is "
@@ -141,13 +407,23 @@ parent_process_events(struct imsg *msg)
 		default:
 			err_type = -1;
 		}
+		if (msg->hdr.peerid == 0 && play_req_id == 0
+		    && (msg->hdr.type == MSG_DONE
+		    || msg->hdr.type == MSG_NACK))
+			playing = 0; /* start_play() is over. */
 		if (err_type != -1) {
 			err_msg = (char *)msg->data;
 			err_msg[msg->hdr.len - 1] = '\0';
 			err_cb(err_type, err_msg);
 			rv = -1;
+		}
+		if (dispatch_reply(msg)) {
 			imsg_free(msg);
+			if (rv > 0)
+				rv = 0;
 		}
+		else if (err_type != -1)
+			imsg_free(msg);
 	}
 	if (pfd.revents & (POLLIN|POLLHUP)) {
 		if (imsg_read(&ibuf) == -1 && errno != EAGAIN)
@@ -155,7 +431,8 @@ parent_process_events(struct imsg *msg)
 	}
 	if (pfd.revents & POLLOUT) {
 		/* Send own messages. */
-		if (imsg_flush(&ibuf) == -1)
+		if (imsg_flush(&ibuf) == -1
+		    && (errno != EPIPE || standby_pid == -1))
 			parent_err("imsg_flush");
 	}
 	return (rv);
@@ -167,24 +444,19 @@ parent_process_events(struct imsg *msg)
  */
 static void
 check_signal(void) {
-	int 		child_status;
-	struct imsg	imsg;
+	int 		child_status, standby_died;
 
 	if (caught_sigchld) {
-		if (check_child())
+		caught_sigchld = 0;
+		standby_died = check_standby();
+		if (!check_child())
+			child_died();
+		else if (!standby_died)
 			err_cb(PNP_PARENT_WARN, "spurious SIGCHILD caught");
-		else {
-			/* See if we got an error message. */
-			if (imsg_read(&ibuf) == -1 && errno != EAGAIN)
-				parent_err("imsg_read");
-			if (imsg_get(&ibuf, &imsg) == -1)
-				parent_err("imsg_get");
-			if (imsg.hdr.type == MSG_FATAL)
-				err_cb(PNP_CHILD_FATAL, "fatal error");
-			exit(1);
-		}
 	}
 	if (term_sig) {
+		if (standby_pid != -1)
+			kill(standby_pid, SIGTERM);
 		if (kill(child_pid, SIGTERM))
 			parent_err("kill");
 		while (waitpid(child_pid, &child_status, 0) == -1) {
@@ -197,6 +469,130 @@ check_signal(void) {
 	}
 }
 
+/*
+ * check_standby: If the standby child died, start a new one and return 1.
+ * Otherwise, return 0.
+ */
+static int
+check_standby(void)
+{
+	int	status;
+	pid_t	rv;
+
+	if (standby_pid == -1)
+		return (0);
+	while ((rv = waitpid(standby_pid, &status, WNOHANG)) == -1) {
+		if (errno != EINTR)
+			parent_err("waitpid");
+	}
+	if (rv != standby_pid)
+		return (0);
+	if (close(standby_fd))
+		parent_err("close");
+	munmap(standby_shared, sizeof(*standby_shared));
+	standby_pid = standby_fd = -1;
+	standby_shared = NULL;
+	err_cb(PNP_PARENT_WARN, "standby child died");
+	spawn_standby();
+	return (1);
+}
+
+/*
+ * child_died: Pass on the replies the child sent before it exited, then
+ * let the standby take over. Without a standby, exit.
+ */
+static void
+child_died(void)
+{
+	struct imsg	imsg;
+	ssize_t		n;
+	int		fatal = 0;
+
+	if (imsg_read(&ibuf) == -1 && errno != EAGAIN)
+		parent_err("imsg_read");
+	while ((n = imsg_get(&ibuf, &imsg)) > 0) {
+		if (imsg.hdr.type == MSG_FATAL)
+			fatal = 1;
+		else
+			dispatch_reply(&imsg);
+		imsg_free(&imsg);
+	}
+	if (n == -1)
+		parent_err("imsg_get");
+	if (recover() == 0) {
+		err_cb(PNP_PARENT_WARN, "child died, standby took over");
+		return;
+	}
+	if (fatal)
+		err_cb(PNP_CHILD_FATAL, "fatal error");
+	exit(1);
+}
+
+/*
+ * recover: Make the standby the running child. Requests the dead child
+ * didn't answer fail, except for playback: the standby resumes it at the
+ * last sample the dead child handed to its output. Returns -1 if there is
+ * no standby.
+ */
+static int
+recover(void)
+{
+	TAILQ_HEAD(, request)	failed = TAILQ_HEAD_INITIALIZER(failed);
+	struct request		*req, *next;
+	struct stream_cmd	cmd;
+	uint64_t		pos;
+	int			in_fd = -1;
+
+	if (standby_pid == -1)
+		return (-1);
+	pos = shared != NULL ? shared->sample_pos : 0;
+	imsg_clear(&ibuf);
+	if (close(ibuf.fd))
+		parent_err("close");
+	if (shared != NULL)
+		munmap(shared, sizeof(*shared));
+	imsg_init(&ibuf, standby_fd);
+	pfd.fd = standby_fd;
+	child_pid = standby_pid;
+	shared = standby_shared;
+	standby_pid = standby_fd = -1;
+	standby_shared = NULL;
+
+	/* What was read from standard input is gone, so it can't resume. */
+	if (playing && (strcmp(play_path, "-") == 0 ||
+	    (in_fd = open_input(play_path)) == -1))
+		playing = 0;
+	/* Callbacks may send new requests; those must not fail, too. */
+	TAILQ_FOREACH_SAFE(req, &requests, entry, next) {
+		if (playing && req->id == play_req_id)
+			continue;
+		TAILQ_REMOVE(&requests, req, entry);
+		TAILQ_INSERT_TAIL(&failed, req, entry);
+		npending--;
+	}
+	if (playing) {
+		if (cur_fd != -1 && close(cur_fd))
+			parent_err("close");
+		if ((cur_fd = dup(in_fd)) == -1)
+			parent_err("dup");
+		new_request(CMD_NEW_INPUT_FILE, in_fd, NULL, status_reply);
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.pos = pos;
+		if (imsg_compose(&ibuf, (u_int32_t)CMD_PLAY, play_req_id,
+		    getpid(), -1, &cmd, sizeof(cmd)) == -1)
+			parent_err("imsg_compose");
+		if (paused)
+			parent_msg(CMD_PAUSE, NULL, 0);
+	}
+	while ((req = TAILQ_FIRST(&failed)) != NULL) {
+		TAILQ_REMOVE(&failed, req, entry);
+		fail_request(req);
+		free(req);
+	}
+	spawn_standby();
+	return (0);
+}
+
 void
 stop_child(void)
 {
@@ -205,130 +601,640 @@ stop_child(void)
 		parent_err("imsg_flush");
 }
 
-struct meta
-*get_meta()
+/*
+ * dump_trace: Make both processes write their trace buffers to disk. Does
+ * nothing unless pnp was built with tracing enabled.
+ */
+void
+dump_trace(void)
+{
+	parent_msg(CMD_TRACE_DUMP, NULL, 0);
+	if (imsg_flush(&ibuf) == -1)
+		parent_err("imsg_flush");
+	TRACE_DUMP();
+}
+
+/*
+ * new_request: Send a command to the child with the next request ID and add
+ * it to the pending requests. The caller sets the callback. Commands with
+ * cmd == NULL are for stream 0.
+ */
+static struct request *
+new_request(int type, int fd, const struct stream_cmd *cmd,
+    int (*handle)(struct request *, struct imsg *))
+{
+	struct request	*req;
+
+	if ((req = calloc(1, sizeof(struct request))) == NULL)
+		parent_err("calloc");
+	req->id = next_id++;
+	if (next_id == 0)
+		next_id = 1; /* 0 means that a message answers no request. */
+	req->handle = handle;
+	req->fd = -1;
+	if (imsg_compose(&ibuf, (u_int32_t)type, req->id, getpid(), fd, cmd,
+	    cmd != NULL ? sizeof(*cmd) : 0) == -1)
+		parent_err("imsg_compose");
+	TAILQ_INSERT_TAIL(&requests, req, entry);
+	npending++;
+	return (req);
+}
+
+/*
+ * dispatch_reply: If msg answers a pending request, pass it to the
+ * request's handler and return 1. Otherwise, return 0.
+ */
+static int
+dispatch_reply(struct imsg *msg)
+{
+	struct request	*req;
+
+	if (msg->hdr.peerid == 0)
+		return (0);
+	TAILQ_FOREACH(req, &requests, entry) {
+		if (req->id == msg->hdr.peerid)
+			break;
+	}
+	if (req == NULL)
+		return (0);
+	if (req->handle(req, msg)) {
+		if (req->id == play_req_id)
+			playing = play_req_id = 0;
+		TAILQ_REMOVE(&requests, req, entry);
+		npending--;
+		free(req);
+	}
+	return (1);
+}
+
+/* fail_request: Answer a request with a MSG_NACK of our own. */
+static void
+fail_request(struct request *req)
 {
-	struct meta	*mdata = malloc(sizeof(struct meta));
 	struct imsg	msg;
-	char		**field = NULL, *trackstr;
-	const char	*errstr = NULL;
-	size_t		len;
 
-	if (mdata == NULL)
-		return (NULL);
+	memset(&msg, 0, sizeof(msg));
+	msg.hdr.type = MSG_NACK;
+	msg.hdr.len = IMSG_HEADER_SIZE;
+	msg.hdr.peerid = req->id;
+	msg.fd = -1;
+	req->handle(req, &msg);
+}
+
+/* open_input: Open infile for the child; "-" is standard input. */
+static int
+open_input(char *infile)
+{
+	if (strcmp(infile, "-") == 0)
+		return (dup(STDIN_FILENO));
+	return (open(infile, O_RDONLY|O_NONBLOCK));
+}
+
+/* set_playing: Remember what is being played, for a standby. */
+static void
+set_playing(char *infile, uint32_t id)
+{
+	free(play_path);
+	if ((play_path = strdup(infile)) == NULL)
+		parent_err("strdup");
+	play_req_id = id;
+	playing = 1;
+	paused = 0;
+}
+
+/* pending_requests: Return the number of requests waiting for replies. */
+int
+pending_requests(void)
+{
+	return (npending);
+}
+
+/* status_reply: MSG_ACK and MSG_DONE mean success, MSG_NACK failure. */
+static int
+status_reply(struct request *req, struct imsg *msg)
+{
+	int	status;
+
+	switch (msg->hdr.type) {
+	case (MSG_ACK):
+	case (MSG_DONE):
+		status = 0;
+		break;
+	case (MSG_NACK):
+		status = 1;
+		break;
+	default:
+		return (0);
+	}
+	if (req->cb.status != NULL)
+		req->cb.status(status, req->arg);
+	return (1);
+}
+
+static struct meta *
+new_meta(void)
+{
+	struct meta	*mdata;
+
+	if ((mdata = malloc(sizeof(struct meta))) == NULL)
+		parent_err("malloc");
 	mdata->artist = NULL;
 	mdata->title = NULL;
 	mdata->album = NULL;
 	mdata->trackno = -1;
 	mdata->date = NULL;
 	mdata->time = NULL;
+	return (mdata);
+}
 
-	parent_msg(CMD_META, NULL, 0);
-	while (1) {
-		if (parent_process_events(&msg) > 0) {
-			field = NULL;
-			switch ((int)msg.hdr.type) {
-			case (META_ARTIST):
-				field = &mdata->artist;
-				break;
-			case (META_TITLE):
-				field = &mdata->title;
-				break;
-			case (META_ALBUM):
-				field = &mdata->album;
-				break;
-			case (META_TRACKNO):
-				/* Store the track number as an int. */
-				len = msg.hdr.len - IMSG_HEADER_SIZE;
-				trackstr = strndup(msg.data, len);
-				if (trackstr == NULL)
-					parent_err("strndup");
-				mdata->trackno = (int)strtonum(trackstr, 0,
-				    INT_MAX, &errstr);
-				if (errstr != NULL)
-					mdata->trackno = -1;
-				free(trackstr);
-				break;
-			case (META_DATE):
-				field = &mdata->date;
-				break;
-			case (META_TIME):
-				field = &mdata->time;
-				break;
-			case (MSG_DONE):
-				goto done;
-			case (MSG_NACK):
-				goto fail;
-			}
-			if (field != NULL && msg.data != NULL) {
-				len = msg.hdr.len - IMSG_HEADER_SIZE;
-				*field = strndup(msg.data, len);
-				if (*field == NULL)
-					parent_err("strndup");
-			}
-			imsg_free(&msg);
+static int
+meta_reply(struct request *req, struct imsg *msg)
+{
+	struct meta	*mdata = req->meta;
+	char		**field = NULL, *trackstr;
+	const char	*errstr = NULL;
+	size_t		len;
+
+	switch ((int)msg->hdr.type) {
+	case (META_ARTIST):
+		field = &mdata->artist;
+		break;
+	case (META_TITLE):
+		field = &mdata->title;
+		break;
+	case (META_ALBUM):
+		field = &mdata->album;
+		break;
+	case (META_TRACKNO):
+		/* Store the track number as an int. */
+		len = msg->hdr.len - IMSG_HEADER_SIZE;
+		trackstr = strndup(msg->data, len);
+		if (trackstr == NULL)
+			parent_err("strndup");
+		mdata->trackno = (int)strtonum(trackstr, 0, INT_MAX, &errstr);
+		if (errstr != NULL)
+			mdata->trackno = -1;
+		free(trackstr);
+		break;
+	case (META_DATE):
+		field = &mdata->date;
+		break;
+	case (META_TIME):
+		field = &mdata->time;
+		break;
+	case (MSG_DONE):
+		req->cb.meta(mdata, req->arg);
+		return (1);
+	case (MSG_NACK):
+		free_meta(mdata);
+		req->cb.meta(NULL, req->arg);
+		return (1);
+	}
+	if (field != NULL && msg->data != NULL) {
+		len = msg->hdr.len - IMSG_HEADER_SIZE;
+		*field = strndup(msg->data, len);
+		if (*field == NULL)
+			parent_err("strndup");
+	}
+	return (0);
+}
+
+/*
+ * picture_reply: Read the picture the child found from the parent's own fd.
+ * The location comes from the child, so it has to lie within the file.
+ */
+static int
+picture_reply(struct request *req, struct imsg *msg)
+{
+	struct picture	*pic = NULL;
+	struct stat	sb;
+	unsigned char	*data;
+
+	switch (msg->hdr.type) {
+	case (MSG_PICTURE):
+		if (msg->hdr.len - IMSG_HEADER_SIZE == sizeof(req->loc)) {
+			memcpy(&req->loc, msg->data, sizeof(req->loc));
+			req->loc.mime[sizeof(req->loc.mime) - 1] = '\0';
+			req->found = 1;
 		}
+		return (0);
+	case (MSG_DONE):
+		if (!req->found || req->fd == -1 || req->loc.length == 0
+		    || req->loc.length > PICTURE_MAX_LEN
+		    || fstat(req->fd, &sb) == -1 || sb.st_size < 0
+		    || req->loc.offset > (uint64_t)sb.st_size
+		    || req->loc.length > (uint64_t)sb.st_size - req->loc.offset)
+			break;
+		if ((data = malloc(req->loc.length)) == NULL)
+			parent_err("malloc");
+		if (pread(req->fd, data, req->loc.length,
+		    (off_t)req->loc.offset) != (ssize_t)req->loc.length)
+			free(data);
+		else
+			pic = picture_cache_add(&req->loc, data);
+		break;
+	case (MSG_NACK):
+		break;
+	default:
+		return (0);
 	}
+	if (req->fd != -1 && close(req->fd))
+		parent_err("close");
+	req->cb.picture(pic, req->arg);
+	return (1);
+}
 
-done:
-	imsg_free(&msg);
-	return (mdata);
+static int
+stats_reply(struct request *req, struct imsg *msg)
+{
+	int	status;
 
-fail:
-	imsg_free(&msg);
-	free_meta(mdata);
-	return (NULL);
+	switch (msg->hdr.type) {
+	case (MSG_STATS):
+		if (msg->hdr.len - IMSG_HEADER_SIZE == sizeof(*req->stats)) {
+			memcpy(req->stats, msg->data, sizeof(*req->stats));
+			status = 0;
+		}
+		else
+			status = -1;
+		break;
+	case (MSG_NACK):
+		status = -1;
+		break;
+	default:
+		return (0);
+	}
+	req->cb.status(status, req->arg);
+	return (1);
 }
 
-int
-send_new_file(char *infile)
+/*
+ * pcm_reply: Pass the samples in the ring on with each MSG_PCM. The ring
+ * is unmapped once the decode is over.
+ */
+static int
+pcm_reply(struct request *req, struct imsg *msg)
+{
+	int	status;
+
+	switch (msg->hdr.type) {
+	case (MSG_PCM):
+		pcm_deliver(req);
+		return (0);
+	case (MSG_DONE):
+		pcm_deliver(req);
+		status = 0;
+		break;
+	case (MSG_NACK):
+		status = 1;
+		break;
+	default:
+		return (0);
+	}
+	pcm_ring_free(req->pcm, req->pcm_size);
+	if (req->cb.status != NULL)
+		req->cb.status(status, req->arg);
+	return (1);
+}
+
+/*
+ * pcm_deliver: Copy what is in the ring to the caller's buffer, a buffer
+ * full at a time. Blocks hold whole sample frames unless the buffer is
+ * smaller than one. At most a ring's worth is passed on, so a child that
+ * keeps moving wpos can't keep the parent here.
+ */
+static void
+pcm_deliver(struct request *req)
+{
+	struct pcm_ring		*ring = req->pcm;
+	struct pnp_pcm_format	fmt;
+	size_t			framesize, chunk, len, total = 0;
+
+	fmt.rate = ring->rate;
+	fmt.channels = ring->channels;
+	fmt.bits = ring->bits;
+	framesize = fmt.channels * (fmt.bits / 8);
+	chunk = req->bufsize;
+	if (framesize != 0 && chunk >= framesize)
+		chunk -= chunk % framesize;
+	while (total < req->pcm_size && (len = pcm_ring_read(ring,
+	    req->pcm_size, req->buf, chunk)) > 0) {
+		req->block(&fmt, req->buf, len, req->arg);
+		total += len;
+	}
+}
+
+/*
+ * get_meta_async: Ask the child for the metadata of the current file. The
+ * callback gets the result of get_meta() and has to free it.
+ */
+void
+get_meta_async(void (*cb)(struct meta *, void *), void *arg)
+{
+	struct request	*req;
+
+	req = new_request(CMD_META, -1, NULL, meta_reply);
+	req->cb.meta = cb;
+	req->arg = arg;
+	req->meta = new_meta();
+}
+
+/*
+ * get_picture_async: Ask the child for the cover art of the current file.
+ * The callback gets the result of get_picture().
+ */
+void
+get_picture_async(void (*cb)(struct picture *, void *), void *arg)
+{
+	struct request	*req;
+
+	req = new_request(CMD_PICTURE, -1, NULL, picture_reply);
+	req->cb.picture = cb;
+	req->arg = arg;
+	/* Hold on to the file in case the next one is sent before we read. */
+	if (cur_fd != -1 && (req->fd = dup(cur_fd)) == -1)
+		parent_err("dup");
+}
+
+/*
+ * send_new_file_async: Pass a new input file to the child. The callback
+ * gets the result of send_new_file() and may be NULL.
+ */
+void
+send_new_file_async(char *infile, void (*cb)(int, void *), void *arg)
+{
+	struct request	*req;
+	int		in_fd;
+
+	/* A new file stops playback. */
+	playing = play_req_id = 0;
+	in_fd = open_input(infile);
+	/*
+	 * Keep a copy, so get_picture() can read the image data itself. It
+	 * shares the file offset with the child's, so only use pread(2).
+	 */
+	if (cur_fd != -1 && close(cur_fd))
+		parent_err("close");
+	cur_fd = -1;
+	if (in_fd != -1 && (cur_fd = dup(in_fd)) == -1)
+		parent_err("dup");
+	req = new_request(CMD_NEW_INPUT_FILE, in_fd, NULL, status_reply);
+	req->cb.status = cb;
+	req->arg = arg;
+}
+
+/*
+ * start_play_async: Play or decode a new file. The callback runs when
+ * playback is over; its status is 0 if the whole file was played and 1
+ * otherwise, including when a new file stopped it.
+ */
+void
+start_play_async(char *infile, void (*cb)(int, void *), void *arg)
+{
+	struct request	*req;
+
+	send_new_file_async(infile, NULL, NULL);
+	req = new_request(CMD_PLAY, -1, NULL, status_reply);
+	req->cb.status = cb;
+	req->arg = arg;
+	set_playing(infile, req->id);
+}
+
+/*
+ * decode_stream_async: Decode infile to out_fd on another stream, next to
+ * whatever stream 0 is doing. out_type is OUT_WAV_FILE, OUT_RAW or
+ * OUT_NULL; out_fd is passed to the child and closed. The callback is
+ * called like the one of start_play_async().
+ */
+void
+decode_stream_async(int stream, char *infile, int out_fd, int out_type,
+    void (*cb)(int, void *), void *arg)
+{
+	struct stream_cmd	cmd;
+	struct request		*req;
+	int			in_fd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.stream = stream;
+	cmd.out_type = out_type;
+	new_request(CMD_NEW_OUTPUT, out_fd, &cmd, status_reply);
+	in_fd = open_input(infile);
+	new_request(CMD_NEW_INPUT_FILE, in_fd, &cmd, status_reply);
+	req = new_request(CMD_PLAY, -1, &cmd, status_reply);
+	req->cb.status = cb;
+	req->arg = arg;
+}
+
+/*
+ * add_tap_async: Also write what the stream decodes next to fd, as WAVE
+ * (OUT_WAV_FILE) or raw samples (OUT_RAW). Send it before the CMD_PLAY;
+ * the tap is used for one file. fd is passed to the child and closed.
+ */
+void
+add_tap_async(int stream, int fd, int out_type, void (*cb)(int, void *),
+    void *arg)
+{
+	struct stream_cmd	cmd;
+	struct request		*req;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.stream = stream;
+	cmd.out_type = out_type;
+	req = new_request(CMD_ADD_TAP, fd, &cmd, status_reply);
+	req->cb.status = cb;
+	req->arg = arg;
+}
+
+/*
+ * decode_pcm_async: Decode infile on a stream and hand the samples to
+ * block() in buf, which holds bufsize bytes. They come through memory
+ * shared with the child, so no file is written. done() is called like the
+ * callback of start_play_async() and may be NULL.
+ */
+void
+decode_pcm_async(int stream, char *infile, void *buf, size_t bufsize,
+    void (*block)(const struct pnp_pcm_format *, void *, size_t, void *),
+    void (*done)(int, void *), void *arg)
+{
+	struct stream_cmd	cmd;
+	struct request		*req;
+	struct pcm_ring		*ring;
+	int			in_fd, ring_fd;
+
+	if (bufsize == 0)
+		parent_err("decode_pcm_async: empty buffer");
+	if ((ring = pcm_ring_new(&ring_fd, PCM_RING_SIZE)) == NULL)
+		parent_err("pcm_ring_new");
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.stream = stream;
+	cmd.out_type = OUT_PCM;
+	new_request(CMD_NEW_OUTPUT, ring_fd, &cmd, status_reply);
+	in_fd = open_input(infile);
+	new_request(CMD_NEW_INPUT_FILE, in_fd, &cmd, status_reply);
+	req = new_request(CMD_PLAY, -1, &cmd, pcm_reply);
+	req->cb.status = done;
+	req->block = block;
+	req->arg = arg;
+	req->pcm = ring;
+	req->pcm_size = PCM_RING_SIZE;
+	req->buf = buf;
+	req->bufsize = bufsize;
+}
+
+static void
+wait_sync(struct sync_reply *r)
 {
 	struct imsg	msg;
-	int		in_fd, rv = -1;
 
-	in_fd = open(infile, O_RDONLY|O_NONBLOCK);
-	if (imsg_compose(&ibuf, (u_int32_t)CMD_NEW_INPUT_FILE, 0, 0, in_fd,
-	    NULL, 0) == -1)
-		parent_err("imsg_compose");
-	while (1) {
-		if (parent_process_events(&msg) > 0) {
-			switch (msg.hdr.type) {
-			case (MSG_ACK):
-				rv = 0;
-				break;
-			case (MSG_NACK):
-				rv = 1;
-				break;
-			default:
-				break;
-			}
+	while (!r->done) {
+		if (parent_process_events(&msg) > 0)
 			imsg_free(&msg);
-			if (rv != -1)
-				return (rv);
-		}
 	}
-	return (rv);
+}
+
+static void
+sync_status(int status, void *arg)
+{
+	struct sync_reply	*r = arg;
+
+	r->status = status;
+	r->done = 1;
+}
+
+static void
+sync_meta(struct meta *mdata, void *arg)
+{
+	struct sync_reply	*r = arg;
+
+	r->meta = mdata;
+	r->done = 1;
+}
+
+static void
+sync_picture(struct picture *pic, void *arg)
+{
+	struct sync_reply	*r = arg;
+
+	r->picture = pic;
+	r->done = 1;
+}
+
+struct meta
+*get_meta()
+{
+	struct sync_reply	r;
+
+	memset(&r, 0, sizeof(r));
+	get_meta_async(sync_meta, &r);
+	wait_sync(&r);
+	return (r.meta);
+}
+
+/*
+ * get_picture: Ask the child where the cover art of the current file is
+ * and read it. Returns NULL if there is none or it can't be read.
+ */
+struct picture *
+get_picture(void)
+{
+	struct sync_reply	r;
+
+	memset(&r, 0, sizeof(r));
+	get_picture_async(sync_picture, &r);
+	wait_sync(&r);
+	return (r.picture);
+}
+
+/*
+ * get_stats: Ask the child for a snapshot of its counters and store it in
+ * the supplied struct. Returns 0 on success and -1 if the reply was
+ * malformed.
+ */
+int
+get_stats(struct pnp_stats *stats)
+{
+	return (get_stream_stats(0, stats));
+}
+
+/* get_stream_stats: Like get_stats(), but for any stream. */
+int
+get_stream_stats(int stream, struct pnp_stats *stats)
+{
+	struct stream_cmd	cmd;
+	struct request		*req;
+	struct sync_reply	r;
+
+	memset(&r, 0, sizeof(r));
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.stream = stream;
+	req = new_request(CMD_STATS, -1, &cmd, stats_reply);
+	req->cb.status = sync_status;
+	req->arg = &r;
+	req->stats = stats;
+	wait_sync(&r);
+	return (r.status);
+}
+
+/*
+ * decode_pcm: Like decode_pcm_async(), but return once the file is
+ * decoded. Returns 0 on success and 1 on error.
+ */
+int
+decode_pcm(int stream, char *infile, void *buf, size_t bufsize,
+    void (*block)(const struct pnp_pcm_format *, void *, size_t, void *),
+    void *arg)
+{
+	struct sync_reply	r;
+
+	memset(&r, 0, sizeof(r));
+	decode_pcm_async(stream, infile, buf, bufsize, block, sync_status,
+	    &r);
+	wait_sync(&r);
+	return (r.status);
+}
+
+int
+send_new_file(char *infile)
+{
+	struct sync_reply	r;
+
+	memset(&r, 0, sizeof(r));
+	send_new_file_async(infile, sync_status, &r);
+	wait_sync(&r);
+	return (r.status);
+}
+
+int
+add_tap(int stream, int fd, int out_type)
+{
+	struct sync_reply	r;
+
+	memset(&r, 0, sizeof(r));
+	add_tap_async(stream, fd, out_type, sync_status, &r);
+	wait_sync(&r);
+	return (r.status);
 }
 
 int
 decode(char *infile)
 {
-	struct imsg	msg;
+	struct request		*req;
+	struct sync_reply	r;
 
 	if (send_new_file(infile))
 		return (1);
-	parent_msg((u_int32_t)CMD_PLAY, NULL, 0);
-	while (1) {
-		if (parent_process_events(&msg) > 0) {
-			if (msg.hdr.type == MSG_DONE) {
-				imsg_free(&msg);
-				return (0);
-			}
-			imsg_free(&msg);
-		}
-	}
+	memset(&r, 0, sizeof(r));
+	req = new_request(CMD_PLAY, -1, NULL, status_reply);
+	req->cb.status = sync_status;
+	req->arg = &r;
+	wait_sync(&r);
+	return (r.status);
 }
 
+/*
+ * start_play: Start playing a new file and return. The MSG_DONE at the end
+ * goes to the caller of parent_process_events().
+ */
 int
 start_play(char *infile)
 {
@@ -336,6 +1242,7 @@ start_play(char *infile)
 
 	if (send_new_file(infile))
 		return (1);
+	set_playing(infile, 0);
 	parent_msg((u_int32_t)CMD_PLAY, NULL, 0);
 	if (parent_process_events(&msg) > 0) {
 		imsg_free(&msg);
@@ -348,6 +1255,7 @@ pause_play(void)
 {
 	struct imsg	msg;
 
+	paused = 1;
 	parent_msg((u_int32_t)CMD_PAUSE, NULL, 0);
 	if (parent_process_events(&msg) > 0) {
 		imsg_free(&msg);
@@ -360,6 +1268,7 @@ resume_play(void)
 {
 	struct imsg	msg;
 
+	paused = 0;
 	parent_msg((u_int32_t)CMD_PLAY, NULL, 0);
 	if (parent_process_events(&msg) > 0) {
 		imsg_free(&msg);
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include "pcm.h"
+
+/*
+ * pcm_ring_new: Create an empty ring with size bytes of data in anonymous
+ * shared memory and store its fd in *fd. Returns NULL on error.
+ */
+struct pcm_ring *
+pcm_ring_new(int *fd, size_t size)
+{
+	struct pcm_ring	*ring;
+	char		path[] = "/tmp/pnp-pcm.XXXXXXXXXX";
+	size_t		len = sizeof(struct pcm_ring) + size;
+
+	if ((*fd = shm_mkstemp(path)) == -1)
+		return (NULL);
+	if (shm_unlink(path) == -1 || ftruncate(*fd, len) == -1) {
+		close(*fd);
+		return (NULL);
+	}
+	ring = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (ring == MAP_FAILED) {
+		close(*fd);
+		return (NULL);
+	}
+	ring->wpos = ring->rpos = ring->fmt_pos = 0;
+	ring->rate = ring->channels = ring->bits = 0;
+	ring->size = size;
+	return (ring);
+}
+
+/*
+ * pcm_ring_map: Map the ring the parent passed in fd and close fd. Returns
+ * NULL if it isn't one.
+ */
+struct pcm_ring *
+pcm_ring_map(int fd)
+{
+	struct pcm_ring	*ring;
+	struct stat	sb;
+
+	if (fstat(fd, &sb) == -1
+	    || (size_t)sb.st_size < sizeof(struct pcm_ring)) {
+		close(fd);
+		return (NULL);
+	}
+	ring = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return (NULL);
+	if (ring->size == 0
+	    || ring->size > (size_t)sb.st_size - sizeof(*ring)) {
+		munmap(ring, sb.st_size);
+		return (NULL);
+	}
+	return (ring);
+}
+
+/*
+ * pcm_ring_free: Unmap a ring with size bytes of data. The parent passes
+ * the size it created the ring with, not ring->size.
+ */
+void
+pcm_ring_free(struct pcm_ring *ring, size_t size)
+{
+	munmap(ring, sizeof(*ring) + size);
+}
+
+/* pcm_ring_space: Return how many bytes can be written. */
+size_t
+pcm_ring_space(struct pcm_ring *ring)
+{
+	return (ring->size - (size_t)(ring->wpos - ring->rpos));
+}
+
+/*
+ * pcm_ring_write: Append len bytes. The caller makes sure that they fit
+ * and tells the parent afterwards. A broadcast ring is written without
+ * regard to rpos; see broadcast.c.
+ */
+void
+pcm_ring_write(struct pcm_ring *ring, const void *buf, size_t len)
+{
+	size_t	off, to_end;
+
+	off = ring->wpos % ring->size;
+	to_end = ring->size - off;
+	if (len <= to_end)
+		memcpy(ring->data + off, buf, len);
+	else {
+		memcpy(ring->data + off, buf, to_end);
+		memcpy(ring->data, (const unsigned char *)buf + to_end,
+		    len - to_end);
+	}
+	/* The samples have to be in place before the parent sees them. */
+	__sync_synchronize();
+	ring->wpos += len;
+}
+
+/*
+ * pcm_ring_read: Copy up to len bytes to buf and free their space. size is
+ * the parent's copy of ring->size; a child that claims to have written
+ * more than that gets it cut short. Returns the number of bytes copied.
+ */
+size_t
+pcm_ring_read(struct pcm_ring *ring, size_t size, void *buf, size_t len)
+{
+	uint64_t	rpos = ring->rpos, wpos = ring->wpos;
+	size_t		avail, off, to_end;
+
+	avail = wpos - rpos > size ? size : (size_t)(wpos - rpos);
+	if (len > avail)
+		len = avail;
+	off = rpos % size;
+	to_end = size - off;
+	if (len <= to_end)
+		memcpy(buf, ring->data + off, len);
+	else {
+		memcpy(buf, ring->data + off, to_end);
+		memcpy((unsigned char *)buf + to_end, ring->data,
+		    len - to_end);
+	}
+	/* Don't let the child overwrite what we haven't copied yet. */
+	__sync_synchronize();
+	ring->rpos = rpos + len;
+	return (len);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_PCM_H
+#define PNP_PCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ring buffer in shared memory for OUT_PCM. The parent creates it and
+ * passes the fd with CMD_NEW_OUTPUT. The child decodes into it and sends a
+ * MSG_PCM after every block; the parent copies the samples out and moves
+ * rpos on. Both positions count bytes since the start and only grow. The
+ * child fills in the format before the first block. The child can write
+ * all of it, so the parent keeps its own copy of size and checks every
+ * position it reads against that.
+ */
+struct pcm_ring {
+	volatile uint64_t	wpos, rpos;
+	volatile uint64_t	fmt_pos; /* Broadcast: where the format began */
+	uint32_t		rate, channels, bits;
+	uint32_t		size;	/* Of data, in bytes. */
+	unsigned char		data[];
+};
+
+/*
+ * The largest block FLAC allows: 65535 samples of 8 channels with up to
+ * 4 bytes each. The ring holds two, so the child can decode the next one
+ * while the parent copies the last.
+ */
+#define PCM_MAX_BLOCK	(65535 * 8 * 4)
+#define PCM_RING_SIZE	(2 * PCM_MAX_BLOCK)
+
+struct pcm_ring	*pcm_ring_new(int *, size_t);
+struct pcm_ring	*pcm_ring_map(int);
+void		pcm_ring_free(struct pcm_ring *, size_t);
+size_t		pcm_ring_space(struct pcm_ring *);
+void		pcm_ring_write(struct pcm_ring *, const void *, size_t);
+size_t		pcm_ring_read(struct pcm_ring *, size_t, void *, size_t);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Cache for the pictures returned by get_picture(). Pictures are looked up
+ * by the SHA-256 of their data, so an album's worth of tracks with the
+ * same cover art shares one copy. Unused pictures are evicted, least
+ * recently used first, once there are more than PICTURE_CACHE_SIZE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <sha2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pnp.h"
+
+#define PICTURE_CACHE_SIZE	32
+
+static TAILQ_HEAD(picture_list, picture)	cache =
+    TAILQ_HEAD_INITIALIZER(cache);
+static int			ncached;
+
+static void	evict(void);
+
+/*
+ * picture_cache_add: Take ownership of data, which holds the picture that
+ * loc describes, and return the cached picture with the same content.
+ */
+struct picture *
+picture_cache_add(const struct picture_loc *loc, unsigned char *data)
+{
+	struct picture	*p;
+	SHA2_CTX	ctx;
+	unsigned char	hash[SHA256_DIGEST_LENGTH];
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, data, loc->length);
+	SHA256Final(hash, &ctx);
+	TAILQ_FOREACH(p, &cache, entry) {
+		if (p->len == loc->length
+		    && memcmp(p->hash, hash, sizeof(hash)) == 0) {
+			free(data);
+			TAILQ_REMOVE(&cache, p, entry);
+			TAILQ_INSERT_HEAD(&cache, p, entry);
+			p->refs++;
+			return (p);
+		}
+	}
+	if ((p = malloc(sizeof(*p))) == NULL)
+		parent_err("malloc");
+	memcpy(p->mime, loc->mime, sizeof(p->mime));
+	p->type = loc->type;
+	p->data = data;
+	p->len = loc->length;
+	memcpy(p->hash, hash, sizeof(p->hash));
+	p->refs = 1;
+	TAILQ_INSERT_HEAD(&cache, p, entry);
+	ncached++;
+	evict();
+	return (p);
+}
+
+/*
+ * free_picture: Drop a reference. The picture stays cached until it is
+ * evicted.
+ */
+void
+free_picture(struct picture *p)
+{
+	if (p != NULL && p->refs > 0)
+		p->refs--;
+	evict();
+}
+
+static void
+evict(void)
+{
+	struct picture	*p, *prev;
+
+	for (p = TAILQ_LAST(&cache, picture_list); p != NULL &&
+	    ncached > PICTURE_CACHE_SIZE; p = prev) {
+		prev = TAILQ_PREV(p, picture_list, entry);
+		if (p->refs > 0)
+			continue;
+		TAILQ_REMOVE(&cache, p, entry);
+		free(p->data);
+		free(p);
+		ncached--;
+	}
+}
@@ -22,9 +22,11 @@
 
 #include <imsg.h>
 #include <poll.h>
+#include <stdint.h>
 
 /* output types */
-enum {NONE, OUT_SNDIO, OUT_WAV_FILE, OUT_RAW};
+enum {NONE, OUT_SNDIO, OUT_WAV_FILE, OUT_RAW, OUT_NULL, OUT_PCM,
+    OUT_BROADCAST, OUT_VERIFY};
 /* Error types */
 enum {PNP_CHILD_WARN, PNP_CHILD_FATAL, PNP_CHILD_FILE_ERR, PNP_PARENT_WARN,
     PNP_PARENT_ERR};
@@ -32,6 +34,7 @@ enum {PNP_CHILD_WARN, PNP_CHILD_FATAL, PNP_CHILD_FILE_ERR, PNP_PARENT_WARN,
 union handle {
 	FILE		*fp;
 	struct sio_hdl	*sio;
+	struct pcm_ring	*pcm;
 };
 struct out {
 	int		type;
@@ -48,11 +51,104 @@ struct meta {
 	char		*time;
 };
 
+/* Snapshot of the child's counters, sent in reply to CMD_STATS. */
+struct pnp_stats {
+	uint64_t	bytes_read;	/* From the current input file. */
+	uint64_t	frames_decoded;	/* FLAC frames, not sample frames. */
+	uint64_t	dec_ns_min, dec_ns_avg, dec_ns_max; /* Per block. */
+	uint64_t	sbuf_fill, sbuf_size;	/* In sample frames. */
+	uint64_t	inbuf_fill, inbuf_size;	/* In bytes. */
+	uint64_t	sio_writes, sio_short_writes;
+	uint64_t	underruns;
+	uint64_t	poll_wakeups;
+	uint64_t	sample_pos;	/* Sample frames sent to the output. */
+	uint64_t	pcm_bytes;	/* Produced by the decoder. */
+	uint64_t	cpu_ns;		/* CPU time used by the child. */
+	uint64_t	dec_inits;	/* 0 if the last decoder was reused. */
+};
+
+/*
+ * Result of decoding to OUT_VERIFY, sent as MSG_VERIFY before the MSG_DONE.
+ * Like OUT_NULL, OUT_VERIFY throws the samples away, but it also checks
+ * them against the MD5 signature in the STREAMINFO block. CMD_SCAN only
+ * checks the CRCs of the frames and leaves the MD5 unchecked.
+ */
+enum {VERIFY_OK, VERIFY_UNSIGNED, VERIFY_CORRUPT};	/* status */
+enum {MD5_MATCH, MD5_MISMATCH, MD5_NONE, MD5_UNCHECKED};	/* md5 */
+struct pnp_verify {
+	uint32_t	status;
+	uint32_t	crc_errors;	/* Frames with a bad CRC. */
+	uint32_t	sync_errors;	/* Lost sync or bad frame headers. */
+	uint32_t	md5;
+	uint64_t	samples;	/* Sample frames in the frames found. */
+	uint64_t	expected;	/* From STREAMINFO, 0 if unknown. */
+};
+
+/*
+ * Format of the samples passed to the callback of decode_pcm_async(). They
+ * are interleaved, signed and in host byte order, and take bits/8 bytes
+ * each.
+ */
+struct pnp_pcm_format {
+	unsigned int	rate, channels, bits;
+};
+
+#define PNP_MAX_STREAMS		4	/* Decoded at once by one child. */
+#define PNP_MAX_TAPS		4	/* Extra outputs of a stream. */
+
+/*
+ * Memory shared with a child started by parent_start(). The child keeps it
+ * up to date, so the parent can still read it after the child died.
+ */
+struct pnp_shared {
+	volatile uint64_t	sample_pos;	/* Of stream 0 in its file. */
+};
+
+#define PICTURE_MIME_LEN	64
+#define PICTURE_MAX_LEN		(16 * 1024 * 1024) /* As FLAC allows. */
+#define PICTURE_FRONT_COVER	3	/* Picture type from ID3v2 and FLAC. */
+
+/*
+ * Where the child found an embedded picture, sent in reply to CMD_PICTURE.
+ * The image itself stays in the file; the parent reads it from there.
+ */
+struct picture_loc {
+	uint64_t	offset;		/* Of the image data in the file. */
+	uint32_t	length;
+	uint32_t	type;
+	char		mime[PICTURE_MIME_LEN];
+};
+
+/*
+ * A picture returned by get_picture(). Pictures are cached by the SHA-256
+ * of their data, so tracks with the same cover art share one struct.
+ * Release it with free_picture().
+ */
+struct picture {
+	char			mime[PICTURE_MIME_LEN];
+	uint32_t		type;
+	unsigned char		*data;
+	size_t			len;
+	unsigned char		hash[32];	/* SHA-256 */
+	int			refs;
+	TAILQ_ENTRY(picture)	entry;
+};
+
 int	child_main(int[2], struct out *);
+extern struct pnp_shared	*child_shared;
+
+/*
+ * The decoder the child uses for the samples of FLAC files. The child
+ * reads it when a file starts, so set it before parent_start().
+ */
+enum {FLAC_DEC_LIBFLAC, FLAC_DEC_NATIVE};
+extern int			flac_decoder;
 
 void		free_meta(struct meta *);
 int		decode(char *);
 void		parent_init(int[2], pid_t);
+pid_t		parent_start(struct out *);
+int		parent_standby(int (*)(struct out *));
 int		start_play(char *);
 int		pause_play(void);
 int		resume_play(void);
@@ -64,6 +160,38 @@ int		send_new_file(char *);
 void		set_err_cb(void (*)(int, char *));
 void		parent_msg(int, char *, size_t);
 struct meta	*get_meta(void);
+struct picture	*get_picture(void);
+void		free_picture(struct picture *);
+struct picture	*picture_cache_add(const struct picture_loc *, unsigned char *);
+int		get_stats(struct pnp_stats *);
+int		get_stream_stats(int, struct pnp_stats *);
+int		add_tap(int, int, int);
+int		broadcast_open(const char *);
+int		broadcast_tap(int);
+void		broadcast_service(void);
+uint64_t	broadcast_skips(void);
+void		broadcast_close(void);
+int		decode_pcm(int, char *, void *, size_t,
+		    void (*)(const struct pnp_pcm_format *, void *, size_t,
+		    void *), void *);
 void		stop_child(void);
+void		dump_trace(void);
+
+/*
+ * Asynchronous requests. They return at once, and the callback runs from
+ * parent_process_events() when the child's reply is complete. Requests can
+ * be pipelined; the child answers them in order.
+ */
+void		send_new_file_async(char *, void (*)(int, void *), void *);
+void		start_play_async(char *, void (*)(int, void *), void *);
+void		get_meta_async(void (*)(struct meta *, void *), void *);
+void		get_picture_async(void (*)(struct picture *, void *), void *);
+void		decode_stream_async(int, char *, int, int,
+		    void (*)(int, void *), void *);
+void		decode_pcm_async(int, char *, void *, size_t,
+		    void (*)(const struct pnp_pcm_format *, void *, size_t,
+		    void *), void (*)(int, void *), void *);
+void		add_tap_async(int, int, int, void (*)(int, void *), void *);
+int		pending_requests(void);
 
 #endif
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * pnptrace: Print the records of one or more trace files written by pnp,
+ * merged into a single timeline. Times are relative to the earliest
+ * record; the delta column is the time since the previous record of the
+ * same process.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+struct entry {
+	struct trace_rec	rec;
+	uint32_t		pid;
+	uint64_t		delta;
+};
+
+static int	cmp_entries(const void *, const void *);
+static size_t	load(const char *, struct entry **, size_t);
+
+extern char	*__progname;
+
+int
+main(int argc, char **argv)
+{
+	struct entry	*entries = NULL;
+	size_t		nentries = 0, i;
+	uint64_t	t0;
+
+	if (argc < 2) {
+		(void)fprintf(stderr, "usage: %s trace_file ...\n",
+		    __progname);
+		exit(1);
+	}
+	for (i = 1; i < argc; i++)
+		nentries = load(argv[i], &entries, nentries);
+	if (nentries == 0)
+		return (0);
+	qsort(entries, nentries, sizeof(entries[0]), cmp_entries);
+	t0 = entries[0].rec.ts;
+	printf("%14s %10s %7s %-16s %12s %12s\n", "time/us", "delta/us",
+	    "pid", "event", "a", "b");
+	for (i = 0; i < nentries; i++) {
+		printf("%14.3f %10.3f %7u %-16s %12lld %12lld\n",
+		    (entries[i].rec.ts - t0) / 1000.0,
+		    entries[i].delta / 1000.0, entries[i].pid,
+		    trace_event_name(entries[i].rec.event),
+		    (long long)entries[i].rec.a, (long long)entries[i].rec.b);
+	}
+	free(entries);
+	return (0);
+}
+
+/* load: Append the records of the given file to *entries. */
+static size_t
+load(const char *path, struct entry **entries, size_t n)
+{
+	struct trace_hdr	hdr;
+	struct trace_rec	rec;
+	struct entry		*e;
+	FILE			*fp;
+	uint64_t		i, prev = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+	    || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.version != TRACE_VERSION)
+		errx(1, "%s: not a pnp trace file", path);
+	if (hdr.nrec > TRACE_RING_SIZE)
+		errx(1, "%s: too many records", path);
+	e = reallocarray(*entries, n + hdr.nrec, sizeof(**entries));
+	if (e == NULL)
+		err(1, "reallocarray");
+	*entries = e;
+	for (i = 0; i < hdr.nrec; i++) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1)
+			errx(1, "%s: truncated", path);
+		e[n].rec = rec;
+		e[n].pid = hdr.pid;
+		e[n].delta = i == 0 ? 0 : rec.ts - prev;
+		prev = rec.ts;
+		n++;
+	}
+	fclose(fp);
+	return (n);
+}
+
+static int
+cmp_entries(const void *p1, const void *p2)
+{
+	const struct entry	*e1 = p1, *e2 = p2;
+
+	if (e1->rec.ts < e2->rec.ts)
+		return (-1);
+	return (e1->rec.ts > e2->rec.ts);
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sndio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "child_errors.h"
+#include "file.h"
+#include "out_sndio.h"
+#include "pcm.h"
+#include "pnp.h"
+#include "tee.h"
+
+static int	tap_write(struct tap *);
+static void	tap_close(struct tap *);
+static void	tee_drop(struct tee *, int, const char *);
+
+/*
+ * tee_add: Add a tap writing to fd, or to the PCM ring in fd for
+ * OUT_BROADCAST. fd is closed if -1 is returned.
+ */
+int
+tee_add(struct tee *tee, int fd, int type)
+{
+	struct tap	*tap;
+
+	if (tee->ntaps == PNP_MAX_TAPS || (type != OUT_WAV_FILE
+	    && type != OUT_RAW && type != OUT_BROADCAST)) {
+		close(fd);
+		return (-1);
+	}
+	tap = &tee->tap[tee->ntaps];
+	tap->fp = NULL;
+	tap->pcm = NULL;
+	if (type == OUT_BROADCAST) {
+		if ((tap->pcm = pcm_ring_map(fd)) == NULL)
+			return (-1);
+	}
+	else if ((tap->fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return (-1);
+	}
+	tap->type = type;
+	tap->sbuf = NULL;
+	tap->partial = 0;
+	tap->data_bytes = 0;
+	tee->ntaps++;
+	return (0);
+}
+
+/*
+ * tee_start: Write the WAVE headers and get the taps ready for samples of
+ * the given format. Blocks are at most max_bsize frames long.
+ */
+void
+tee_start(struct tee *tee, unsigned int bps, unsigned int channels,
+    unsigned int rate, uint64_t samples, size_t max_bsize, int realtime)
+{
+	struct tap	*tap;
+	size_t		nframes;
+	int		i, flags;
+
+	tee->realtime = realtime;
+	tee->samples = samples;
+	nframes = (size_t)rate * TEE_BUFFER_MS / 1000;
+	if (nframes < 2 * max_bsize)
+		nframes = 2 * max_bsize;
+	for (i = 0; i < tee->ntaps; ) {
+		tap = &tee->tap[i];
+		if (tap->type == OUT_BROADCAST) {
+			if (tap->pcm->size < max_bsize * channels * (bps/8)) {
+				tee_drop(tee, i, "tee: PCM buffer too small");
+				continue;
+			}
+			/* The parent checks this before each send. */
+			tap->pcm->fmt_pos = tap->pcm->wpos;
+			__sync_synchronize();
+			tap->pcm->rate = rate;
+			tap->pcm->channels = channels;
+			tap->pcm->bits = bps;
+			if ((tap->sbuf = sbuf_acquire(bps/8, channels,
+			    max_bsize)) == NULL)
+				child_fatal("malloc");
+			i++;
+			continue;
+		}
+		if (tap->type == OUT_WAV_FILE && ((tap->hdr_len =
+		    write_wav_header(tap->fp, channels, rate, bps,
+		    samples != 0 ? samples : WAV_UNKNOWN_LENGTH)) == -1
+		    || fflush(tap->fp) == EOF)) {
+			tee_drop(tee, i, "tee: can't write WAVE header");
+			continue;
+		}
+		/* From here on, the samples bypass stdio. */
+		if ((flags = fcntl(fileno(tap->fp), F_GETFL)) == -1
+		    || fcntl(fileno(tap->fp), F_SETFL, flags|O_NONBLOCK)
+		    == -1) {
+			tee_drop(tee, i, "tee: fcntl failed");
+			continue;
+		}
+		if ((tap->sbuf = sbuf_acquire(bps/8, channels, nframes))
+		    == NULL)
+			child_fatal("malloc");
+		i++;
+	}
+}
+
+/* tee_room: Return 1 if every tap has space for nframes, 0 otherwise. */
+int
+tee_room(struct tee *tee, size_t nframes)
+{
+	int	i;
+
+	for (i = 0; i < tee->ntaps; i++)
+		if (tee->tap[i].sbuf != NULL
+		    && tee->tap[i].sbuf->free < nframes)
+			return (0);
+	return (1);
+}
+
+/*
+ * tee_put: Copy a block into every tap. A tap without space has fallen
+ * too far behind and is dropped.
+ */
+void
+tee_put(struct tee *tee, const FLAC__int32 *const smp[], size_t nframes)
+{
+	struct tap	*tap;
+	int		i;
+
+	for (i = 0; i < tee->ntaps; ) {
+		tap = &tee->tap[i];
+		if (tap->sbuf == NULL) {
+			i++;
+			continue;
+		}
+		if (sbuf_put(tap->sbuf, smp, nframes) < nframes) {
+			tee_drop(tee, i, "tee: output too slow, dropped");
+			continue;
+		}
+		tap->data_bytes += nframes * tap->sbuf->framesize;
+		if (tap->type == OUT_BROADCAST) {
+			/* Overwrite what the slowest listener hasn't got. */
+			pcm_ring_write(tap->pcm, tap->sbuf->buf,
+			    nframes * tap->sbuf->framesize);
+			sbuf_clear(tap->sbuf);
+		}
+		i++;
+	}
+}
+
+/* tee_flush: Write what the taps take without blocking. */
+void
+tee_flush(struct tee *tee)
+{
+	int	i;
+
+	for (i = 0; i < tee->ntaps; ) {
+		if (tee->tap[i].sbuf != NULL && tap_write(&tee->tap[i]) == -1)
+			tee_drop(tee, i, "tee: write failed");
+		else
+			i++;
+	}
+}
+
+/*
+ * tee_finish: Write out the rest, fix up the WAVE headers and close the
+ * taps. Unlike tee_flush(), this blocks.
+ */
+void
+tee_finish(struct tee *tee)
+{
+	struct tap	*tap;
+	int		i, flags, fd;
+
+	for (i = 0; i < tee->ntaps; i++) {
+		tap = &tee->tap[i];
+		if (tap->sbuf == NULL || tap->type == OUT_BROADCAST) {
+			tap_close(tap);
+			continue;
+		}
+		fd = fileno(tap->fp);
+		if ((flags = fcntl(fd, F_GETFL)) == -1
+		    || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1
+		    || tap_write(tap) == -1) {
+			child_warn("tee");
+			tap_close(tap);
+			continue;
+		}
+		if (tap->type == OUT_WAV_FILE) {
+			if (tap->data_bytes % 2 != 0
+			    && write(fd, "\0", 1) != 1)
+				child_warn("tee");
+			/* Playback may have stopped early. */
+			if (tap->data_bytes != tee->samples *
+			    tap->sbuf->framesize)
+				patch_wav_header(tap->fp, tap->hdr_len,
+				    tap->data_bytes, tap->sbuf->framesize);
+		}
+		tap_close(tap);
+	}
+	tee->ntaps = 0;
+}
+
+/*
+ * tap_write: Write the tap's buffer until it is empty or the fd would
+ * block. Returns -1 on error.
+ */
+static int
+tap_write(struct tap *tap)
+{
+	struct sample_buf	*sbuf = tap->sbuf;
+	size_t			nframes, len;
+	ssize_t			nw;
+
+	while ((nframes = sbuf->size - sbuf->free) > 0) {
+		if (nframes > sbuf->size - sbuf->rpos)
+			nframes = sbuf->size - sbuf->rpos;
+		len = nframes * sbuf->framesize - tap->partial;
+		nw = write(fileno(tap->fp), sbuf->buf + sbuf->rpos *
+		    sbuf->framesize + tap->partial, len);
+		if (nw == -1)
+			return (errno == EAGAIN || errno == EINTR ? 0 : -1);
+		nframes = (tap->partial + nw) / sbuf->framesize;
+		tap->partial = (tap->partial + nw) % sbuf->framesize;
+		sbuf->free += nframes;
+		sbuf->rpos = (sbuf->rpos + nframes) % sbuf->size;
+		if ((size_t)nw < len)
+			return (0);
+	}
+	return (0);
+}
+
+static void
+tap_close(struct tap *tap)
+{
+	if (tap->sbuf != NULL)
+		sbuf_release(tap->sbuf);
+	tap->sbuf = NULL;
+	if (tap->pcm != NULL)
+		pcm_ring_free(tap->pcm, tap->pcm->size);
+	tap->pcm = NULL;
+	if (tap->fp != NULL && fclose(tap->fp) == EOF)
+		child_warn("fclose");
+	tap->fp = NULL;
+}
+
+/* tee_drop: Give up on tap i and let the others carry on. */
+static void
+tee_drop(struct tee *tee, int i, const char *why)
+{
+	child_warnx(why);
+	tap_close(&tee->tap[i]);
+	tee->tap[i] = tee->tap[--tee->ntaps];
+}
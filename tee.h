@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_TEE_H
+#define PNP_TEE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <FLAC/format.h>
+
+#include "pnp.h"
+
+#define TEE_BUFFER_MS	2000	/* How far a tap may fall behind. */
+
+/*
+ * A tap is a file that gets a copy of what a stream decodes, as WAVE or
+ * raw samples, next to the stream's own output. Each tap has a sample
+ * buffer of its own and is written to without blocking, so a slow one
+ * holds up neither the others nor the device. If a tap falls behind a
+ * stream that plays in real time, it is dropped; otherwise, the decoder
+ * waits for it. Taps are used for one file, like output files.
+ *
+ * An OUT_BROADCAST tap writes to a PCM ring instead, which the parent
+ * passes on to its listeners. It never waits: the parent keeps a cursor
+ * per listener, and those that fall behind skip ahead.
+ */
+struct tap {
+	int			type;	/* OUT_WAV_FILE, _RAW or _BROADCAST */
+	FILE			*fp;
+	struct pcm_ring		*pcm;	/* For OUT_BROADCAST */
+	struct sample_buf	*sbuf;	/* NULL until tee_start(). */
+	size_t			partial; /* Bytes written of the next frame. */
+	uint64_t		data_bytes;
+	int			hdr_len; /* For OUT_WAV_FILE */
+};
+
+struct tee {
+	struct tap	tap[PNP_MAX_TAPS];
+	int		ntaps;
+	int		realtime;
+	uint64_t	samples;	/* From the header, 0 if unknown. */
+};
+
+int	tee_add(struct tee *, int, int);
+void	tee_start(struct tee *, unsigned int, unsigned int, unsigned int,
+	    uint64_t, size_t, int);
+int	tee_room(struct tee *, size_t);
+void	tee_put(struct tee *, const FLAC__int32 *const [], size_t);
+void	tee_flush(struct tee *);
+void	tee_finish(struct tee *);
+
+#endif
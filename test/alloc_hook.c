@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Allocation counting. The wrappers below take the place of the libc
+ * functions for the program and the libraries it links (libFLAC, libutil,
+ * ...) and forward to the real ones found with dlsym(RTLD_NEXT).
+ */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc_hook.h"
+
+/* Serves allocations made while the real functions are looked up. */
+#define BOOTSTRAP_SIZE	4096
+
+static void	*(*real_malloc)(size_t);
+static void	*(*real_calloc)(size_t, size_t);
+static void	*(*real_realloc)(void *, size_t);
+static void	*(*real_reallocarray)(void *, size_t, size_t);
+static void	*(*real_recallocarray)(void *, size_t, size_t, size_t);
+static void	(*real_free)(void *);
+
+static uint64_t	*counter;
+static int	armed, resolving;
+static char	bootstrap[BOOTSTRAP_SIZE];
+static size_t	bootstrap_pos;
+
+static void	resolve(void);
+static void	*bootstrap_alloc(size_t);
+static int	is_bootstrap(void *);
+
+void
+alloc_hook_init(void)
+{
+	if (counter != NULL)
+		return;
+	counter = mmap(NULL, sizeof(*counter), PROT_READ|PROT_WRITE,
+	    MAP_ANON|MAP_SHARED, -1, 0);
+	if (counter == MAP_FAILED)
+		err(1, "mmap");
+	*counter = 0;
+}
+
+void
+alloc_hook_arm(void)
+{
+	alloc_hook_init();
+	resolve();
+	armed = 1;
+}
+
+uint64_t
+alloc_hook_count(void)
+{
+	return (counter == NULL ? 0 : *counter);
+}
+
+static void
+resolve(void)
+{
+	if (real_free != NULL || resolving)
+		return;
+	resolving = 1;
+	/* The casts are the POSIX way around ISO C's function pointers. */
+	*(void **)&real_malloc = dlsym(RTLD_NEXT, "malloc");
+	*(void **)&real_calloc = dlsym(RTLD_NEXT, "calloc");
+	*(void **)&real_realloc = dlsym(RTLD_NEXT, "realloc");
+	*(void **)&real_reallocarray = dlsym(RTLD_NEXT, "reallocarray");
+	*(void **)&real_recallocarray = dlsym(RTLD_NEXT, "recallocarray");
+	*(void **)&real_free = dlsym(RTLD_NEXT, "free");
+	resolving = 0;
+}
+
+static void *
+bootstrap_alloc(size_t size)
+{
+	void	*p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (size > BOOTSTRAP_SIZE - bootstrap_pos)
+		return (NULL);
+	p = bootstrap + bootstrap_pos;
+	bootstrap_pos += size;
+	return (p);
+}
+
+static int
+is_bootstrap(void *p)
+{
+	return ((char *)p >= bootstrap
+	    && (char *)p < bootstrap + BOOTSTRAP_SIZE);
+}
+
+#define COUNT() do {				\
+	if (armed)				\
+		(*counter)++;			\
+	resolve();				\
+} while (0)
+
+void *
+malloc(size_t size)
+{
+	COUNT();
+	if (real_malloc == NULL)
+		return (bootstrap_alloc(size));
+	return (real_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	COUNT();
+	if (real_calloc == NULL) {
+		if (size != 0 && nmemb > SIZE_MAX / size)
+			return (NULL);
+		/* The bootstrap buffer is static, so it is zeroed. */
+		return (bootstrap_alloc(nmemb * size));
+	}
+	return (real_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	void	*p;
+	size_t	len;
+
+	COUNT();
+	if (!is_bootstrap(ptr))
+		return (real_realloc(ptr, size));
+	/* We don't know the old size; copy what may belong to it. */
+	len = bootstrap + BOOTSTRAP_SIZE - (char *)ptr;
+	if ((p = real_malloc(size)) != NULL)
+		memcpy(p, ptr, size < len ? size : len);
+	return (p);
+}
+
+void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	COUNT();
+	return (real_reallocarray(ptr, nmemb, size));
+}
+
+void *
+recallocarray(void *ptr, size_t oldnmemb, size_t nmemb, size_t size)
+{
+	COUNT();
+	return (real_recallocarray(ptr, oldnmemb, nmemb, size));
+}
+
+void
+free(void *ptr)
+{
+	if (ptr == NULL || is_bootstrap(ptr))
+		return;
+	resolve();
+	if (real_free != NULL)
+		real_free(ptr);
+}
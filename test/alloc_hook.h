@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_ALLOC_HOOK_H
+#define PNP_ALLOC_HOOK_H
+
+#include <stdint.h>
+
+/*
+ * Programs linked with alloc_hook.o get wrappers around malloc(3) and
+ * friends that count allocations. Call alloc_hook_init() before forking;
+ * the process that calls alloc_hook_arm() is the one that is counted.
+ * The counter lives in shared memory, so the parent can watch the child.
+ */
+
+void		alloc_hook_init(void);
+void		alloc_hook_arm(void);
+uint64_t	alloc_hook_count(void);
+
+#endif
@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bench: Generate a corpus of FLAC files with libFLAC's encoder and measure
+ * the decoder, the sample packing functions, metadata extraction and the
+ * IPC round-trip time. Results are printed as tab-separated lines
+ *
+ *	name	parameters	value	unit
+ *
+ * With -c, the results are compared to those of an earlier run and every
+ * result that is worse by more than the threshold (-t, in percent) is
+ * flagged. bench then exits with status 1.
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <imsg.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <FLAC/stream_decoder.h>
+#include <FLAC/stream_encoder.h>
+
+#include "flac.h"
+#include "out_sndio.h"
+#include "pnp.h"
+
+#define CORPUS_DIR	"./scratchspace/bench"
+#define CORPUS_SECONDS	3
+#define MAX_BSIZE	16384
+#define MAX_CHANNELS	8
+#define PUT_FRAMES	(1 << 22)
+#define RTT_ROUNDS	10000
+#define META_ROUNDS	20
+
+struct fixture {
+	unsigned int	bsize, bits, channels, rate;
+	char		path[64];
+};
+
+struct result {
+	char	name[32];
+	char	params[64];
+	double	value;
+	char	unit[16];
+};
+
+static const unsigned int	bsizes[] = {1152, 4096, 16384};
+static const unsigned int	bitss[] = {16, 24};
+static const unsigned int	channelss[] = {1, 2, 6, 8};
+static const unsigned int	rates[] = {44100, 96000};
+
+#define NELEMS(a)	(sizeof(a)/sizeof((a)[0]))
+#define NFIXTURES	(NELEMS(bsizes) * NELEMS(bitss) * NELEMS(channelss) * \
+			    NELEMS(rates))
+
+static struct fixture	fixtures[NFIXTURES];
+static struct result	*results;
+static size_t		nresults;
+
+static void	make_corpus(void);
+static void	encode_fixture(struct fixture *);
+static double	isolated(double (*)(void *), void *);
+static void	spawn_child(struct out *);
+static double	bench_decode(void *);
+static double	bench_decode_native(void *);
+static double	bench_meta(void *);
+static double	bench_rtt(void *);
+static double	bench_sbuf_put(unsigned int, unsigned int);
+static double	bench_write_cb_file(unsigned int, unsigned int);
+static void	add_result(const char *, const char *, double, const char *);
+static int	compare(const char *, double);
+static double	elapsed(struct timespec *, struct timespec *);
+
+FLAC__StreamDecoderWriteStatus write_cb_file (const FLAC__StreamDecoder *,
+    const FLAC__Frame *, const FLAC__int32 *const [], void *);
+
+extern char	*__progname;
+
+int
+main(int argc, char **argv)
+{
+	char		params[64], *old = NULL;
+	const char	*errstr;
+	double		threshold = 5.0, v;
+	size_t		i, j, k;
+	int		opt;
+
+	while ((opt = getopt(argc, argv, "c:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			old = optarg;
+			break;
+		case 't':
+			threshold = strtonum(optarg, 0, 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "threshold is %s: %s", errstr, optarg);
+			break;
+		default:
+			(void)fprintf(stderr,
+			    "usage: %s [-c old_results] [-t percent]\n",
+			    __progname);
+			exit(1);
+		}
+	}
+
+	make_corpus();
+	printf("# pnp bench 1\n");
+	for (i = 0; i < NFIXTURES; i++) {
+		snprintf(params, sizeof(params), "bs=%u,bits=%u,ch=%u,rate=%u",
+		    fixtures[i].bsize, fixtures[i].bits, fixtures[i].channels,
+		    fixtures[i].rate);
+		v = isolated(bench_decode, &fixtures[i]);
+		add_result("decode_raw", params, v, "MB/s");
+		v = isolated(bench_decode_native, &fixtures[i]);
+		add_result("decode_native", params, v, "MB/s");
+	}
+	for (j = 0; j < NELEMS(bitss); j++)
+		for (k = 0; k < NELEMS(channelss); k++) {
+			snprintf(params, sizeof(params), "bits=%u,ch=%u",
+			    bitss[j], channelss[k]);
+			add_result("sbuf_put", params,
+			    bench_sbuf_put(bitss[j], channelss[k]),
+			    "ns/sample");
+			add_result("write_cb_file", params,
+			    bench_write_cb_file(bitss[j], channelss[k]),
+			    "ns/sample");
+		}
+	add_result("get_meta", "corpus", isolated(bench_meta, NULL), "us/file");
+	add_result("round_trip", "CMD_STATS", isolated(bench_rtt, NULL), "us");
+
+	return (old == NULL ? 0 : compare(old, threshold));
+}
+
+static void
+make_corpus(void)
+{
+	struct stat	sb;
+	size_t		i, j, k, l, n = 0;
+
+	if (mkdir(CORPUS_DIR, 0755) == -1 && errno != EEXIST)
+		err(1, "mkdir");
+	for (i = 0; i < NELEMS(bsizes); i++)
+	for (j = 0; j < NELEMS(bitss); j++)
+	for (k = 0; k < NELEMS(channelss); k++)
+	for (l = 0; l < NELEMS(rates); l++) {
+		fixtures[n].bsize = bsizes[i];
+		fixtures[n].bits = bitss[j];
+		fixtures[n].channels = channelss[k];
+		fixtures[n].rate = rates[l];
+		snprintf(fixtures[n].path, sizeof(fixtures[n].path),
+		    "%s/%u_%u_%u_%u.flac", CORPUS_DIR, bsizes[i], bitss[j],
+		    channelss[k], rates[l]);
+		/* The corpus is deterministic, so reuse existing files. */
+		if (stat(fixtures[n].path, &sb) == -1)
+			encode_fixture(&fixtures[n]);
+		n++;
+	}
+}
+
+/*
+ * encode_fixture: Write a file with a sine wave of a different frequency
+ * in each channel, plus some noise so that the encoder can't predict the
+ * signal perfectly.
+ */
+static void
+encode_fixture(struct fixture *fx)
+{
+	FLAC__StreamEncoder	*enc;
+	FLAC__int32		*buf;
+	uint32_t		lcg = 1;
+	double			amp;
+	size_t			nframes, i, c;
+
+	nframes = (size_t)fx->rate * CORPUS_SECONDS;
+	buf = reallocarray(NULL, nframes * fx->channels, sizeof(*buf));
+	if (buf == NULL)
+		err(1, "reallocarray");
+	amp = ((1 << (fx->bits - 1)) - 1) * 0.5;
+	for (i = 0; i < nframes; i++)
+		for (c = 0; c < fx->channels; c++) {
+			lcg = lcg * 1103515245 + 12345;
+			buf[i * fx->channels + c] = (FLAC__int32)(amp *
+			    sin(2 * M_PI * 220.0 * (c + 1) * i / fx->rate)) +
+			    (FLAC__int32)((lcg >> 16) % 256) - 128;
+		}
+	if ((enc = FLAC__stream_encoder_new()) == NULL)
+		errx(1, "FLAC__stream_encoder_new");
+	FLAC__stream_encoder_set_channels(enc, fx->channels);
+	FLAC__stream_encoder_set_bits_per_sample(enc, fx->bits);
+	FLAC__stream_encoder_set_sample_rate(enc, fx->rate);
+	FLAC__stream_encoder_set_compression_level(enc, 5);
+	FLAC__stream_encoder_set_blocksize(enc, fx->bsize);
+	FLAC__stream_encoder_set_total_samples_estimate(enc, nframes);
+	if (FLAC__stream_encoder_init_file(enc, fx->path, NULL, NULL)
+	    != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+		errx(1, "%s: encoder initialization failed", fx->path);
+	if (!FLAC__stream_encoder_process_interleaved(enc, buf, nframes)
+	    || !FLAC__stream_encoder_finish(enc))
+		errx(1, "%s: encoding failed", fx->path);
+	FLAC__stream_encoder_delete(enc);
+	free(buf);
+}
+
+/*
+ * isolated: Run fn in a separate process and return its result. Every
+ * benchmark that needs a pnp child gets a fresh parent this way, since the
+ * parent side keeps its state in globals.
+ */
+static double
+isolated(double (*fn)(void *), void *arg)
+{
+	pid_t	pid;
+	double	v = -1;
+	int	p[2], status;
+
+	if (pipe(p) == -1)
+		err(1, "pipe");
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		close(p[0]);
+		v = fn(arg);
+		if (write(p[1], &v, sizeof(v)) != sizeof(v))
+			_exit(1);
+		_exit(0);
+	default:
+		close(p[1]);
+		if (read(p[0], &v, sizeof(v)) != sizeof(v))
+			errx(1, "benchmark process failed");
+		close(p[0]);
+		while (waitpid(pid, &status, 0) == -1)
+			if (errno != EINTR)
+				err(1, "waitpid");
+	}
+	return (v);
+}
+
+static void
+spawn_child(struct out *out)
+{
+	pid_t	child_pid;
+	int	sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	switch (child_pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		child_main(sv, out);
+		_exit(1);
+	default:
+		parent_init(sv, child_pid);
+	}
+}
+
+static double
+bench_decode(void *arg)
+{
+	struct fixture	*fx = arg;
+	struct out	out;
+	struct timespec	start, end;
+	double		mbytes;
+
+	out.type = OUT_RAW;
+	if ((out.handle.fp = fopen("/dev/null", "w")) == NULL)
+		err(1, "/dev/null");
+	spawn_child(&out);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (decode(fx->path) != 0)
+		errx(1, "%s: decode failed", fx->path);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stop_child();
+	mbytes = (double)fx->rate * CORPUS_SECONDS * fx->channels *
+	    (fx->bits / 8) / 1e6;
+	return (mbytes / elapsed(&start, &end));
+}
+
+/* Like bench_decode, with the in-tree frame decoder. */
+static double
+bench_decode_native(void *arg)
+{
+	flac_decoder = FLAC_DEC_NATIVE;
+	return (bench_decode(arg));
+}
+
+static double
+bench_meta(void *arg)
+{
+	struct out	out;
+	struct meta	*mdata;
+	struct timespec	start, end;
+	size_t		i, r;
+
+	out.type = OUT_RAW;
+	out.handle.fp = NULL;
+	spawn_child(&out);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < META_ROUNDS; r++)
+		for (i = 0; i < NFIXTURES; i++) {
+			if (send_new_file(fixtures[i].path) != 0)
+				errx(1, "%s: rejected", fixtures[i].path);
+			if ((mdata = get_meta()) == NULL)
+				errx(1, "%s: get_meta failed",
+				    fixtures[i].path);
+			free_meta(mdata);
+		}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stop_child();
+	return (elapsed(&start, &end) * 1e6 / (META_ROUNDS * NFIXTURES));
+}
+
+static double
+bench_rtt(void *arg)
+{
+	struct out		out;
+	struct pnp_stats	stats;
+	struct timespec		start, end;
+	size_t			i;
+
+	out.type = OUT_RAW;
+	out.handle.fp = NULL;
+	spawn_child(&out);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < RTT_ROUNDS; i++)
+		if (get_stats(&stats) != 0)
+			errx(1, "get_stats failed");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stop_child();
+	return (elapsed(&start, &end) * 1e6 / RTT_ROUNDS);
+}
+
+/* Planar sample buffers, as libFLAC hands them to the write callback. */
+static FLAC__int32	planes[MAX_CHANNELS][MAX_BSIZE];
+
+static double
+bench_sbuf_put(unsigned int bits, unsigned int channels)
+{
+	struct sample_buf	*sbuf;
+	const FLAC__int32	*smp[MAX_CHANNELS];
+	struct timespec		start, end;
+	size_t			done;
+	unsigned int		c;
+
+	for (c = 0; c < channels; c++)
+		smp[c] = planes[c];
+	if ((sbuf = sbuf_new(bits / 8, channels, 3 * 4096)) == NULL)
+		err(1, "sbuf_new");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (done = 0; done < PUT_FRAMES; done += 4096) {
+		if (sbuf->free < 4096)
+			sbuf_clear(sbuf);
+		sbuf_put(sbuf, smp, 4096);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	sbuf_free(sbuf);
+	return (elapsed(&start, &end) * 1e9 / ((double)PUT_FRAMES * channels));
+}
+
+static double
+bench_write_cb_file(unsigned int bits, unsigned int channels)
+{
+	struct flac_client_data	cdata;
+	struct out		out;
+	struct tee		tee;
+	FLAC__Frame		frame;
+	const FLAC__int32	*smp[MAX_CHANNELS];
+	struct timespec		start, end;
+	size_t			done;
+	unsigned int		c;
+
+	for (c = 0; c < channels; c++)
+		smp[c] = planes[c];
+	memset(&cdata, 0, sizeof(cdata));
+	memset(&frame, 0, sizeof(frame));
+	memset(&tee, 0, sizeof(tee));
+	out.type = OUT_RAW;
+	if ((out.handle.fp = fopen("/dev/null", "w")) == NULL)
+		err(1, "/dev/null");
+	cdata.out = &out;
+	cdata.tee = &tee;
+	cdata.bps = bits;
+	cdata.channels = channels;
+	if ((cdata.sbuf = sbuf_new(bits / 8, channels, 4096)) == NULL)
+		err(1, "sbuf_new");
+	if (writer_start(&cdata.writer, fileno(out.handle.fp)) == -1)
+		errx(1, "writer_start");
+	frame.header.blocksize = 4096;
+	frame.header.bits_per_sample = bits;
+	frame.header.channels = channels;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (done = 0; done < PUT_FRAMES; done += 4096)
+		write_cb_file(NULL, &frame, smp, &cdata);
+	if (writer_finish(&cdata.writer) == -1)
+		errx(1, "writer_finish");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fclose(out.handle.fp);
+	sbuf_free(cdata.sbuf);
+	return (elapsed(&start, &end) * 1e9 / ((double)PUT_FRAMES * channels));
+}
+
+static void
+add_result(const char *name, const char *params, double value,
+    const char *unit)
+{
+	struct result	*r;
+
+	r = reallocarray(results, nresults + 1, sizeof(*results));
+	if (r == NULL)
+		err(1, "reallocarray");
+	results = r;
+	r += nresults++;
+	strlcpy(r->name, name, sizeof(r->name));
+	strlcpy(r->params, params, sizeof(r->params));
+	strlcpy(r->unit, unit, sizeof(r->unit));
+	r->value = value;
+	printf("%s\t%s\t%.3f\t%s\n", name, params, value, unit);
+	fflush(stdout);
+}
+
+/*
+ * compare: Compare the results with those in the given file. Throughput
+ * (MB/s) should not go down, everything else is a time and should not go
+ * up. Returns 1 if there was a regression, 0 otherwise.
+ */
+static int
+compare(const char *path, double threshold)
+{
+	struct result	old;
+	FILE		*fp;
+	char		line[256];
+	double		change;
+	size_t		i;
+	int		regressed = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%31[^\t]\t%63[^\t]\t%lf\t%15s", old.name,
+		    old.params, &old.value, old.unit) != 4 || old.value <= 0)
+			continue;
+		for (i = 0; i < nresults; i++) {
+			if (strcmp(results[i].name, old.name) != 0
+			    || strcmp(results[i].params, old.params) != 0)
+				continue;
+			change = 100 * (results[i].value - old.value) /
+			    old.value;
+			if (strcmp(old.unit, "MB/s") == 0)
+				change = -change;
+			if (change > threshold) {
+				fprintf(stderr, "REGRESSION %s %s: %.3f -> "
+				    "%.3f %s (%+.1f%%)\n", old.name,
+				    old.params, old.value, results[i].value,
+				    old.unit, change);
+				regressed = 1;
+			}
+		}
+	}
+	fclose(fp);
+	return (regressed);
+}
+
+static double
+elapsed(struct timespec *start, struct timespec *end)
+{
+	return ((end->tv_sec - start->tv_sec) +
+	    (end->tv_nsec - start->tv_nsec) / 1e9);
+}
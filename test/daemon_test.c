@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Tests for pnp -D. The tests act as clients of a daemon they start. */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <check.h>
+#include <err.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "message_types.h"
+#include "pnp.h"
+
+#define SOCK_PATH	"./scratchspace/pnpd.sock"
+#define MAX_JOB_ID	16
+
+static pid_t	start_daemon(int, int);
+static void	stop_daemon(pid_t);
+static void	connect_daemon(struct imsgbuf *);
+static void	send_job(struct imsgbuf *, int, uint32_t, const char *);
+static void	wait_results(struct imsgbuf *, int);
+static int	run_verify(char **, int, int, const char *);
+static void	make_corrupt(const char *);
+static int	verify_result(const char *, const char *, char *, size_t);
+
+/* Results by job ID, -1 if there is none yet, and who sent them. */
+static int	results[MAX_JOB_ID];
+static pid_t	result_pids[MAX_JOB_ID];
+static char	title[64];
+
+static pid_t
+start_daemon(int nworkers, int max_jobs)
+{
+	pid_t	pid;
+
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		_exit(pnpd_main(SOCK_PATH, nworkers, max_jobs));
+	}
+	return (pid);
+}
+
+static void
+stop_daemon(pid_t pid)
+{
+	int	status;
+
+	if (kill(pid, SIGTERM))
+		err(1, "kill");
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	ck_assert(WIFEXITED(status));
+	ck_assert_int_eq(WEXITSTATUS(status), 0);
+}
+
+static void
+connect_daemon(struct imsgbuf *ibuf)
+{
+	struct sockaddr_un	sun;
+	int			fd, i;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, SOCK_PATH, sizeof(sun.sun_path));
+	/* Give the daemon some time to get ready. */
+	for (i = 0; i < 100; i++) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			err(1, "socket");
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+			break;
+		close(fd);
+		fd = -1;
+		usleep(50000);
+	}
+	if (fd == -1)
+		err(1, "connect");
+	imsg_init(ibuf, fd);
+	for (i = 0; i < MAX_JOB_ID; i++)
+		results[i] = -1;
+	title[0] = '\0';
+}
+
+static void
+send_job(struct imsgbuf *ibuf, int type, uint32_t id, const char *file)
+{
+	int	fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "open");
+	if (imsg_compose(ibuf, type, id, getpid(), fd, NULL, 0) == -1
+	    || imsg_flush(ibuf) == -1)
+		err(1, "imsg");
+}
+
+/* wait_results: Read replies until n jobs are done. */
+static void
+wait_results(struct imsgbuf *ibuf, int n)
+{
+	struct imsg	imsg;
+	int32_t		status;
+	ssize_t		len;
+
+	while (n > 0) {
+		if (imsg_read(ibuf) <= 0)
+			err(1, "imsg_read");
+		while ((len = imsg_get(ibuf, &imsg)) > 0) {
+			len = imsg.hdr.len - IMSG_HEADER_SIZE;
+			ck_assert_int_lt(imsg.hdr.peerid, MAX_JOB_ID);
+			if (imsg.hdr.type == JOB_RESULT) {
+				ck_assert_int_eq(len, sizeof(status));
+				memcpy(&status, imsg.data, sizeof(status));
+				ck_assert_int_eq(results[imsg.hdr.peerid], -1);
+				results[imsg.hdr.peerid] = status;
+				result_pids[imsg.hdr.peerid] = imsg.hdr.pid;
+				n--;
+			}
+			else if (imsg.hdr.type == META_TITLE)
+				strlcpy(title, imsg.data, sizeof(title));
+			imsg_free(&imsg);
+		}
+		if (len == -1)
+			err(1, "imsg_get");
+	}
+}
+
+/*
+ * run_verify: Run pnp -t on the files, with -q if type is JOB_SCAN, and
+ * return its exit status.
+ */
+static int
+run_verify(char **files, int n, int type, const char *results)
+{
+	pid_t	pid;
+	int	status;
+
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		_exit(pnpd_verify(files, n, 2, PNPD_JOBS, type, results));
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	ck_assert(WIFEXITED(status));
+	return (WEXITSTATUS(status));
+}
+
+/* make_corrupt: Copy test.flac to path and flip a byte in the audio. */
+static void
+make_corrupt(const char *path)
+{
+	char		cmd[1024];
+	unsigned char	c;
+	int		fd;
+
+	snprintf(cmd, sizeof(cmd), "cp ./testdata/test.flac %s", path);
+	ck_assert_int_eq(system(cmd), 0);
+	if ((fd = open(path, O_RDWR)) == -1)
+		err(1, "open");
+	ck_assert_int_eq(pread(fd, &c, 1, 1500000), 1);
+	c = ~c;
+	ck_assert_int_eq(pwrite(fd, &c, 1, 1500000), 1);
+	close(fd);
+}
+
+/*
+ * verify_result: Find the last status that the results file has for path.
+ * Returns the number of lines for it.
+ */
+static int
+verify_result(const char *results, const char *path, char *status,
+    size_t size)
+{
+	FILE	*fp;
+	char	line[1024], *p;
+	int	n = 0;
+
+	if ((fp = fopen(results, "r")) == NULL)
+		err(1, "fopen");
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((p = strrchr(line, '\t')) == NULL
+		    || strcmp(p + 1, path) != 0)
+			continue;
+		line[strcspn(line, "\t")] = '\0';
+		strlcpy(status, line, size);
+		n++;
+	}
+	fclose(fp);
+	return (n);
+}
+
+START_TEST (daemon_decodes_and_reads_meta)
+{
+	struct imsgbuf	ibuf;
+	pid_t		pid;
+	uint32_t	out_type = OUT_RAW;
+	int		fd, cmp;
+
+	pid = start_daemon(2, PNPD_JOBS);
+	connect_daemon(&ibuf);
+	fd = open("./scratchspace/pnpd.raw", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1)
+		err(1, "open");
+	if (imsg_compose(&ibuf, JOB_OUTPUT, 1, getpid(), fd, &out_type,
+	    sizeof(out_type)) == -1)
+		err(1, "imsg_compose");
+	send_job(&ibuf, JOB_DECODE, 1, "./testdata/test.flac");
+	send_job(&ibuf, JOB_META, 2, "./testdata/with_id3v2.flac");
+	/* A decode job without an output fails right away. */
+	send_job(&ibuf, JOB_DECODE, 3, "./testdata/test.flac");
+	wait_results(&ibuf, 3);
+	ck_assert_int_eq(results[1], 0);
+	ck_assert_int_eq(results[2], 0);
+	ck_assert_int_eq(results[3], 1);
+	ck_assert_str_eq(title, "I");
+	cmp = system("cmp ./testdata/test.raw ./scratchspace/pnpd.raw"
+	    " 1>/dev/null");
+	ck_assert_int_eq(cmp, 0);
+	stop_daemon(pid);
+}
+END_TEST
+
+START_TEST (daemon_queues_jobs_and_recycles_workers)
+{
+	struct imsgbuf	ibuf;
+	pid_t		pid;
+	uint32_t	id, other;
+	int		same;
+
+	/* Two workers that are replaced after two jobs each. */
+	pid = start_daemon(2, 2);
+	connect_daemon(&ibuf);
+	for (id = 1; id <= 9; id++)
+		send_job(&ibuf, JOB_VERIFY, id, "./testdata/test.flac");
+	send_job(&ibuf, JOB_VERIFY, 10, "./testdata/random_garbage");
+	wait_results(&ibuf, 10);
+	for (id = 1; id <= 9; id++)
+		ck_assert_int_eq(results[id], 0);
+	ck_assert_int_eq(results[10], 1);
+	/* Each job ran in a worker, and no worker ran more than two. */
+	for (id = 1; id <= 10; id++) {
+		ck_assert_int_gt(result_pids[id], 0);
+		ck_assert_int_ne(result_pids[id], pid);
+		same = 0;
+		for (other = 1; other <= 10; other++) {
+			if (result_pids[other] == result_pids[id])
+				same++;
+		}
+		ck_assert_int_le(same, 2);
+	}
+	stop_daemon(pid);
+}
+END_TEST
+
+START_TEST (verify_finds_corrupt_files_and_resumes)
+{
+	char		*files[] = {"./testdata/test.flac",
+			    "./scratchspace/corrupt.flac",
+			    "./testdata/random_garbage"};
+	const char	*results = "./scratchspace/verify.txt";
+	char		status[16];
+
+	make_corrupt(files[1]);
+	unlink(results);
+
+	ck_assert_int_eq(run_verify(files, 3, JOB_VERIFY, results), 1);
+	ck_assert_int_eq(verify_result(results, files[0], status,
+	    sizeof(status)), 1);
+	ck_assert_str_eq(status, "ok");
+	ck_assert_int_eq(verify_result(results, files[1], status,
+	    sizeof(status)), 1);
+	ck_assert_str_eq(status, "corrupt");
+	ck_assert_int_eq(verify_result(results, files[2], status,
+	    sizeof(status)), 1);
+	ck_assert_str_eq(status, "error");
+
+	/* A second run only tries the file that couldn't be checked. */
+	ck_assert_int_eq(run_verify(files, 3, JOB_VERIFY, results), 1);
+	ck_assert_int_eq(verify_result(results, files[0], status,
+	    sizeof(status)), 1);
+	ck_assert_int_eq(verify_result(results, files[1], status,
+	    sizeof(status)), 1);
+	ck_assert_int_eq(verify_result(results, files[2], status,
+	    sizeof(status)), 2);
+	ck_assert_int_eq(run_verify(files, 2, JOB_VERIFY, results), 0);
+}
+END_TEST
+
+START_TEST (scan_finds_corrupt_files)
+{
+	char		*files[] = {"./testdata/test.flac",
+			    "./testdata/with_id3v2.flac",
+			    "./scratchspace/corrupt_scan.flac",
+			    "./testdata/random_garbage"};
+	const char	*results = "./scratchspace/scan.txt";
+	char		status[16];
+
+	make_corrupt(files[2]);
+	unlink(results);
+
+	ck_assert_int_eq(run_verify(files, 4, JOB_SCAN, results), 1);
+	ck_assert_int_eq(verify_result(results, files[0], status,
+	    sizeof(status)), 1);
+	ck_assert_str_eq(status, "ok");
+	ck_assert_int_eq(verify_result(results, files[1], status,
+	    sizeof(status)), 1);
+	ck_assert_str_eq(status, "ok");
+	ck_assert_int_eq(verify_result(results, files[2], status,
+	    sizeof(status)), 1);
+	ck_assert_str_eq(status, "corrupt");
+	ck_assert_int_eq(verify_result(results, files[3], status,
+	    sizeof(status)), 1);
+	ck_assert_str_eq(status, "error");
+
+	/* A full check doesn't trust the scan. */
+	ck_assert_int_eq(run_verify(files, 2, JOB_VERIFY, results), 0);
+	ck_assert_int_eq(verify_result(results, files[0], status,
+	    sizeof(status)), 2);
+	ck_assert_str_eq(status, "ok");
+}
+END_TEST
+
+Suite
+*daemon_suite(void)
+{
+	Suite *s;
+	TCase *tc_jobs;
+
+	s = suite_create("Daemon");
+	tc_jobs = tcase_create("Jobs");
+	tcase_set_timeout(tc_jobs, 30);
+
+	tcase_add_test(tc_jobs, daemon_decodes_and_reads_meta);
+	tcase_add_test(tc_jobs, daemon_queues_jobs_and_recycles_workers);
+	tcase_add_test(tc_jobs, verify_finds_corrupt_files_and_resumes);
+	tcase_add_test(tc_jobs, scan_finds_corrupt_files);
+	suite_add_tcase(s, tc_jobs);
+
+	return (s);
+}
+
+int
+main(void)
+{
+	int	no_failed;
+	Suite	*s;
+	SRunner	*sr;
+
+	s = daemon_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	no_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return ((no_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -19,6 +19,7 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 
 #include <assert.h>
 #include <check.h>
@@ -27,13 +28,31 @@
 #include <fcntl.h>
 #include <imsg.h>
 #include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <FLAC/stream_encoder.h>
+
 #include "comm.h"
 #include "file.h"
 #include "pnp.h"
+
+static uint64_t	le_at(const unsigned char *, size_t);
+
+/* le_at: Read a little endian number of len bytes. */
+static uint64_t
+le_at(const unsigned char *p, size_t len)
+{
+	uint64_t	n = 0;
+
+	while (len-- > 0)
+		n = (n << 8) | p[len];
+	return (n);
+}
+
 /* Filetype detection */
 
 START_TEST (filetype_identifies_files)
@@ -63,6 +82,28 @@ START_TEST (filetype_skips_id3v2)
 }
 END_TEST
 
+START_TEST (header_type_identifies_buffered_bytes)
+{
+	char		*files[] = {"./testdata/with_id3v2.wav",
+	    "./testdata/with_id3v2.flac", "./testdata/with_id3v2.mp3"};
+	int		types[] = {WAVE_PCM, FLAC, MP3};
+	unsigned char	buf[FILETYPE_PROBE_LEN];
+	size_t		skip;
+	int		fd;
+
+	fd = open(files[_i], O_RDONLY);
+	assert(fd != -1);
+	ck_assert_int_eq(read(fd, buf, sizeof(buf)), sizeof(buf));
+	ck_assert_int_eq(header_type(buf, sizeof(buf)), UNKNOWN);
+	skip = id3v2_size(buf);
+	ck_assert_int_gt(skip, ID3_HDR_LEN);
+	ck_assert_int_eq(pread(fd, buf, sizeof(buf), skip), sizeof(buf));
+	ck_assert_int_eq(id3v2_size(buf), 0);
+	ck_assert_int_eq(header_type(buf, sizeof(buf)), types[_i]);
+	close(fd);
+}
+END_TEST
+
 /* Metadata extraction */
 
 START_TEST (get_meta_returns_NULL_when_no_file_open)
@@ -174,6 +215,58 @@ START_TEST (get_meta_handles_id3v2_in_flac)
 }
 END_TEST
 
+START_TEST (get_picture_finds_front_cover)
+{
+	struct picture	*pic, *again;
+	struct out	out;
+	pid_t		child_pid;
+	int		sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_RAW;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		/* In a PICTURE block. */
+		if (send_new_file("./testdata/test.flac"))
+			errx(1, "send_new_file: file rejected");
+		pic = get_picture();
+		ck_assert_ptr_ne(pic, NULL);
+		ck_assert_str_eq(pic->mime, "image/jpeg");
+		ck_assert_int_eq(pic->type, PICTURE_FRONT_COVER);
+		ck_assert_int_eq(pic->len, 111913);
+		ck_assert_int_eq(pic->data[0], 0xff);
+		ck_assert_int_eq(pic->data[1], 0xd8);
+		/* The same picture again comes from the cache. */
+		if (send_new_file("./testdata/test.flac"))
+			errx(1, "send_new_file: file rejected");
+		again = get_picture();
+		ck_assert_ptr_eq(again, pic);
+		ck_assert_int_eq(pic->refs, 2);
+		free_picture(again);
+		/* The APIC frame comes first in this one. */
+		if (send_new_file("./testdata/with_id3v2.flac"))
+			errx(1, "send_new_file: file rejected");
+		again = get_picture();
+		ck_assert_ptr_ne(again, NULL);
+		ck_assert_ptr_ne(again, pic);
+		ck_assert_int_eq(again->len, 217620);
+		ck_assert_int_eq(again->data[again->len - 1], 0xd9);
+		free_picture(again);
+		free_picture(pic);
+	}
+}
+END_TEST
+
 START_TEST (decode_converts_flac_to_raw)
 {
 	struct out	out;
@@ -206,6 +299,41 @@ START_TEST (decode_converts_flac_to_raw)
 }
 END_TEST
 
+START_TEST (native_decoder_matches_libflac)
+{
+	struct out	out;
+	FILE		*outfp;
+	pid_t		child_pid;
+	int		rv, cmp, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	outfp = fopen("./scratchspace/native.raw", "w");
+	if (outfp == NULL)
+		err(1, "fopen");
+	/* The child inherits it. */
+	flac_decoder = FLAC_DEC_NATIVE;
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_RAW;
+		out.handle.fp = outfp;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		rv = decode("./testdata/with_id3v2.flac");
+		ck_assert_int_eq(rv, 0);
+		cmp = system("cmp ./testdata/test.raw ./scratchspace/native.raw"
+		    " 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+	}
+}
+END_TEST
+
 START_TEST (test_write_wav_header)
 {
 	FILE	*f = fopen("scratchspace/wav_hdr", "w");
@@ -220,6 +348,69 @@ START_TEST (test_write_wav_header)
 }
 END_TEST
 
+START_TEST (unknown_length_wav_header_is_patched)
+{
+	FILE		*f = fopen("scratchspace/wav_hdr", "w+");
+	unsigned char	hdr[WAV_EXT_HEADER_LEN];
+	int		bytes_written;
+
+	assert(f != NULL);
+	bytes_written = write_wav_header(f, 2, 44100, 16, WAV_UNKNOWN_LENGTH);
+	ck_assert_int_eq(bytes_written, WAV_EXT_HEADER_LEN);
+	assert(fflush(f) == 0);
+	ck_assert_int_eq(pread(fileno(f), hdr, sizeof(hdr), 0), sizeof(hdr));
+	ck_assert_int_eq(memcmp(hdr, "RIFF", 4), 0);
+	ck_assert_int_eq(memcmp(hdr + 12, "JUNK", 4), 0);
+	ck_assert_int_eq(memcmp(hdr + 72, "data", 4), 0);
+	ck_assert_int_eq(le_at(hdr + 4, 4), UINT32_MAX);
+	ck_assert_int_eq(le_at(hdr + 76, 4), UINT32_MAX);
+	ck_assert_int_eq(patch_wav_header(f, bytes_written, 1000, 4), 0);
+	assert(fflush(f) == 0);
+	ck_assert_int_eq(pread(fileno(f), hdr, sizeof(hdr), 0), sizeof(hdr));
+	ck_assert_int_eq(memcmp(hdr, "RIFF", 4), 0);
+	ck_assert_int_eq(memcmp(hdr + 12, "JUNK", 4), 0);
+	ck_assert_int_eq(le_at(hdr + 4, 4), 1000 + WAV_EXT_HEADER_LEN - 8);
+	ck_assert_int_eq(le_at(hdr + 76, 4), 1000);
+	assert(fclose(f) != EOF);
+}
+END_TEST
+
+START_TEST (large_wav_header_is_rf64)
+{
+	FILE		*f = fopen("scratchspace/wav_hdr", "w+");
+	unsigned char	hdr[WAV_EXT_HEADER_LEN];
+	uint64_t	samples = 1500000000;
+	int		bytes_written;
+
+	assert(f != NULL);
+	if (_i == 0)
+		bytes_written = write_wav_header(f, 2, 44100, 24, samples);
+	else {
+		/* The length is found out after decoding. */
+		bytes_written = write_wav_header(f, 2, 44100, 24,
+		    WAV_UNKNOWN_LENGTH);
+		ck_assert_int_eq(patch_wav_header(f, bytes_written,
+		    samples * 6, 6), 0);
+	}
+	ck_assert_int_eq(bytes_written, WAV_EXT_HEADER_LEN);
+	assert(fflush(f) == 0);
+	ck_assert_int_eq(pread(fileno(f), hdr, sizeof(hdr), 0), sizeof(hdr));
+	ck_assert_int_eq(memcmp(hdr, "RF64", 4), 0);
+	ck_assert_int_eq(le_at(hdr + 4, 4), UINT32_MAX);
+	ck_assert_int_eq(memcmp(hdr + 8, "WAVEds64", 8), 0);
+	ck_assert_int_eq(le_at(hdr + 16, 4), 28);
+	ck_assert_int_eq(le_at(hdr + 20, 8), samples * 6 + 72);
+	ck_assert_int_eq(le_at(hdr + 28, 8), samples * 6);
+	ck_assert_int_eq(le_at(hdr + 36, 8), samples);
+	ck_assert_int_eq(le_at(hdr + 44, 4), 0);
+	ck_assert_int_eq(memcmp(hdr + 48, "fmt ", 4), 0);
+	ck_assert_int_eq(le_at(hdr + 68, 2), 6);
+	ck_assert_int_eq(memcmp(hdr + 72, "data", 4), 0);
+	ck_assert_int_eq(le_at(hdr + 76, 4), UINT32_MAX);
+	assert(fclose(f) != EOF);
+}
+END_TEST
+
 START_TEST (decode_converts_flac_to_wav)
 {
 	struct out	out;
@@ -253,6 +444,403 @@ START_TEST (decode_converts_flac_to_wav)
 }
 END_TEST
 
+START_TEST (decode_to_null_discards_samples)
+{
+	struct pnp_stats	stats;
+	struct stat		sb;
+	struct out		out;
+	pid_t			child_pid;
+	int			rv, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		rv = decode("./testdata/test.flac");
+		ck_assert_int_eq(rv, 0);
+		rv = get_stats(&stats);
+		ck_assert_int_eq(rv, 0);
+		if (stat("./testdata/test.raw", &sb) == -1)
+			err(1, "stat");
+		ck_assert_int_eq(stats.pcm_bytes, sb.st_size);
+		ck_assert_int_ne(stats.frames_decoded, 0);
+	}
+}
+END_TEST
+
+START_TEST (decoder_is_reused_across_files)
+{
+	struct pnp_stats	stats;
+	struct stat		sb;
+	struct out		out;
+	pid_t			child_pid;
+	int			i, rv, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		if (stat("./testdata/test.raw", &sb) == -1)
+			err(1, "stat");
+		for (i = 0; i < 3; i++) {
+			rv = decode("./testdata/test.flac");
+			ck_assert_int_eq(rv, 0);
+			rv = get_stats(&stats);
+			ck_assert_int_eq(rv, 0);
+			ck_assert_int_eq(stats.pcm_bytes, sb.st_size);
+			/* Only the first file sets the decoder up. */
+			ck_assert_int_eq(stats.dec_inits, i == 0);
+		}
+	}
+}
+END_TEST
+
+static void
+count_done(int status, void *arg)
+{
+	ck_assert_int_eq(status, 0);
+	(*(int *)arg)++;
+}
+
+START_TEST (streams_decode_side_by_side)
+{
+	struct pnp_stats	stats;
+	struct stat		sb;
+	struct imsg		msg;
+	struct out		out;
+	pid_t			child_pid;
+	int			done = 0, rv, cmp, fd1, fd2, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		fd1 = open("./scratchspace/stream1.raw",
+		    O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		fd2 = open("./scratchspace/stream2.wav",
+		    O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd1 == -1 || fd2 == -1)
+			err(1, "open");
+		decode_stream_async(1, "./testdata/test.flac", fd1, OUT_RAW,
+		    count_done, &done);
+		decode_stream_async(2, "./testdata/test.flac", fd2,
+		    OUT_WAV_FILE, count_done, &done);
+		/* Stream 0 decodes while the others are running. */
+		rv = decode("./testdata/test.flac");
+		ck_assert_int_eq(rv, 0);
+		while (done < 2) {
+			if (parent_process_events(&msg) > 0)
+				imsg_free(&msg);
+		}
+		cmp = system("cmp ./testdata/test.raw "
+		    "./scratchspace/stream1.raw 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+		cmp = system("cmp ./testdata/test.wav "
+		    "./scratchspace/stream2.wav 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+		/* Each stream counts for itself. */
+		if (stat("./testdata/test.raw", &sb) == -1)
+			err(1, "stat");
+		ck_assert_int_eq(get_stream_stats(1, &stats), 0);
+		ck_assert_int_eq(stats.pcm_bytes, sb.st_size);
+		ck_assert_int_eq(get_stats(&stats), 0);
+		ck_assert_int_eq(stats.pcm_bytes, sb.st_size);
+		ck_assert_int_eq(get_stream_stats(PNP_MAX_STREAMS, &stats), -1);
+	}
+}
+END_TEST
+
+START_TEST (decode_streams_wav_to_pipe)
+{
+	struct imsg	msg;
+	struct out	out;
+	FILE		*fp;
+	pid_t		child_pid;
+	char		buf[4096];
+	ssize_t		n;
+	int		done = 0, cmp, sv[2], pfd[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		/* After the fork, so only the decoder has the write end. */
+		if (pipe(pfd) == -1)
+			err(1, "pipe");
+		if ((fp = fopen("./scratchspace/pipe.wav", "w")) == NULL)
+			err(1, "fopen");
+		if (fcntl(pfd[0], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+		decode_stream_async(1, "./testdata/test.flac", pfd[1],
+		    OUT_WAV_FILE, count_done, &done);
+		/* The pipe is full long before the decoder is done. */
+		while ((n = read(pfd[0], buf, sizeof(buf))) != 0) {
+			if (n == -1 && errno != EAGAIN)
+				err(1, "read");
+			if (n > 0 && fwrite(buf, 1, n, fp) != (size_t)n)
+				err(1, "fwrite");
+			if (parent_process_events(&msg) > 0)
+				imsg_free(&msg);
+		}
+		fclose(fp);
+		while (done < 1) {
+			if (parent_process_events(&msg) > 0)
+				imsg_free(&msg);
+		}
+		cmp = system("cmp ./testdata/test.wav ./scratchspace/pipe.wav"
+		    " 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+	}
+}
+END_TEST
+
+START_TEST (decode_reads_flac_from_pipe)
+{
+	struct out	out;
+	FILE		*outfp, *infp;
+	pid_t		child_pid, writer_pid;
+	char		buf[4096];
+	size_t		n;
+	int		rv, cmp, status, sv[2], pfd[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	outfp = fopen("./scratchspace/stdin.raw", "w");
+	if (outfp == NULL)
+		err(1, "fopen");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_RAW;
+		out.handle.fp = outfp;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		if (pipe(pfd) == -1)
+			err(1, "pipe");
+		if ((writer_pid = fork()) == -1)
+			err(1, "fork");
+		if (writer_pid == 0) {
+			/* Feed the file through the pipe, like cat(1). */
+			close(pfd[0]);
+			if ((infp = fopen("./testdata/test.flac", "r")) == NULL)
+				err(1, "fopen");
+			while ((n = fread(buf, 1, sizeof(buf), infp)) > 0)
+				if (write(pfd[1], buf, n) != (ssize_t)n)
+					err(1, "write");
+			_exit(0);
+		}
+		close(pfd[1]);
+		if (dup2(pfd[0], STDIN_FILENO) == -1)
+			err(1, "dup2");
+		close(pfd[0]);
+		rv = decode("-");
+		ck_assert_int_eq(rv, 0);
+		ck_assert_int_eq(waitpid(writer_pid, &status, 0), writer_pid);
+		cmp = system("cmp ./testdata/test.raw ./scratchspace/stdin.raw"
+		    " 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+	}
+}
+END_TEST
+
+START_TEST (taps_get_copies_of_the_output)
+{
+	struct out	out;
+	FILE		*outfp;
+	pid_t		child_pid;
+	int		rv, cmp, fd, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	outfp = fopen("./scratchspace/teed.raw", "w");
+	if (outfp == NULL)
+		err(1, "fopen");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_RAW;
+		out.handle.fp = outfp;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		fd = open("./scratchspace/tee.wav", O_WRONLY|O_CREAT|O_TRUNC,
+		    0644);
+		ck_assert_int_ne(fd, -1);
+		ck_assert_int_eq(add_tap(0, fd, OUT_WAV_FILE), 0);
+		fd = open("./scratchspace/tee.raw", O_WRONLY|O_CREAT|O_TRUNC,
+		    0644);
+		ck_assert_int_ne(fd, -1);
+		ck_assert_int_eq(add_tap(0, fd, OUT_RAW), 0);
+		rv = decode("./testdata/test.flac");
+		ck_assert_int_eq(rv, 0);
+		cmp = system("cmp ./testdata/test.raw ./scratchspace/teed.raw"
+		    " 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+		cmp = system("cmp ./testdata/test.wav ./scratchspace/tee.wav"
+		    " 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+		cmp = system("cmp ./testdata/test.raw ./scratchspace/tee.raw"
+		    " 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+	}
+}
+END_TEST
+
+static void
+write_block(const struct pnp_pcm_format *fmt, void *buf, size_t len,
+    void *arg)
+{
+	ck_assert_int_eq(fmt->rate, 44100);
+	ck_assert_int_eq(len % (fmt->channels * fmt->bits / 8), 0);
+	if (fwrite(buf, 1, len, arg) != len)
+		err(1, "fwrite");
+}
+
+START_TEST (decode_pcm_delivers_samples_in_memory)
+{
+	struct out	out;
+	FILE		*fp;
+	pid_t		child_pid;
+	char		buf[1000];
+	int		rv, cmp, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		if ((fp = fopen("./scratchspace/pcm.raw", "w")) == NULL)
+			err(1, "fopen");
+		/* The buffer holds no whole number of sample frames. */
+		rv = decode_pcm(1, "./testdata/test.flac", buf, sizeof(buf),
+		    write_block, fp);
+		ck_assert_int_eq(rv, 0);
+		fclose(fp);
+		cmp = system("cmp ./testdata/test.raw ./scratchspace/pcm.raw"
+		    " 1>/dev/null");
+		ck_assert_int_eq(cmp, 0);
+	}
+}
+END_TEST
+
+static void
+count_block(const struct pnp_pcm_format *fmt, void *buf, size_t len,
+    void *arg)
+{
+	ck_assert_int_eq(fmt->channels, 8);
+	ck_assert_int_eq(fmt->bits, 24);
+	*(size_t *)arg += len;
+}
+
+/* The biggest blocks FLAC allows have to fit into the ring. */
+START_TEST (decode_pcm_takes_the_largest_blocks)
+{
+	FLAC__StreamEncoder	*enc;
+	FLAC__int32		*samples;
+	struct out		out;
+	pid_t			child_pid;
+	char			buf[4096];
+	size_t			got = 0, i, n = 2 * 65535;
+	int			rv, sv[2];
+
+	samples = calloc(n * 8, sizeof(FLAC__int32));
+	ck_assert_ptr_ne(samples, NULL);
+	for (i = 0; i < n * 8; i++)
+		samples[i] = (FLAC__int32)(i % 4096) - 2048;
+	ck_assert_ptr_ne(enc = FLAC__stream_encoder_new(), NULL);
+	FLAC__stream_encoder_set_channels(enc, 8);
+	FLAC__stream_encoder_set_bits_per_sample(enc, 24);
+	FLAC__stream_encoder_set_sample_rate(enc, 44100);
+	FLAC__stream_encoder_set_streamable_subset(enc, false);
+	FLAC__stream_encoder_set_blocksize(enc, 65535);
+	ck_assert_int_eq(FLAC__stream_encoder_init_file(enc,
+	    "./scratchspace/big_blocks.flac", NULL, NULL),
+	    FLAC__STREAM_ENCODER_INIT_STATUS_OK);
+	ck_assert(FLAC__stream_encoder_process_interleaved(enc, samples, n));
+	ck_assert(FLAC__stream_encoder_finish(enc));
+	FLAC__stream_encoder_delete(enc);
+	free(samples);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_NULL;
+		out.handle.fp = NULL;
+		child_main(sv, &out);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+		rv = decode_pcm(1, "./scratchspace/big_blocks.flac", buf,
+		    sizeof(buf), count_block, &got);
+		ck_assert_int_eq(rv, 0);
+		ck_assert_int_eq(got, n * 8 * 3);
+	}
+}
+END_TEST
+
 Suite
 *decode_suite(void)
 {
@@ -266,16 +854,30 @@ Suite
 
 	tcase_add_loop_test(tc_filetype, filetype_identifies_files, 0, 4);
 	tcase_add_loop_test(tc_filetype, filetype_skips_id3v2, 0, 3);
+	tcase_add_loop_test(tc_filetype, header_type_identifies_buffered_bytes,
+	    0, 3);
 	suite_add_tcase(s, tc_filetype);
 
 	tcase_add_test(tc_meta, get_meta_returns_NULL_when_no_file_open);
 	tcase_add_test(tc_meta, get_meta_handles_vorbis_comment_in_flac);
 	tcase_add_test(tc_meta, get_meta_handles_id3v2_in_flac);
+	tcase_add_test(tc_meta, get_picture_finds_front_cover);
 	suite_add_tcase(s, tc_meta);
 
 	tcase_add_test(tc_dec, decode_converts_flac_to_raw);
+	tcase_add_test(tc_dec, native_decoder_matches_libflac);
 	tcase_add_test(tc_dec, test_write_wav_header);
+	tcase_add_test(tc_dec, unknown_length_wav_header_is_patched);
+	tcase_add_loop_test(tc_dec, large_wav_header_is_rf64, 0, 2);
 	tcase_add_test(tc_dec, decode_converts_flac_to_wav);
+	tcase_add_test(tc_dec, decode_streams_wav_to_pipe);
+	tcase_add_test(tc_dec, decode_reads_flac_from_pipe);
+	tcase_add_test(tc_dec, taps_get_copies_of_the_output);
+	tcase_add_test(tc_dec, decode_to_null_discards_samples);
+	tcase_add_test(tc_dec, decoder_is_reused_across_files);
+	tcase_add_test(tc_dec, streams_decode_side_by_side);
+	tcase_add_test(tc_dec, decode_pcm_delivers_samples_in_memory);
+	tcase_add_test(tc_dec, decode_pcm_takes_the_largest_blocks);
 	suite_add_tcase(s, tc_dec);
 	
 	return (s);
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Fake sndio device. Like a real one, it starts playing once the buffer
+ * has been filled after sio_start(). It plays frames in blocks of
+ * conf.round at conf.speed times the sample rate. If the buffer runs
+ * empty, it plays silence and the stream is shifted, like SIO_IGNORE.
+ * During a stall, the device keeps playing but reports no POLLOUT and
+ * accepts no data, which is what a player on a loaded host sees.
+ */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <poll.h>
+#include <sndio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_sndio.h"
+
+enum {DEV_STOPPED, DEV_ARMED, DEV_RUNNING};
+
+struct sio_hdl {
+	struct sio_par	par;
+	int		fd[2];	/* A pipe, so there is something to poll. */
+};
+
+/* Shared between the parent and the child. */
+struct fake_state {
+	struct fake_sio_conf	conf;
+	struct fake_sio_report	report;
+	uint64_t		lat_sum, lat_count;
+	int			state, starved;
+	unsigned int		rate;
+	/* At the last sio_start(): */
+	uint64_t		t0;		/* Simulated ns, */
+	uint64_t		played0;	/* frames played */
+	uint64_t		silence0;	/* and silence. */
+	uint64_t		dev_pos;	/* Frames since sio_start(). */
+};
+
+static struct fake_state	*st;
+static struct sio_hdl		hdl;
+static uint64_t			real_t0;
+
+static void	init_state(void);
+static uint64_t	sim_now(void);
+static void	advance(void);
+static int	stalled(void);
+static size_t	buffered(void);
+
+void
+fake_sio_configure(const struct fake_sio_conf *conf)
+{
+	init_state();
+	st->conf = *conf;
+	if (st->conf.round == 0)
+		st->conf.round = 1;
+	if (st->conf.speed <= 0)
+		st->conf.speed = 1.0;
+}
+
+void
+fake_sio_get_report(struct fake_sio_report *report)
+{
+	init_state();
+	*report = st->report;
+	report->lat_avg_ns = st->lat_count ? st->lat_sum / st->lat_count : 0;
+}
+
+static void
+init_state(void)
+{
+	struct timespec	ts;
+
+	if (st != NULL)
+		return;
+	st = mmap(NULL, sizeof(*st), PROT_READ|PROT_WRITE,
+	    MAP_ANON|MAP_SHARED, -1, 0);
+	if (st == MAP_FAILED)
+		err(1, "mmap");
+	memset(st, 0, sizeof(*st));
+	st->conf.round = 480;
+	st->conf.speed = 1.0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	real_t0 = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Simulated time in ns since the state was set up. */
+static uint64_t
+sim_now(void)
+{
+	struct timespec	ts;
+	uint64_t	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return ((uint64_t)((now - real_t0) * st->conf.speed));
+}
+
+/* Bring the play position up to date. */
+static void
+advance(void)
+{
+	uint64_t	elapsed, pos, jitter = 0;
+	uint64_t	written = st->report.frames_written;
+
+	if (st->state != DEV_RUNNING)
+		return;
+	if (st->conf.jitter_us > 0)
+		jitter = arc4random_uniform(st->conf.jitter_us) * 1000ULL;
+	elapsed = sim_now() - st->t0;
+	elapsed = elapsed > jitter ? elapsed - jitter : 0;
+	pos = elapsed * st->rate / 1000000000;
+	pos -= pos % st->conf.round;
+	if (pos <= st->dev_pos)
+		return;
+	st->dev_pos = pos;
+	if (st->played0 + st->dev_pos - (st->report.silence_frames -
+	    st->silence0) > written) {
+		/* The buffer ran empty: play silence. */
+		if (!st->starved)
+			st->report.underruns++;
+		st->starved = 1;
+		st->report.silence_frames = st->silence0 + st->played0 +
+		    st->dev_pos - written;
+	}
+	else
+		st->starved = 0;
+	st->report.frames_played = st->played0 + st->dev_pos -
+	    (st->report.silence_frames - st->silence0);
+}
+
+static int
+stalled(void)
+{
+	uint64_t	ms;
+
+	if (st->conf.stall_every_ms == 0)
+		return (0);
+	ms = sim_now() / 1000000;
+	return (ms % st->conf.stall_every_ms >=
+	    st->conf.stall_every_ms - st->conf.stall_ms);
+}
+
+static size_t
+buffered(void)
+{
+	return (st->report.frames_written - st->report.frames_played);
+}
+
+struct sio_hdl *
+sio_open(const char *name, unsigned int mode, int nbio)
+{
+	init_state();
+	if (pipe(hdl.fd) == -1)
+		return (NULL);
+	sio_initpar(&hdl.par);
+	return (&hdl);
+}
+
+void
+sio_close(struct sio_hdl *h)
+{
+	close(h->fd[0]);
+	close(h->fd[1]);
+}
+
+void
+sio_initpar(struct sio_par *par)
+{
+	memset(par, 0xff, sizeof(*par));
+}
+
+int
+sio_setpar(struct sio_hdl *h, struct sio_par *par)
+{
+	h->par = *par;
+	h->par.round = st->conf.round;
+	h->par.bufsz = h->par.appbufsz;
+	st->rate = h->par.rate;
+	return (1);
+}
+
+int
+sio_getpar(struct sio_hdl *h, struct sio_par *par)
+{
+	*par = h->par;
+	return (1);
+}
+
+int
+sio_start(struct sio_hdl *h)
+{
+	st->state = DEV_ARMED;
+	st->starved = 0;
+	st->played0 = st->report.frames_played;
+	st->silence0 = st->report.silence_frames;
+	st->dev_pos = 0;
+	st->report.starts++;
+	return (1);
+}
+
+int
+sio_stop(struct sio_hdl *h)
+{
+	/* Like sndio, let the buffer drain, but don't wait for it. */
+	advance();
+	st->state = DEV_STOPPED;
+	st->report.frames_played = st->report.frames_written;
+	st->report.stops++;
+	return (1);
+}
+
+size_t
+sio_write(struct sio_hdl *h, const void *buf, size_t len)
+{
+	size_t		framesize, nframes, space;
+	uint64_t	lat;
+
+	advance();
+	framesize = h->par.bps * h->par.pchan;
+	nframes = len / framesize;
+	space = h->par.bufsz - buffered();
+	if (stalled())
+		space = 0;
+	st->report.writes++;
+	if (space < nframes) {
+		st->report.short_writes++;
+		nframes = space;
+	}
+	if (nframes == 0)
+		return (0);
+	lat = (uint64_t)buffered() * 1000000000 / h->par.rate;
+	if (st->lat_count == 0 || lat < st->report.lat_min_ns)
+		st->report.lat_min_ns = lat;
+	if (lat > st->report.lat_max_ns)
+		st->report.lat_max_ns = lat;
+	st->lat_sum += lat;
+	st->lat_count++;
+	st->report.frames_written += nframes;
+	if (st->state == DEV_ARMED && buffered() >= h->par.bufsz) {
+		st->state = DEV_RUNNING;
+		st->t0 = sim_now();
+	}
+	return (nframes * framesize);
+}
+
+int
+sio_nfds(struct sio_hdl *h)
+{
+	return (1);
+}
+
+int
+sio_pollfd(struct sio_hdl *h, struct pollfd *pfd, int events)
+{
+	pfd->fd = h->fd[1];
+	pfd->events = events & POLLOUT;
+	return (1);
+}
+
+int
+sio_revents(struct sio_hdl *h, struct pollfd *pfd)
+{
+	advance();
+	if (stalled() || h->par.bufsz - buffered() < h->par.round)
+		return (0);
+	return (pfd->revents & POLLOUT);
+}
+
+int
+sio_eof(struct sio_hdl *h)
+{
+	return (0);
+}
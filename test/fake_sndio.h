@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_FAKE_SNDIO_H
+#define PNP_FAKE_SNDIO_H
+
+#include <stdint.h>
+
+/*
+ * A stand-in for libsndio for machines without audio hardware. Programs
+ * linked with fake_sndio.o instead of -lsndio get a device that consumes
+ * samples at the configured rate. The report lives in shared memory, so
+ * the parent can read what happened in the child.
+ */
+
+struct fake_sio_conf {
+	unsigned int	round;		/* Device block size in frames. */
+	unsigned int	jitter_us;	/* Random delay per block. */
+	unsigned int	stall_every_ms;	/* 0 disables stalls. */
+	unsigned int	stall_ms;	/* No POLLOUT, no writes accepted. */
+	double		speed;		/* 1.0 is real time. */
+};
+
+struct fake_sio_report {
+	uint64_t	frames_written, frames_played;
+	uint64_t	writes, short_writes;
+	uint64_t	underruns, silence_frames;
+	uint64_t	starts, stops;
+	/* Time from sio_write() until the first frame is played. */
+	uint64_t	lat_min_ns, lat_avg_ns, lat_max_ns;
+};
+
+void	fake_sio_configure(const struct fake_sio_conf *);
+void	fake_sio_get_report(struct fake_sio_report *);
+
+#endif
@@ -174,6 +174,106 @@ START_TEST (send_new_file_returns_1_on_invalid_file)
 }
 END_TEST
 
+START_TEST (get_stats_returns_snapshot)
+{
+	struct pnp_stats	stats;
+	struct imsg		msg;
+	struct out		out;
+	pid_t			child;
+	int			sv[2], rv;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child = fork();
+	switch (child) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_RAW;
+		out.handle.fp = NULL;
+		rv = child_main(sv, &out);
+		if (rv == -1)
+			ck_abort_msg("child_main failed.");
+	default:
+		/* Parent process */
+		parent_init(sv, child);
+		parent_process_events(&msg);
+		rv = send_new_file("testdata/test.flac");
+		ck_assert_int_eq(rv, 0);
+		rv = get_stats(&stats);
+		ck_assert_int_eq(rv, 0);
+		ck_assert_int_eq(stats.inbuf_size, 32768);
+		ck_assert_int_eq(stats.sbuf_size, 0);
+		ck_assert_int_eq(stats.frames_decoded, 0);
+		ck_assert_int_eq(stats.sample_pos, 0);
+	}
+}
+END_TEST
+
+static char	replies[8];
+static int	nreplies;
+
+static void
+record_status(int status, void *arg)
+{
+	replies[nreplies++] = (status == 0) ? 'A' : 'N';
+}
+
+static void
+record_meta(struct meta *mdata, void *arg)
+{
+	if (mdata != NULL) {
+		ck_assert_ptr_ne(mdata->title, NULL);
+		ck_assert_str_eq(mdata->title, "I");
+	}
+	replies[nreplies++] = (mdata != NULL) ? 'M' : '-';
+	free_meta(mdata);
+}
+
+START_TEST (pipelined_requests_complete_in_order)
+{
+	struct imsg	msg;
+	struct out	out;
+	pid_t		child;
+	int		sv[2], rv;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child = fork();
+	switch (child) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		out.type = OUT_RAW;
+		out.handle.fp = NULL;
+		rv = child_main(sv, &out);
+		if (rv == -1)
+			ck_abort_msg("child_main failed.");
+	default:
+		/* Parent process */
+		parent_init(sv, child);
+		/* Nothing is answered before all requests are sent. */
+		send_new_file_async("testdata/test.flac", record_status, NULL);
+		get_meta_async(record_meta, NULL);
+		send_new_file_async("testdata/random_garbage", record_status,
+		    NULL);
+		get_meta_async(record_meta, NULL);
+		send_new_file_async("testdata/with_id3v2.flac", record_status,
+		    NULL);
+		get_meta_async(record_meta, NULL);
+		ck_assert_int_eq(pending_requests(), 6);
+		while (pending_requests() > 0) {
+			if (parent_process_events(&msg) > 0)
+				imsg_free(&msg);
+		}
+		ck_assert_int_eq(nreplies, 6);
+		ck_assert(memcmp(replies, "AMN-AM", 6) == 0);
+	}
+}
+END_TEST
+
 void
 test_err_cb(int type, char *msg)
 {
@@ -197,6 +297,8 @@ Suite
 	tcase_add_test(tc_cmd, child_exits_on_CMD_EXIT);
 	tcase_add_test(tc_cmd, send_new_file_returns_0_on_valid_file);
 	tcase_add_test(tc_cmd, send_new_file_returns_1_on_invalid_file);
+	tcase_add_test(tc_cmd, get_stats_returns_snapshot);
+	tcase_add_test(tc_cmd, pipelined_requests_complete_in_order);
 	tcase_add_exit_test(tc_signals, parent_handles_child_exit, 1);
 	tcase_add_test(tc_signals, parent_ignores_false_SIGCHLD);
 	suite_add_tcase(s, tc_cmd);
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Playback tests. These are linked with fake_sndio.o instead of libsndio. */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <check.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <signal.h>
+#include <sndio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc_hook.h"
+#include "fake_sndio.h"
+#include "message_types.h"
+#include "pnp.h"
+
+static void	spawn_player(const struct fake_sio_conf *, int);
+static void	wait_for_done(void);
+static int	open_fake(struct out *);
+
+/* If count_allocs is set, the child's allocations are counted. */
+static void
+spawn_player(const struct fake_sio_conf *conf, int count_allocs)
+{
+	struct out	out;
+	pid_t		child_pid;
+	int		sv[2];
+
+	fake_sio_configure(conf);
+	alloc_hook_init();
+	out.type = OUT_SNDIO;
+	if ((out.handle.sio = sio_open(SIO_DEVANY, SIO_PLAY, 1)) == NULL)
+		err(1, "sio_open");
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_LOCAL, sv) == -1)
+		err(1, "socketpair");
+	child_pid = fork();
+	switch (child_pid) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/* Child process */
+		if (count_allocs)
+			alloc_hook_arm();
+		child_main(sv, &out);
+		_exit(1);
+	default:
+		/* Parent process */
+		parent_init(sv, child_pid);
+	}
+}
+
+static void
+wait_for_done(void)
+{
+	struct imsg	msg;
+
+	while (1) {
+		if (parent_process_events(&msg) > 0) {
+			if (msg.hdr.type == MSG_DONE) {
+				imsg_free(&msg);
+				return;
+			}
+			imsg_free(&msg);
+		}
+	}
+}
+
+static int
+open_fake(struct out *out)
+{
+	out->type = OUT_SNDIO;
+	out->ready = 0;
+	if ((out->handle.sio = sio_open(SIO_DEVANY, SIO_PLAY, 1)) == NULL)
+		return (-1);
+	return (0);
+}
+
+START_TEST (play_delivers_every_frame)
+{
+	struct fake_sio_conf	conf = {480, 1000, 0, 0, 10.0};
+	struct fake_sio_report	report;
+	struct pnp_stats	stats;
+
+	spawn_player(&conf, 0);
+	ck_assert_int_eq(start_play("./testdata/test.flac"), 0);
+	wait_for_done();
+	ck_assert_int_eq(get_stats(&stats), 0);
+	fake_sio_get_report(&report);
+	ck_assert_int_ne(report.frames_written, 0);
+	ck_assert_int_eq(report.frames_written, stats.sample_pos);
+	ck_assert_int_eq(report.frames_played, report.frames_written);
+	ck_assert_int_eq(report.underruns, 0);
+	/* The buffer holds 200 ms. */
+	ck_assert_int_le(report.lat_max_ns, 200000000);
+}
+END_TEST
+
+START_TEST (stall_longer_than_buffer_underruns)
+{
+	struct fake_sio_conf	conf = {480, 0, 1000, 400, 10.0};
+	struct fake_sio_report	report;
+	struct pnp_stats	stats;
+
+	spawn_player(&conf, 0);
+	ck_assert_int_eq(start_play("./testdata/test.flac"), 0);
+	wait_for_done();
+	ck_assert_int_eq(get_stats(&stats), 0);
+	fake_sio_get_report(&report);
+	ck_assert_int_ge(report.underruns, 1);
+	ck_assert_int_ne(report.silence_frames, 0);
+	ck_assert_int_ne(report.short_writes, 0);
+	ck_assert_int_eq(report.frames_played, report.frames_written);
+	ck_assert_int_eq(report.frames_written, stats.sample_pos);
+}
+END_TEST
+
+START_TEST (pause_stops_and_resume_restarts_device)
+{
+	struct fake_sio_conf	conf = {480, 0, 0, 0, 10.0};
+	struct fake_sio_report	before, after;
+
+	spawn_player(&conf, 0);
+	ck_assert_int_eq(start_play("./testdata/test.flac"), 0);
+	usleep(300000);
+	pause_play();
+	usleep(100000);
+	fake_sio_get_report(&before);
+	usleep(300000);
+	fake_sio_get_report(&after);
+	ck_assert_int_eq(before.stops, 1);
+	ck_assert_int_eq(after.frames_played, before.frames_played);
+	ck_assert_int_eq(after.frames_written, before.frames_written);
+	resume_play();
+	wait_for_done();
+	fake_sio_get_report(&after);
+	ck_assert_int_eq(after.starts, 2);
+	ck_assert_int_gt(after.frames_played, before.frames_played);
+}
+END_TEST
+
+START_TEST (steady_playback_does_not_allocate)
+{
+	struct fake_sio_conf	conf = {480, 1000, 0, 0, 2.0};
+	struct fake_sio_report	before, after;
+	uint64_t		allocs;
+
+	spawn_player(&conf, 1);
+	ck_assert_int_eq(start_play("./testdata/test.flac"), 0);
+	/* Let the decoder and the device settle, then watch for 2 s. */
+	usleep(500000);
+	allocs = alloc_hook_count();
+	fake_sio_get_report(&before);
+	usleep(2000000);
+	fake_sio_get_report(&after);
+	ck_assert_int_gt(after.frames_played, before.frames_played);
+	ck_assert_int_eq(alloc_hook_count(), allocs);
+	wait_for_done();
+}
+END_TEST
+
+START_TEST (tap_records_what_is_played)
+{
+	struct fake_sio_conf	conf = {480, 0, 0, 0, 10.0};
+	struct fake_sio_report	report;
+	struct pnp_stats	stats;
+	struct stat		sb;
+	int			fd;
+
+	spawn_player(&conf, 0);
+	fd = open("./scratchspace/played.raw", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	ck_assert_int_ne(fd, -1);
+	ck_assert_int_eq(add_tap(0, fd, OUT_RAW), 0);
+	ck_assert_int_eq(start_play("./testdata/test.flac"), 0);
+	wait_for_done();
+	ck_assert_int_eq(get_stats(&stats), 0);
+	fake_sio_get_report(&report);
+	ck_assert_int_eq(report.underruns, 0);
+	ck_assert_int_eq(stat("./scratchspace/played.raw", &sb), 0);
+	ck_assert_int_eq(sb.st_size, stats.pcm_bytes);
+	ck_assert_int_eq(system("cmp ./testdata/test.raw "
+	    "./scratchspace/played.raw 1>/dev/null"), 0);
+}
+END_TEST
+
+START_TEST (broadcast_reaches_listener)
+{
+	struct fake_sio_conf	conf = {480, 0, 0, 0, 10.0};
+	struct sockaddr_un	sun;
+	struct pnp_pcm_format	fmt;
+	struct stat		sb;
+	struct imsg		msg;
+	FILE			*fp;
+	char			buf[4096];
+	ssize_t			n;
+	off_t			got = 0;
+	int			fd;
+
+	spawn_player(&conf, 0);
+	ck_assert_int_eq(broadcast_open("./scratchspace/pnp.sock"), 0);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, "./scratchspace/pnp.sock", sizeof(sun.sun_path));
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	ck_assert_int_eq(connect(fd, (struct sockaddr *)&sun, sizeof(sun)),
+	    0);
+	ck_assert_int_eq(broadcast_tap(0), 0);
+	ck_assert_int_eq(start_play("./testdata/test.flac"), 0);
+	/* The format comes first. */
+	do {
+		if (parent_process_events(&msg) > 0)
+			imsg_free(&msg);
+		n = recv(fd, &fmt, sizeof(fmt), MSG_DONTWAIT);
+	} while (n == -1 && errno == EAGAIN);
+	ck_assert_int_eq(n, sizeof(fmt));
+	ck_assert_int_eq(fmt.rate, 44100);
+	ck_assert_int_eq(stat("./testdata/test.raw", &sb), 0);
+	if ((fp = fopen("./scratchspace/broadcast.raw", "w")) == NULL)
+		err(1, "fopen");
+	while (got < sb.st_size) {
+		if (parent_process_events(&msg) > 0)
+			imsg_free(&msg);
+		n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n == -1 && errno != EAGAIN)
+			err(1, "recv");
+		if (n > 0 && fwrite(buf, 1, n, fp) != (size_t)n)
+			err(1, "fwrite");
+		if (n > 0)
+			got += n;
+	}
+	fclose(fp);
+	close(fd);
+	ck_assert_int_eq(broadcast_skips(), 0);
+	ck_assert_int_eq(system("cmp ./testdata/test.raw "
+	    "./scratchspace/broadcast.raw 1>/dev/null"), 0);
+	broadcast_close();
+}
+END_TEST
+
+START_TEST (standby_resumes_after_crash)
+{
+	struct fake_sio_conf	conf = {480, 0, 0, 0, 10.0};
+	struct fake_sio_report	report;
+	struct pnp_stats	stats;
+	struct out		out;
+	pid_t			pid;
+
+	fake_sio_configure(&conf);
+	ck_assert_int_eq(open_fake(&out), 0);
+	pid = parent_start(&out);
+	ck_assert_int_eq(parent_standby(open_fake), 0);
+	ck_assert_int_eq(start_play("./testdata/test.flac"), 0);
+	usleep(300000);
+	ck_assert_int_eq(kill(pid, SIGKILL), 0);
+	wait_for_done();
+	ck_assert_int_eq(get_stats(&stats), 0);
+	fake_sio_get_report(&report);
+	ck_assert_int_eq(report.starts, 2);
+	/*
+	 * The standby starts where the first child stopped. It may have
+	 * died between a write and publishing its position.
+	 */
+	ck_assert_int_ge(report.frames_written, stats.sample_pos);
+	ck_assert_int_le(report.frames_written, stats.sample_pos + 44100 / 5);
+}
+END_TEST
+
+Suite
+*play_suite(void)
+{
+	Suite *s;
+	TCase *tc_play;
+
+	s = suite_create("Playback");
+	tc_play = tcase_create("Fake sndio device");
+	tcase_set_timeout(tc_play, 60);
+
+	tcase_add_test(tc_play, play_delivers_every_frame);
+	tcase_add_test(tc_play, stall_longer_than_buffer_underruns);
+	tcase_add_test(tc_play, pause_stops_and_resume_restarts_device);
+	tcase_add_test(tc_play, steady_playback_does_not_allocate);
+	tcase_add_test(tc_play, tap_records_what_is_played);
+	tcase_add_test(tc_play, broadcast_reaches_listener);
+	tcase_add_test(tc_play, standby_resumes_after_crash);
+	suite_add_tcase(s, tc_play);
+
+	return (s);
+}
+
+int
+main(void)
+{
+	int	no_failed;
+	Suite	*s;
+	SRunner	*sr;
+
+	s = play_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	no_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return ((no_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+START_TEST (arena_alloc_returns_aligned_disjoint_memory)
+{
+	struct arena	a = {NULL, 0};
+	char		*p, *q;
+
+	p = arena_alloc(&a, 3);
+	q = arena_alloc(&a, 5);
+	ck_assert_ptr_ne(p, NULL);
+	ck_assert_ptr_ne(q, NULL);
+	ck_assert_int_eq((uintptr_t)p % 16, 0);
+	ck_assert_int_eq((uintptr_t)q % 16, 0);
+	ck_assert(q >= p + 3 || p >= q + 5);
+	memset(p, 'a', 3);
+	memset(q, 'b', 5);
+	ck_assert_int_eq(p[2], 'a');
+	arena_reset(&a);
+}
+END_TEST
+
+START_TEST (arena_alloc_handles_large_requests)
+{
+	struct arena	a = {NULL, 0};
+	char		*small, *big;
+
+	small = arena_alloc(&a, 10);
+	big = arena_alloc(&a, 1 << 20);
+	ck_assert_ptr_ne(small, NULL);
+	ck_assert_ptr_ne(big, NULL);
+	memset(big, 0xff, 1 << 20);
+	ck_assert_ptr_eq(arena_alloc(&a, SIZE_MAX), NULL);
+	arena_reset(&a);
+}
+END_TEST
+
+START_TEST (arena_reset_reuses_memory)
+{
+	struct arena	a = {NULL, 0};
+	char		*p, *q;
+
+	p = arena_alloc(&a, 100);
+	(void)arena_alloc(&a, 1 << 20);
+	arena_reset(&a);
+	q = arena_alloc(&a, 100);
+	ck_assert_ptr_eq(p, q);
+	arena_reset(&a);
+}
+END_TEST
+
+START_TEST (arena_strndup_copies_at_most_maxlen)
+{
+	struct arena	a = {NULL, 0};
+	char		src[] = {'a', 'b', 'c', 'd'}; /* Not terminated. */
+
+	ck_assert_str_eq(arena_strndup(&a, src, 3), "abc");
+	ck_assert_str_eq(arena_strndup(&a, "xy", 10), "xy");
+	arena_reset(&a);
+}
+END_TEST
+
+Suite
+*arena_suite(void)
+{
+	Suite *s;
+	TCase *tc_arena;
+
+	s = suite_create("Arena");
+	tc_arena = tcase_create("Bump allocator");
+
+	tcase_add_test(tc_arena, arena_alloc_returns_aligned_disjoint_memory);
+	tcase_add_test(tc_arena, arena_alloc_handles_large_requests);
+	tcase_add_test(tc_arena, arena_reset_reuses_memory);
+	tcase_add_test(tc_arena, arena_strndup_copies_at_most_maxlen);
+	suite_add_tcase(s, tc_arena);
+
+	return (s);
+}
+
+int
+main(void)
+{
+	int	no_failed;
+	Suite	*s;
+	SRunner	*sr;
+
+	s = arena_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	no_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return ((no_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Tests for the in-tree frame decoder. Streams are encoded with libFLAC
+ * in memory, decoded by libFLAC for reference and then frame by frame
+ * with frame_decode().
+ */
+
+#include <check.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <FLAC/stream_decoder.h>
+#include <FLAC/stream_encoder.h>
+
+#include "flac_frame.h"
+
+#define MAX_FRAMES	8
+#define RATE		44100
+
+/* An encoded stream and what libFLAC decodes it to. */
+struct coded {
+	unsigned char	*buf;
+	size_t		len, size, read_pos;
+	size_t		frame_off[MAX_FRAMES];
+	unsigned int	nframes;
+	FLAC__int32	*ref[FRAME_MAX_CHANNELS];
+	size_t		nsamples, ref_pos;
+};
+
+static void	make_coded(struct coded *, unsigned int, unsigned int,
+		    unsigned int);
+static void	free_coded(struct coded *);
+static FLAC__int32	*make_samples(size_t, unsigned int, unsigned int);
+
+static const unsigned int	bitss[] = {8, 16, 24};
+static const unsigned int	channelss[] = {1, 2, 6};
+static const unsigned int	bsizes[] = {192, 4096, 16384};
+
+/*
+ * make_samples: Return n interleaved frames. The channels differ so the
+ * encoder tries everything: LPC, a channel that follows the first one for
+ * the stereo modes, constant and verbatim subframes, and wasted bits.
+ */
+static FLAC__int32 *
+make_samples(size_t n, unsigned int bits, unsigned int channels)
+{
+	FLAC__int32	*buf, v, max = (1 << (bits - 1)) - 1;
+	uint32_t	lcg = 12345;
+	size_t		i;
+	unsigned int	c;
+
+	buf = reallocarray(NULL, n * channels, sizeof(FLAC__int32));
+	ck_assert_ptr_ne(buf, NULL);
+	for (i = 0; i < n; i++)
+		for (c = 0; c < channels; c++) {
+			lcg = lcg * 1103515245 + 12345;
+			switch (c) {
+			case 1:
+				v = buf[i * channels] +
+				    (FLAC__int32)((lcg >> 16) % 16) - 8;
+				break;
+			case 2:
+				v = 0;
+				break;
+			case 3:
+				v = (FLAC__int32)(lcg >> (32 - bits)) - max - 1;
+				break;
+			case 4:
+				v = (FLAC__int32)(max / 2 *
+				    sin(2 * M_PI * 440 * i / RATE));
+				v &= ~3;
+				break;
+			default:
+				v = (FLAC__int32)(max / 2 * sin(2 * M_PI *
+				    (220 + 110 * c) * i / RATE)) +
+				    (FLAC__int32)((lcg >> 16) % 16) - 8;
+			}
+			if (v > max)
+				v = max;
+			if (v < -max - 1)
+				v = -max - 1;
+			buf[i * channels + c] = v;
+		}
+	return (buf);
+}
+
+static FLAC__StreamEncoderWriteStatus
+enc_write(const FLAC__StreamEncoder *enc, const FLAC__byte buf[],
+    size_t len, unsigned samples, unsigned current_frame, void *arg)
+{
+	struct coded	*cs = arg;
+
+	/* Metadata comes with samples == 0, each frame in one piece. */
+	if (samples > 0) {
+		ck_assert_int_lt(cs->nframes, MAX_FRAMES);
+		cs->frame_off[cs->nframes++] = cs->len;
+	}
+	if (cs->len + len > cs->size) {
+		cs->size = 2 * (cs->len + len);
+		cs->buf = realloc(cs->buf, cs->size);
+		ck_assert_ptr_ne(cs->buf, NULL);
+	}
+	memcpy(cs->buf + cs->len, buf, len);
+	cs->len += len;
+	return (FLAC__STREAM_ENCODER_WRITE_STATUS_OK);
+}
+
+static FLAC__StreamDecoderReadStatus
+dec_read(const FLAC__StreamDecoder *dec, FLAC__byte buf[], size_t *len,
+    void *arg)
+{
+	struct coded	*cs = arg;
+	size_t		n = cs->len - cs->read_pos;
+
+	if (n == 0) {
+		*len = 0;
+		return (FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM);
+	}
+	if (n > *len)
+		n = *len;
+	memcpy(buf, cs->buf + cs->read_pos, n);
+	cs->read_pos += n;
+	*len = n;
+	return (FLAC__STREAM_DECODER_READ_STATUS_CONTINUE);
+}
+
+static FLAC__StreamDecoderWriteStatus
+dec_write(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame,
+    const FLAC__int32 *const samples[], void *arg)
+{
+	struct coded	*cs = arg;
+	unsigned int	c;
+
+	ck_assert_int_le(cs->ref_pos + frame->header.blocksize, cs->nsamples);
+	for (c = 0; c < frame->header.channels; c++)
+		memcpy(cs->ref[c] + cs->ref_pos, samples[c],
+		    frame->header.blocksize * sizeof(FLAC__int32));
+	cs->ref_pos += frame->header.blocksize;
+	return (FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE);
+}
+
+static void
+dec_error(const FLAC__StreamDecoder *dec,
+    FLAC__StreamDecoderErrorStatus status, void *arg)
+{
+	ck_abort_msg("libFLAC can't decode the test stream");
+}
+
+/*
+ * make_coded: Encode a bit more than three blocks, so the last frame is
+ * short, and decode them again with libFLAC. The streams aren't in the
+ * streamable subset, which lets the encoder use up to 32 LPC coefficients.
+ */
+static void
+make_coded(struct coded *cs, unsigned int bits, unsigned int channels,
+    unsigned int bsize)
+{
+	FLAC__StreamEncoder	*enc;
+	FLAC__StreamDecoder	*dec;
+	FLAC__int32		*samples;
+	unsigned int		c;
+
+	memset(cs, 0, sizeof(*cs));
+	cs->nsamples = 3 * bsize + bsize / 3 + 1;
+	samples = make_samples(cs->nsamples, bits, channels);
+	ck_assert_ptr_ne(enc = FLAC__stream_encoder_new(), NULL);
+	FLAC__stream_encoder_set_channels(enc, channels);
+	FLAC__stream_encoder_set_bits_per_sample(enc, bits);
+	FLAC__stream_encoder_set_sample_rate(enc, RATE);
+	FLAC__stream_encoder_set_compression_level(enc, 8);
+	FLAC__stream_encoder_set_streamable_subset(enc, false);
+	FLAC__stream_encoder_set_max_lpc_order(enc, 32);
+	FLAC__stream_encoder_set_blocksize(enc, bsize);
+	ck_assert_int_eq(FLAC__stream_encoder_init_stream(enc, enc_write,
+	    NULL, NULL, NULL, cs), FLAC__STREAM_ENCODER_INIT_STATUS_OK);
+	ck_assert(FLAC__stream_encoder_process_interleaved(enc, samples,
+	    cs->nsamples));
+	ck_assert(FLAC__stream_encoder_finish(enc));
+	FLAC__stream_encoder_delete(enc);
+	free(samples);
+
+	for (c = 0; c < channels; c++) {
+		cs->ref[c] = reallocarray(NULL, cs->nsamples,
+		    sizeof(FLAC__int32));
+		ck_assert_ptr_ne(cs->ref[c], NULL);
+	}
+	ck_assert_ptr_ne(dec = FLAC__stream_decoder_new(), NULL);
+	ck_assert_int_eq(FLAC__stream_decoder_init_stream(dec, dec_read, NULL,
+	    NULL, NULL, NULL, dec_write, NULL, dec_error, cs),
+	    FLAC__STREAM_DECODER_INIT_STATUS_OK);
+	ck_assert(FLAC__stream_decoder_process_until_end_of_stream(dec));
+	FLAC__stream_decoder_delete(dec);
+	ck_assert_int_eq(cs->ref_pos, cs->nsamples);
+}
+
+static void
+free_coded(struct coded *cs)
+{
+	unsigned int	c;
+
+	for (c = 0; c < FRAME_MAX_CHANNELS; c++)
+		free(cs->ref[c]);
+	free(cs->buf);
+}
+
+/* Runs for every combination of bitss, channelss and bsizes. */
+START_TEST (frames_match_libflac)
+{
+	struct coded		cs;
+	struct frame_dec	d;
+	unsigned int		bits, channels, bsize, f, c;
+	size_t			off, end, used, pos = 0;
+
+	bits = bitss[_i % 3];
+	channels = channelss[_i / 3 % 3];
+	bsize = bsizes[_i / 9];
+	make_coded(&cs, bits, channels, bsize);
+	ck_assert_int_eq(cs.nframes, 4);
+	ck_assert_int_eq(frame_dec_init(&d, bsize, bits, RATE), 0);
+	for (f = 0; f < cs.nframes; f++) {
+		off = cs.frame_off[f];
+		end = f + 1 < cs.nframes ? cs.frame_off[f + 1] : cs.len;
+		ck_assert_int_eq(frame_decode(&d, cs.buf + off, cs.len - off,
+		    &used), FRAME_OK);
+		ck_assert_int_eq(used, end - off);
+		ck_assert_int_eq(d.hdr.channels, channels);
+		for (c = 0; c < channels; c++)
+			ck_assert_int_eq(memcmp(d.chan[c], cs.ref[c] + pos,
+			    d.hdr.blocksize * sizeof(FLAC__int32)), 0);
+		pos += d.hdr.blocksize;
+	}
+	ck_assert_int_eq(pos, cs.nsamples);
+	frame_dec_free(&d);
+	free_coded(&cs);
+}
+END_TEST
+
+START_TEST (damaged_frames_are_caught)
+{
+	struct coded		cs;
+	struct frame_dec	d;
+	unsigned char		junk[64];
+	size_t			off, len, used;
+	unsigned int		c;
+
+	make_coded(&cs, 16, 2, 4096);
+	ck_assert_int_eq(frame_dec_init(&d, 4096, 16, RATE), 0);
+	off = cs.frame_off[1];
+	len = cs.frame_off[2] - off;
+
+	/* A frame that is cut off. */
+	ck_assert_int_eq(frame_decode(&d, cs.buf + off, len - 1, &used),
+	    FRAME_SHORT);
+
+	/* A bad CRC-16 comes out as silence, like with libFLAC. */
+	cs.buf[off + len - 1] ^= 0x01;
+	ck_assert_int_eq(frame_decode(&d, cs.buf + off, cs.len - off, &used),
+	    FRAME_CRC);
+	ck_assert_int_eq(used, len);
+	for (c = 0; c < 2; c++)
+		ck_assert_int_eq(d.chan[c][0] | d.chan[c][4095], 0);
+
+	/* No frame starts here, but the next one is found. */
+	memset(junk, 0, sizeof(junk));
+	ck_assert_int_eq(frame_decode(&d, junk, sizeof(junk), &used),
+	    FRAME_SYNC);
+	ck_assert_int_eq(frame_find(cs.buf + off + 1, cs.len - off - 1),
+	    len - 1);
+	frame_dec_free(&d);
+	free_coded(&cs);
+}
+END_TEST
+
+Suite
+*flac_frame_suite(void)
+{
+	Suite *s;
+	TCase *tc_frame;
+
+	s = suite_create("FLAC frame decoder");
+	tc_frame = tcase_create("Against libFLAC");
+	tcase_set_timeout(tc_frame, 60);
+
+	tcase_add_loop_test(tc_frame, frames_match_libflac, 0, 27);
+	tcase_add_test(tc_frame, damaged_frames_are_caught);
+	suite_add_tcase(s, tc_frame);
+
+	return (s);
+}
+
+int
+main(void)
+{
+	int	no_failed;
+	Suite	*s;
+	SRunner	*sr;
+
+	s = flac_frame_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	no_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return ((no_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "transcode.h"
+
+static struct arena	a;
+
+START_TEST (latin1_is_converted)
+{
+	/* Long enough for the eight byte ASCII path. */
+	unsigned char	in[] = "Motorhead - Ace of Spades, Ol\xe9 \xff";
+
+	ck_assert_str_eq(transcode(&a, "ISO-8859-1", in, sizeof(in) - 1),
+	    "Motorhead - Ace of Spades, Ol\xc3\xa9 \xc3\xbf");
+	arena_reset(&a);
+}
+END_TEST
+
+START_TEST (latin1_stops_at_null)
+{
+	unsigned char	in[] = "0123456789\0abcdef";
+
+	ck_assert_str_eq(transcode(&a, "ISO-8859-1", in, sizeof(in) - 1),
+	    "0123456789");
+	ck_assert_str_eq(transcode(&a, "ISO-8859-1", in + 3, 3), "345");
+	arena_reset(&a);
+}
+END_TEST
+
+START_TEST (utf16_honors_byte_order_mark)
+{
+	unsigned char	le[] = {0xff, 0xfe, 'A', 0, 0xe9, 0, 0xac, 0x20};
+	unsigned char	be[] = {0xfe, 0xff, 0, 'A', 0, 0xe9, 0x20, 0xac};
+
+	ck_assert_str_eq(transcode(&a, "UTF-16", le, sizeof(le)),
+	    "A\xc3\xa9\xe2\x82\xac");
+	ck_assert_str_eq(transcode(&a, "UTF-16", be, sizeof(be)),
+	    "A\xc3\xa9\xe2\x82\xac");
+	arena_reset(&a);
+}
+END_TEST
+
+START_TEST (utf16_handles_surrogates)
+{
+	/* U+1F600, then an unpaired low surrogate. */
+	unsigned char	be[] = {0xd8, 0x3d, 0xde, 0x00, 0xdc, 0x00, 0, 'x'};
+
+	ck_assert_str_eq(transcode(&a, "UTF-16BE", be, sizeof(be)),
+	    "\xf0\x9f\x98\x80\xef\xbf\xbdx");
+	arena_reset(&a);
+}
+END_TEST
+
+START_TEST (other_charsets_use_iconv)
+{
+	unsigned char	in[] = "\x80 and \x80";
+
+	ck_assert_str_eq(transcode(&a, "CP1252", in, sizeof(in) - 1),
+	    "\xe2\x82\xac and \xe2\x82\xac");
+	ck_assert_str_eq(transcode(&a, "CP1252", in, 1), "\xe2\x82\xac");
+	ck_assert_ptr_eq(transcode(&a, "NO-SUCH-CHARSET", in, 1), NULL);
+	arena_reset(&a);
+}
+END_TEST
+
+Suite
+*transcode_suite(void)
+{
+	Suite *s;
+	TCase *tc_transcode;
+
+	s = suite_create("Transcode");
+	tc_transcode = tcase_create("To UTF-8");
+
+	tcase_add_test(tc_transcode, latin1_is_converted);
+	tcase_add_test(tc_transcode, latin1_stops_at_null);
+	tcase_add_test(tc_transcode, utf16_honors_byte_order_mark);
+	tcase_add_test(tc_transcode, utf16_handles_surrogates);
+	tcase_add_test(tc_transcode, other_charsets_use_iconv);
+	suite_add_tcase(s, tc_transcode);
+
+	return (s);
+}
+
+int
+main(void)
+{
+	int	no_failed;
+	Suite	*s;
+	SRunner	*sr;
+
+	s = transcode_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	no_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return ((no_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
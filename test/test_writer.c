@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+START_TEST (writer_writes_everything_in_order)
+{
+	struct writer	w;
+	unsigned char	chunk[1000], *back;
+	size_t		total = 3 * WRITER_BUF_SIZE + 123, done, n, i;
+	int		fd;
+
+	memset(&w, 0, sizeof(w));
+	fd = open("./scratchspace/writer.out", O_RDWR|O_CREAT|O_TRUNC, 0644);
+	ck_assert_int_ne(fd, -1);
+	ck_assert_int_eq(writer_start(&w, fd), 0);
+	/* Chunks don't line up with the buffers. */
+	for (done = 0; done < total; done += n) {
+		n = total - done < sizeof(chunk) ? total - done : sizeof(chunk);
+		for (i = 0; i < n; i++)
+			chunk[i] = (done + i) % 251;
+		ck_assert_int_eq(writer_write(&w, chunk, n), 0);
+	}
+	ck_assert_int_eq(writer_finish(&w), 0);
+	ck_assert_int_eq(lseek(fd, 0, SEEK_END), total);
+	back = malloc(total);
+	ck_assert_ptr_ne(back, NULL);
+	ck_assert_int_eq(pread(fd, back, total, 0), total);
+	for (i = 0; i < total; i++)
+		if (back[i] != i % 251)
+			break;
+	ck_assert_int_eq(i, total);
+	free(back);
+	close(fd);
+}
+END_TEST
+
+START_TEST (writer_reports_failed_writes)
+{
+	struct writer	w;
+	char		chunk[4096];
+	size_t		done;
+	int		pfd[2];
+
+	memset(&w, 0, sizeof(w));
+	memset(chunk, 0, sizeof(chunk));
+	signal(SIGPIPE, SIG_IGN);
+	ck_assert_int_eq(pipe(pfd), 0);
+	close(pfd[0]);
+	ck_assert_int_eq(writer_start(&w, pfd[1]), 0);
+	/* The error shows up once the thread gets to a full buffer. */
+	for (done = 0; done < 4 * WRITER_BUF_SIZE; done += sizeof(chunk))
+		if (writer_write(&w, chunk, sizeof(chunk)) == -1)
+			break;
+	ck_assert_int_eq(writer_finish(&w), -1);
+	close(pfd[1]);
+}
+END_TEST
+
+Suite
+*writer_suite(void)
+{
+	Suite *s;
+	TCase *tc_writer;
+
+	s = suite_create("Writer");
+	tc_writer = tcase_create("Writer thread");
+
+	tcase_add_test(tc_writer, writer_writes_everything_in_order);
+	tcase_add_test(tc_writer, writer_reports_failed_writes);
+	suite_add_tcase(s, tc_writer);
+
+	return (s);
+}
+
+int
+main(void)
+{
+	int	no_failed;
+	Suite	*s;
+	SRunner	*sr;
+
+	s = writer_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	no_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return ((no_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static const char	*event_names[TR_SENTINEL] = {
+	"read_cb",
+	"write_cb_sndio",
+	"sbuf_put",
+	"sbuf_sio_write",
+	"fill_inbuf",
+	"process_events",
+};
+
+const char *
+trace_event_name(uint32_t event)
+{
+	if (event >= TR_SENTINEL)
+		return ("unknown");
+	return (event_names[event]);
+}
+
+#ifdef PNP_TRACE
+
+static struct trace_rec	ring[TRACE_RING_SIZE];
+static uint64_t		nrec;
+static int		trace_fd = -1, registered;
+
+/*
+ * trace_init: Empty the ring and open the dump file. This has to happen
+ * before pledge(2), since the child can't open files afterwards. The ring
+ * is dumped automatically on exit(3), but not on _exit(2).
+ */
+void
+trace_init(void)
+{
+	char	path[32];
+
+	nrec = 0;
+	if (trace_fd != -1)
+		close(trace_fd);
+	snprintf(path, sizeof(path), "pnp-%d.trace", (int)getpid());
+	trace_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (!registered && atexit(trace_dump) == 0)
+		registered = 1;
+}
+
+void
+trace_event(uint32_t event, int64_t a, int64_t b)
+{
+	struct trace_rec	*rec;
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec = &ring[nrec++ & (TRACE_RING_SIZE - 1)];
+	rec->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->event = event;
+	rec->a = a;
+	rec->b = b;
+}
+
+/*
+ * trace_dump: Write the ring to the dump file, oldest record first. The
+ * file is overwritten on every call, so it may be called repeatedly.
+ */
+void
+trace_dump(void)
+{
+	struct trace_hdr	hdr;
+	size_t			start, count;
+	off_t			off;
+
+	if (trace_fd == -1)
+		return;
+	count = nrec < TRACE_RING_SIZE ? nrec : TRACE_RING_SIZE;
+	start = nrec < TRACE_RING_SIZE ? 0 : nrec & (TRACE_RING_SIZE - 1);
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.pid = getpid();
+	hdr.nrec = count;
+	if (ftruncate(trace_fd, 0) == -1 ||
+	    pwrite(trace_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return;
+	off = sizeof(hdr);
+	if (start + count > TRACE_RING_SIZE) {
+		pwrite(trace_fd, ring + start,
+		    (TRACE_RING_SIZE - start) * sizeof(ring[0]), off);
+		off += (TRACE_RING_SIZE - start) * sizeof(ring[0]);
+		count -= TRACE_RING_SIZE - start;
+		start = 0;
+	}
+	pwrite(trace_fd, ring + start, count * sizeof(ring[0]), off);
+}
+
+#endif /* PNP_TRACE */
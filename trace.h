@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_TRACE_H
+#define PNP_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Tracepoints for the hot paths. They are only compiled in if PNP_TRACE is
+ * defined (make TRACE=-DPNP_TRACE). Every process records into its own
+ * ring buffer, which is written to pnp-<pid>.trace by trace_dump(). The
+ * files can be printed with pnptrace(1).
+ */
+
+#define TRACE_MAGIC		"PNPTRACE"
+#define TRACE_VERSION		1
+#define TRACE_RING_SIZE		32768 /* Records, must be a power of two. */
+
+enum {
+	TR_READ_CB,		/* a = bytes in inbuf, b = bytes returned */
+	TR_WRITE_CB_SNDIO,	/* a = blocksize, b = free frames in sbuf */
+	TR_SBUF_PUT,		/* a = free frames, b = frames stored */
+	TR_SBUF_SIO_WRITE,	/* a = frames offered, b = frames written */
+	TR_FILL_INBUF,		/* a = bytes read, b = free bytes in inbuf */
+	TR_PROCESS_EVENTS,	/* a = ready fds, b = revents of pfd[0..1] */
+	TR_SENTINEL,
+};
+
+/* The dump file consists of a header followed by nrec records. */
+struct trace_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	pid;
+	uint64_t	nrec;
+};
+
+struct trace_rec {
+	uint64_t	ts;	/* CLOCK_MONOTONIC in ns. */
+	uint32_t	event;
+	uint32_t	reserved;
+	int64_t		a, b;
+};
+
+const char	*trace_event_name(uint32_t);
+
+#ifdef PNP_TRACE
+void		trace_init(void);
+void		trace_event(uint32_t, int64_t, int64_t);
+void		trace_dump(void);
+
+#define TRACE_INIT()		trace_init()
+#define TRACE(ev, a, b)		trace_event((ev), (a), (b))
+#define TRACE_DUMP()		trace_dump()
+#else
+#define TRACE_INIT()		do { } while (0)
+#define TRACE(ev, a, b)		do { } while (0)
+#define TRACE_DUMP()		do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Conversion of tag strings to UTF-8. The encodings that ID3v2 allows
+ * (ISO-8859-1, UTF-16 with BOM, UTF-16BE and UTF-8) are converted here;
+ * anything else goes through iconv(3).
+ */
+
+#include <errno.h>
+#include <iconv.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "transcode.h"
+
+#define REPLACEMENT_CHAR	0xfffd
+
+/* Bytes with the high bit set, and a test for a zero byte in a word. */
+#define HIGH_BITS	0x8080808080808080ULL
+#define LOW_BITS	0x0101010101010101ULL
+#define HAS_ZERO(w)	(((w) - LOW_BITS) & ~(w) & HIGH_BITS)
+
+static size_t	latin1_to_utf8(char *, const unsigned char *, size_t);
+static size_t	utf16_to_utf8(char *, const unsigned char *, size_t, int);
+static size_t	put_utf8(char *, uint32_t);
+static char	*iconv_to_utf8(struct arena *, const char *,
+		    const unsigned char *, size_t);
+
+/*
+ * transcode: Convert len bytes of text in charset from to a null-terminated
+ * UTF-8 string allocated from the arena. The text ends at the first null
+ * character, if there is one. Returns NULL and sets errno on failure.
+ */
+char *
+transcode(struct arena *a, const char *from, const unsigned char *src,
+    size_t len)
+{
+	char	*dst;
+	size_t	n;
+
+	if (strcmp(from, "ISO-8859-1") == 0) {
+		/* Every byte becomes at most two. */
+		if (len > (SIZE_MAX - 1) / 2)
+			goto toolong;
+		if ((dst = arena_alloc(a, 2*len + 1)) == NULL)
+			return (NULL);
+		n = latin1_to_utf8(dst, src, len);
+	}
+	else if (strcmp(from, "UTF-16") == 0 || strcmp(from, "UTF-16BE") == 0) {
+		/*
+		 * A code unit becomes at most three bytes, a surrogate pair
+		 * (two units) four.
+		 */
+		if (len > (SIZE_MAX - 1) / 2)
+			goto toolong;
+		if ((dst = arena_alloc(a, len/2*3 + 1)) == NULL)
+			return (NULL);
+		n = utf16_to_utf8(dst, src, len, strcmp(from, "UTF-16") == 0);
+	}
+	else if (strcmp(from, "UTF-8") == 0)
+		return (arena_strndup(a, (const char *)src, len));
+	else
+		return (iconv_to_utf8(a, from, src, len));
+	dst[n] = '\0';
+	return (dst);
+
+toolong:
+	errno = ENOMEM;
+	return (NULL);
+}
+
+static size_t
+latin1_to_utf8(char *dst, const unsigned char *src, size_t len)
+{
+	uint64_t	w;
+	size_t		i = 0, o = 0;
+
+	while (i < len) {
+		/* Copy runs of ASCII eight bytes at a time. */
+		if (len - i >= sizeof(w)) {
+			memcpy(&w, src + i, sizeof(w));
+			if ((w & HIGH_BITS) == 0 && !HAS_ZERO(w)) {
+				memcpy(dst + o, &w, sizeof(w));
+				i += sizeof(w);
+				o += sizeof(w);
+				continue;
+			}
+		}
+		if (src[i] == '\0')
+			break;
+		if (src[i] < 0x80)
+			dst[o++] = src[i];
+		else {
+			dst[o++] = 0xc0 | (src[i] >> 6);
+			dst[o++] = 0x80 | (src[i] & 0x3f);
+		}
+		i++;
+	}
+	return (o);
+}
+
+/*
+ * utf16_to_utf8: If bom is set, the byte order is taken from a byte order
+ * mark; without one, the text is big endian. Unpaired surrogates are
+ * replaced by U+FFFD.
+ */
+static size_t
+utf16_to_utf8(char *dst, const unsigned char *src, size_t len, int bom)
+{
+	uint32_t	c, lo;
+	size_t		i = 0, o = 0;
+	int		le = 0;
+
+	if (bom && len >= 2) {
+		if (src[0] == 0xff && src[1] == 0xfe) {
+			le = 1;
+			i = 2;
+		}
+		else if (src[0] == 0xfe && src[1] == 0xff)
+			i = 2;
+	}
+	for (; i + 1 < len; i += 2) {
+		c = le ? src[i] | src[i+1] << 8 : src[i] << 8 | src[i+1];
+		if (c == 0)
+			break;
+		if (c < 0x80) {
+			dst[o++] = c;
+			continue;
+		}
+		if (c >= 0xd800 && c < 0xdc00 && i + 3 < len) {
+			lo = le ? src[i+2] | src[i+3] << 8
+			    : src[i+2] << 8 | src[i+3];
+			if (lo >= 0xdc00 && lo < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) +
+				    (lo - 0xdc00);
+				i += 2;
+			}
+		}
+		if (c >= 0xd800 && c < 0xe000)
+			c = REPLACEMENT_CHAR;
+		o += put_utf8(dst + o, c);
+	}
+	return (o);
+}
+
+/* put_utf8: Encode c, which is at least 0x80, and return its length. */
+static size_t
+put_utf8(char *dst, uint32_t c)
+{
+	if (c < 0x800) {
+		dst[0] = 0xc0 | (c >> 6);
+		dst[1] = 0x80 | (c & 0x3f);
+		return (2);
+	}
+	if (c < 0x10000) {
+		dst[0] = 0xe0 | (c >> 12);
+		dst[1] = 0x80 | ((c >> 6) & 0x3f);
+		dst[2] = 0x80 | (c & 0x3f);
+		return (3);
+	}
+	dst[0] = 0xf0 | (c >> 18);
+	dst[1] = 0x80 | ((c >> 12) & 0x3f);
+	dst[2] = 0x80 | ((c >> 6) & 0x3f);
+	dst[3] = 0x80 | (c & 0x3f);
+	return (4);
+}
+
+/*
+ * iconv_to_utf8: The fallback. The descriptor is kept open as long as the
+ * same charset is asked for.
+ */
+static char *
+iconv_to_utf8(struct arena *a, const char *from, const unsigned char *src,
+    size_t len)
+{
+	static iconv_t	cd = (iconv_t)-1;
+	static char	cd_from[32];
+	char		*dst, *in, *out;
+	size_t		inlen, outlen;
+
+	if (cd == (iconv_t)-1 || strcmp(from, cd_from) != 0) {
+		if (cd != (iconv_t)-1)
+			iconv_close(cd);
+		if (strlcpy(cd_from, from, sizeof(cd_from)) >= sizeof(cd_from)
+		    || (cd = iconv_open("UTF-8", from)) == (iconv_t)-1) {
+			cd = (iconv_t)-1;
+			errno = EINVAL;
+			return (NULL);
+		}
+	}
+	else
+		/* Reset the conversion state. */
+		iconv(cd, NULL, NULL, NULL, NULL);
+	if (len > (SIZE_MAX - 1) / 4) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	outlen = 4*len;
+	if ((dst = arena_alloc(a, outlen + 1)) == NULL)
+		return (NULL);
+	in = (char *)src;
+	inlen = len;
+	out = dst;
+	if (iconv(cd, &in, &inlen, &out, &outlen) == (size_t)-1)
+		return (NULL);
+	*out = '\0';
+	return (dst);
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+static int	hand_off(struct writer *);
+static void	*writer_main(void *);
+static int	write_all(int, const char *, size_t);
+
+/*
+ * writer_start: Start a thread that writes to fd. The buffers are kept for
+ * the next file. Returns 0 on success and -1 on error.
+ */
+int
+writer_start(struct writer *w, int fd)
+{
+	int	i;
+
+	for (i = 0; i < WRITER_BUFS; i++) {
+		if (w->buf[i].data == NULL
+		    && (w->buf[i].data = malloc(WRITER_BUF_SIZE)) == NULL)
+			return (-1);
+		w->buf[i].len = 0;
+	}
+	w->fd = fd;
+	w->fill = w->head = w->nfull = 0;
+	w->done = w->error = 0;
+	if (pthread_mutex_init(&w->mtx, NULL) != 0)
+		return (-1);
+	if (pthread_cond_init(&w->cond, NULL) != 0) {
+		pthread_mutex_destroy(&w->mtx);
+		return (-1);
+	}
+	if (pthread_create(&w->thread, NULL, writer_main, w) != 0) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mtx);
+		return (-1);
+	}
+	w->running = 1;
+	return (0);
+}
+
+/*
+ * writer_write: Queue len bytes. This only waits if every buffer is full.
+ * Returns -1 if an earlier write failed.
+ */
+int
+writer_write(struct writer *w, const void *data, size_t len)
+{
+	const char	*p = data;
+	size_t		n;
+
+	while (len > 0) {
+		n = WRITER_BUF_SIZE - w->buf[w->fill].len;
+		if (n > len)
+			n = len;
+		memcpy(w->buf[w->fill].data + w->buf[w->fill].len, p, n);
+		w->buf[w->fill].len += n;
+		p += n;
+		len -= n;
+		if (w->buf[w->fill].len == WRITER_BUF_SIZE
+		    && hand_off(w) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * writer_finish: Write out what is queued and stop the thread. Returns -1
+ * if anything couldn't be written. Does nothing if the thread isn't
+ * running.
+ */
+int
+writer_finish(struct writer *w)
+{
+	int	error;
+
+	if (!w->running)
+		return (0);
+	pthread_mutex_lock(&w->mtx);
+	/* hand_off() left a free buffer, so this one can go too. */
+	if (w->buf[w->fill].len > 0)
+		w->nfull++;
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+	pthread_join(w->thread, NULL);
+	error = w->error;
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mtx);
+	w->running = 0;
+	return (error ? -1 : 0);
+}
+
+/* hand_off: Queue the buffer being filled and move on to the next one. */
+static int
+hand_off(struct writer *w)
+{
+	int	error;
+
+	pthread_mutex_lock(&w->mtx);
+	w->nfull++;
+	pthread_cond_signal(&w->cond);
+	while (w->nfull == WRITER_BUFS && !w->error)
+		pthread_cond_wait(&w->cond, &w->mtx);
+	error = w->error;
+	pthread_mutex_unlock(&w->mtx);
+	/* After an error, the thread doesn't look at the data any more. */
+	w->fill = (w->fill + 1) % WRITER_BUFS;
+	w->buf[w->fill].len = 0;
+	return (error ? -1 : 0);
+}
+
+static void *
+writer_main(void *arg)
+{
+	struct writer	*w = arg;
+	int		head, error;
+
+	pthread_mutex_lock(&w->mtx);
+	while (1) {
+		while (w->nfull == 0 && !w->done)
+			pthread_cond_wait(&w->cond, &w->mtx);
+		if (w->nfull == 0)
+			break;
+		head = w->head;
+		error = w->error;
+		pthread_mutex_unlock(&w->mtx);
+		/* After an error, the rest is thrown away. */
+		if (!error && write_all(w->fd, w->buf[head].data,
+		    w->buf[head].len) == -1)
+			error = 1;
+		pthread_mutex_lock(&w->mtx);
+		w->error = error;
+		w->head = (head + 1) % WRITER_BUFS;
+		w->nfull--;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mtx);
+	return (NULL);
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t	nw;
+
+	while (len > 0) {
+		if ((nw = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buf += nw;
+		len -= nw;
+	}
+	return (0);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2017 Max Fillinger
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PNP_WRITER_H
+#define PNP_WRITER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define WRITER_BUFS	2
+#define WRITER_BUF_SIZE	(1024 * 1024)
+
+/*
+ * Writer thread for decoding to a file. The decoder fills one buffer while
+ * the thread writes out the others, so a slow disk or network mount only
+ * holds up the decoder once all of them are waiting to be written. The
+ * buffers are full[head] to full[head + nfull - 1], modulo WRITER_BUFS;
+ * the decoder fills the one after those.
+ */
+struct writer {
+	int		fd, running;
+	pthread_t	thread;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	struct {
+		char	*data;
+		size_t	len;
+	}		buf[WRITER_BUFS];
+	int		fill, head, nfull;
+	int		done, error;	/* Protected by mtx. */
+};
+
+int	writer_start(struct writer *, int);
+int	writer_write(struct writer *, const void *, size_t);
+int	writer_finish(struct writer *);
+
+#endif